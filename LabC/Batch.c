@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include "Batch.h"
+
+/* A PSI trigger ("some <stall us> <window us>" written to /proc/pressure/<resource>) makes */
+/* the file raise POLLPRI whenever tasks stalled longer than that within a window. While */
+/* jobs are queued the scheduler sleeps in poll on the triggers: an event holds releases back */
+/* for a window, and a full window without one means pressure is below the limits again. */
+/* Nothing is sampled, except the load average (which has no trigger) while it is too high */
+
+/* Events come at most once a window, so "no event for a window" needs some slack */
+#define BATCH_QUIET_MS (BATCH_WINDOW_MS * 3 / 2)
+
+typedef struct job {
+    void *job;
+    char *label;
+    pid_t pid;
+    struct job *next;
+} job;
+
+static const char *resource_names[BATCH_LIMITS] = {"cpu", "memory", "io", "load"};
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t batch_thread;
+static int batch_running = 0;
+static int wake_fd = -1;
+static pid_t (*launch_job)(void *job);
+static double limits[BATCH_LIMITS] = {20, 10, 20, 0};
+static int limits_changed = 1;
+static job *queue = NULL, **queue_tail = &queue;
+static job *started = NULL, **started_tail = &started;
+
+/* Trigger state, only touched by the scheduler thread */
+static int triggers[BATCH_LOAD] = {-1, -1, -1};
+static long long armed_ms[BATCH_LOAD];
+
+static long long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* avg10 of the "some" line, or -1 if PSI is not available */
+static double readPressure(int resource) {
+    char path[64];
+    double avg = -1;
+    FILE *f;
+    snprintf(path, sizeof(path), "/proc/pressure/%s", resource_names[resource]);
+    f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    if (fscanf(f, "some avg10=%lf", &avg) != 1)
+        avg = -1;
+    fclose(f);
+    return avg;
+}
+
+static double readLoad() {
+    double load = 0;
+    FILE *f = fopen("/proc/loadavg", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%lf", &load) != 1)
+        load = 0;
+    fclose(f);
+    return load;
+}
+
+static void armTriggers(const double *limit) {
+    int r;
+    for (r = 0; r < BATCH_LOAD; r++) {
+        char path[64], spec[64];
+        long stall = limit[r] * BATCH_WINDOW_MS * 10;  /* percent of the window, in us */
+        if (triggers[r] != -1)
+            close(triggers[r]);
+        triggers[r] = -1;
+        if (stall <= 0 || stall >= BATCH_WINDOW_MS * 1000L)
+            continue;
+
+        snprintf(path, sizeof(path), "/proc/pressure/%s", resource_names[r]);
+        snprintf(spec, sizeof(spec), "some %ld %ld", stall, BATCH_WINDOW_MS * 1000L);
+        triggers[r] = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (triggers[r] != -1 && write(triggers[r], spec, strlen(spec) + 1) == -1) {
+            close(triggers[r]);
+            triggers[r] = -1;
+        }
+        armed_ms[r] = nowMs();
+    }
+}
+
+/* Checked just before a release. A trigger armed for a whole window has already said all */
+/* there is to say; the current figures are only read where there is no such trigger */
+static int overLimit(const double *limit) {
+    int r;
+    for (r = 0; r < BATCH_LOAD; r++) {
+        if (limit[r] <= 0 || (triggers[r] != -1 && nowMs() - armed_ms[r] >= BATCH_QUIET_MS))
+            continue;
+        if (readPressure(r) >= limit[r])
+            return 1;
+    }
+    return limit[BATCH_LOAD] > 0 && readLoad() >= limit[BATCH_LOAD];
+}
+
+static void *schedulerLoop(void *arg) {
+    long long heldUntil = 0;
+    for (;;) {
+        struct pollfd fds[1 + BATCH_LOAD];
+        double limit[BATCH_LIMITS];
+        int timeout = -1;
+        int r, queued;
+        job *next;
+
+        pthread_mutex_lock(&batch_lock);
+        if (limits_changed) {
+            memcpy(limit, limits, sizeof(limit));
+            armTriggers(limit);
+            limits_changed = 0;
+        }
+        memcpy(limit, limits, sizeof(limit));
+        queued = queue != NULL;
+        pthread_mutex_unlock(&batch_lock);
+
+        if (queued)
+            timeout = heldUntil > nowMs() ? heldUntil - nowMs() : 0;
+        fds[0].fd = wake_fd;
+        fds[0].events = POLLIN;
+        for (r = 0; r < BATCH_LOAD; r++) {
+            fds[1 + r].fd = triggers[r];
+            fds[1 + r].events = POLLPRI;
+        }
+        if (poll(fds, 1 + BATCH_LOAD, timeout) == -1 && errno != EINTR)
+            break;
+
+        if (fds[0].revents & POLLIN) {
+            unsigned long long count;
+            if (read(wake_fd, &count, sizeof(count)) == -1)
+                continue;
+        }
+        for (r = 0; r < BATCH_LOAD; r++) {
+            if (fds[1 + r].revents & POLLPRI)
+                heldUntil = nowMs() + BATCH_QUIET_MS;
+            if (fds[1 + r].revents & POLLERR) {
+                /* the trigger went away (e.g. its cgroup was removed): fall back to reading */
+                close(triggers[r]);
+                triggers[r] = -1;
+            }
+        }
+        if (!queued || nowMs() < heldUntil)
+            continue;
+        if (overLimit(limit)) {
+            heldUntil = nowMs() + BATCH_QUIET_MS;
+            continue;
+        }
+
+        pthread_mutex_lock(&batch_lock);
+        next = queue;
+        if (next != NULL) {
+            queue = next->next;
+            if (queue == NULL)
+                queue_tail = &queue;
+        }
+        pthread_mutex_unlock(&batch_lock);
+        if (next == NULL)
+            continue;
+
+        next->pid = launch_job(next->job);
+        next->next = NULL;
+        pthread_mutex_lock(&batch_lock);
+        *started_tail = next;
+        started_tail = &next->next;
+        pthread_mutex_unlock(&batch_lock);
+        heldUntil = nowMs() + BATCH_SETTLE_MS;
+    }
+    return NULL;
+}
+
+int batchInit(pid_t (*launch)(void *job)) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (batch_running)
+        return 0;
+    launch_job = launch;
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd == -1)
+        return -1;
+    /* more runnable tasks than CPUs means the machine is saturated */
+    limits[BATCH_LOAD] = cpus > 0 ? cpus : 1;
+    if (pthread_create(&batch_thread, NULL, schedulerLoop, NULL) != 0) {
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    pthread_detach(batch_thread);
+    batch_running = 1;
+    return 0;
+}
+
+static void wakeScheduler() {
+    unsigned long long one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1)
+        perror("batch: wake failed");
+}
+
+void batchSubmit(void *item, const char *label) {
+    job *j = calloc(1, sizeof(job));
+    j->job = item;
+    j->label = strdup(label);
+    pthread_mutex_lock(&batch_lock);
+    *queue_tail = j;
+    queue_tail = &j->next;
+    pthread_mutex_unlock(&batch_lock);
+    wakeScheduler();
+}
+
+void batchSetLimit(int resource, double limit) {
+    pthread_mutex_lock(&batch_lock);
+    limits[resource] = limit;
+    limits_changed = 1;
+    pthread_mutex_unlock(&batch_lock);
+    if (batch_running)
+        wakeScheduler();
+}
+
+void *batchTakeStarted(pid_t *pid) {
+    job *j;
+    void *item;
+    pthread_mutex_lock(&batch_lock);
+    j = started;
+    if (j != NULL) {
+        started = j->next;
+        if (started == NULL)
+            started_tail = &started;
+    }
+    pthread_mutex_unlock(&batch_lock);
+    if (j == NULL)
+        return NULL;
+    item = j->job;
+    *pid = j->pid;
+    free(j->label);
+    free(j);
+    return item;
+}
+
+void batchPrint(FILE *out) {
+    job *j;
+    int r, count = 0;
+    pthread_mutex_lock(&batch_lock);
+    for (r = 0; r < BATCH_LIMITS; r++) {
+        double now = r == BATCH_LOAD ? readLoad() : readPressure(r);
+        fprintf(out, "%-7s limit ", resource_names[r]);
+        if (limits[r] > 0)
+            fprintf(out, r == BATCH_LOAD ? "%6.2f" : "%5.1f%%", limits[r]);
+        else
+            fprintf(out, "%6s", "off");
+        if (now >= 0)
+            fprintf(out, r == BATCH_LOAD ? "  now %.2f\n" : "  now %.2f%%\n", now);
+        else
+            fprintf(out, "  now n/a\n");
+    }
+    for (j = queue; j != NULL; j = j->next)
+        fprintf(out, "queued %d: %s\n", ++count, j->label);
+    pthread_mutex_unlock(&batch_lock);
+}
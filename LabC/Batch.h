@@ -0,0 +1,24 @@
+#define BATCH_CPU 0             /* limits: % of the window some task waited for a CPU */
+#define BATCH_MEMORY 1          /* ... for memory */
+#define BATCH_IO 2              /* ... for I/O */
+#define BATCH_LOAD 3            /* 1-minute load average */
+#define BATCH_LIMITS 4
+#define BATCH_WINDOW_MS 2000    /* PSI trigger window (unprivileged triggers need a multiple of 2s) */
+#define BATCH_SETTLE_MS 500     /* wait after a release, so the job shows up in the pressure figures */
+
+/* Starts the scheduler thread. launch is called on that thread for every released job */
+/* and returns the pid that runs it (or -1); the pid is handed back by batchTakeStarted */
+int batchInit(pid_t (*launch)(void *job));
+
+/* Queues job, to be released once cpu, memory and io pressure and the load average are */
+/* all below their limits. label is what batchPrint shows for it */
+void batchSubmit(void *job, const char *label);
+
+/* Sets the limit of a resource (BATCH_CPU ...); 0 removes it */
+void batchSetLimit(int resource, double limit);
+
+/* Returns a job the scheduler has started, storing its pid, or NULL if there is none left */
+void *batchTakeStarted(pid_t *pid);
+
+/* Prints the limits, the current pressure and the queued jobs */
+void batchPrint(FILE *out);
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "Bench.h"
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Linear interpolation between the closest ranks of a sorted array */
+static double quantile(const double *sorted, int n, double q) {
+    double pos = q * (n - 1);
+    int lo = (int)pos;
+    if (lo + 1 >= n)
+        return sorted[n - 1];
+    return sorted[lo] + (pos - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+void benchSummarize(double *samples, int n, benchStats *stats) {
+    double sum = 0, squares = 0, low, high;
+    int i;
+
+    stats->n = n;
+    stats->outliers = 0;
+    if (n == 0)
+        return;
+    qsort(samples, n, sizeof(double), compareDoubles);
+    for (i = 0; i < n; i++)
+        sum += samples[i];
+    stats->mean = sum / n;
+    for (i = 0; i < n; i++)
+        squares += (samples[i] - stats->mean) * (samples[i] - stats->mean);
+    stats->stddev = n > 1 ? sqrt(squares / (n - 1)) : 0;
+    stats->min = samples[0];
+    stats->max = samples[n - 1];
+    stats->median = quantile(samples, n, 0.5);
+    stats->p99 = quantile(samples, n, 0.99);
+    stats->q1 = quantile(samples, n, 0.25);
+    stats->q3 = quantile(samples, n, 0.75);
+
+    low = stats->q1 - 1.5 * (stats->q3 - stats->q1);
+    high = stats->q3 + 1.5 * (stats->q3 - stats->q1);
+    for (i = 0; i < n; i++)
+        if (samples[i] < low || samples[i] > high)
+            stats->outliers++;
+}
+
+/* Formats seconds with the unit that keeps the number readable */
+static const char *formatTime(double seconds, char *buf, int size) {
+    if (seconds < 1e-3)
+        snprintf(buf, size, "%.1f µs", seconds * 1e6);
+    else if (seconds < 1)
+        snprintf(buf, size, "%.2f ms", seconds * 1e3);
+    else
+        snprintf(buf, size, "%.3f s", seconds);
+    return buf;
+}
+
+void benchPrint(const char *name, const benchStats *stats, double user, double sys, int failed, FILE *out) {
+    char a[32], b[32], c[32], d[32];
+
+    fprintf(out, "Benchmark: %s\n", name);
+    if (stats->n == 0) {
+        fprintf(out, "  no measured runs\n");
+        return;
+    }
+    fprintf(out, "  Time (mean ± σ):   %10s ± %s    [User: %s, System: %s]\n", formatTime(stats->mean, a, sizeof(a)),
+            formatTime(stats->stddev, b, sizeof(b)), formatTime(user, c, sizeof(c)), formatTime(sys, d, sizeof(d)));
+    fprintf(out, "  Range (min … max): %10s … %s    %d runs\n", formatTime(stats->min, a, sizeof(a)),
+            formatTime(stats->max, b, sizeof(b)), stats->n);
+    fprintf(out, "  Median / p99:      %10s / %s\n", formatTime(stats->median, a, sizeof(a)),
+            formatTime(stats->p99, b, sizeof(b)));
+    if (stats->outliers > 0)
+        fprintf(out, "  Warning: %d statistical outlier%s (outside 1.5 IQR); the system may have been busy\n",
+                stats->outliers, stats->outliers == 1 ? "" : "s");
+    if (failed > 0)
+        fprintf(out, "  Warning: %d run%s exited with a non-zero status\n", failed, failed == 1 ? "" : "s");
+}
+
+void benchCompare(char **names, const benchStats *stats, int count, FILE *out) {
+    int fastest = -1, i;
+    for (i = 0; i < count; i++)
+        if (stats[i].n > 0 && (fastest == -1 || stats[i].mean < stats[fastest].mean))
+            fastest = i;
+    if (fastest == -1 || count < 2)
+        return;
+
+    fprintf(out, "Summary\n  %s ran\n", names[fastest]);
+    for (i = 0; i < count; i++) {
+        if (i == fastest || stats[i].n == 0)
+            continue;
+        /* the relative errors of the two means add up in quadrature */
+        double ratio = stats[i].mean / stats[fastest].mean;
+        double error = ratio * sqrt(pow(stats[i].stddev / stats[i].mean, 2) +
+                                    pow(stats[fastest].stddev / stats[fastest].mean, 2));
+        fprintf(out, "    %.2f ± %.2f times faster than %s\n", ratio, error, names[i]);
+    }
+}
@@ -0,0 +1,19 @@
+#define BENCH_DEFAULT_RUNS 10
+#define BENCH_MAX_COMMANDS 16
+
+typedef struct benchStats {
+    int n;                      /* number of samples */
+    double mean, stddev;        /* stddev is the sample standard deviation */
+    double min, max, median, p99;
+    double q1, q3;              /* quartiles, for the outlier fences */
+    int outliers;               /* samples outside [q1 - 1.5 IQR, q3 + 1.5 IQR] */
+} benchStats;
+
+/* Computes the statistics of n samples (in seconds). Sorts samples in place */
+void benchSummarize(double *samples, int n, benchStats *stats);
+
+/* Prints the result block of one command; user and sys are mean CPU seconds per run */
+void benchPrint(const char *name, const benchStats *stats, double user, double sys, int failed, FILE *out);
+
+/* Prints how much faster the fastest of the commands was than each of the others */
+void benchCompare(char **names, const benchStats *stats, int count, FILE *out);
@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include "FastCopy.h"
+
+#define COPY_CHUNK (1L << 30)      /* the syscalls cap a single call below 2 GiB anyway */
+#define SPLICE_CHUNK (1L << 20)
+#define BUFFER_CHUNK (128 * 1024)
+
+static const char *method_names[] = {"clone", "copy_file_range", "sendfile", "splice", "read/write"};
+
+/* errno values meaning "this method does not apply to these fds", as opposed to an I/O error */
+static int unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF ||
+           err == ENOTTY || err == EPERM;
+}
+
+static int tryClone(int in, int out) {
+    struct stat st;
+    if (fstat(in, &st) == -1 || !S_ISREG(st.st_mode) || ioctl(out, FICLONE, in) == -1)
+        return -1;
+    /* the clone does not move the offsets; leave out positioned for a following append */
+    lseek(out, 0, SEEK_END);
+    lseek(in, 0, SEEK_END);
+    return 0;
+}
+
+/* Each of these returns 1 when done, 0 if the method did not apply before anything was */
+/* copied, and -1 on an error after (or instead of) copying */
+static int tryCopyFileRange(int in, int out) {
+    ssize_t n;
+    int copied = 0;
+    while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0)
+        copied = 1;
+    if (n == 0)
+        return 1;
+    return !copied && unsupported(errno) ? 0 : -1;
+}
+
+static int trySendfile(int in, int out) {
+    ssize_t n;
+    int copied = 0;
+    while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0)
+        copied = 1;
+    if (n == 0)
+        return 1;
+    return !copied && unsupported(errno) ? 0 : -1;
+}
+
+static int trySplice(int in, int out) {
+    int pipefd[2], copied = 0, res = -1;
+    ssize_t n;
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        return 0;
+    fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+
+    while ((n = splice(in, NULL, pipefd[1], NULL, SPLICE_CHUNK, SPLICE_F_MOVE)) > 0) {
+        copied = 1;
+        while (n > 0) {
+            ssize_t m = splice(pipefd[0], NULL, out, NULL, n, SPLICE_F_MOVE);
+            if (m <= 0)
+                break;
+            n -= m;
+        }
+        if (n > 0)
+            break;
+    }
+    if (n == 0)
+        res = 1;
+    else if (!copied && unsupported(errno))
+        res = 0;
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return res;
+}
+
+static int readWrite(int in, int out) {
+    char buf[BUFFER_CHUNK];
+    ssize_t n;
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (n > 0) {
+            ssize_t m = write(out, p, n);
+            if (m <= 0)
+                return -1;
+            p += m;
+            n -= m;
+        }
+    }
+    return n == 0 ? 1 : -1;
+}
+
+int copyFd(int in, int out, int clone) {
+    static int (*const methods[])(int, int) = {tryCopyFileRange, trySendfile, trySplice, readWrite};
+    int i, res;
+
+    if (clone && tryClone(in, out) == 0)
+        return COPY_CLONE;
+    for (i = 0; i < 4; i++) {
+        res = methods[i](in, out);
+        if (res == 1)
+            return COPY_FILE_RANGE + i;
+        if (res == -1)
+            return COPY_FAILED;
+    }
+    return COPY_FAILED;
+}
+
+const char *copyMethodName(int method) {
+    return method >= 0 && method <= COPY_READ_WRITE ? method_names[method] : "failed";
+}
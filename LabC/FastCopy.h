@@ -0,0 +1,15 @@
+#define COPY_FAILED -1
+#define COPY_CLONE 0          /* the output shares the input's blocks (reflink) */
+#define COPY_FILE_RANGE 1     /* copy_file_range: in-kernel, possibly offloaded to the filesystem */
+#define COPY_SENDFILE 2       /* sendfile: in-kernel, from the input's page cache */
+#define COPY_SPLICE 3         /* splice through a pipe: in-kernel page moves */
+#define COPY_READ_WRITE 4     /* plain read/write through a userspace buffer */
+
+/* Appends everything readable from in to out at out's current offset, without passing */
+/* the data through userspace when the kernel can avoid it. Methods are tried from the */
+/* cheapest down. clone allows a reflink, which replaces out's content, so it should only */
+/* be set for an empty out. Returns the method that did the copy, or COPY_FAILED (errno set) */
+int copyFd(int in, int out, int clone);
+
+/* Name of a COPY_ method, for debug output */
+const char *copyMethodName(int method);
@@ -0,0 +1,609 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <pthread.h>
+#include "LineParser.h"
+#include "Glob.h"
+
+#define GLOB_DENTS_SIZE (1024 * 1024)  /* one getdents64 call returns thousands of entries */
+#define GLOB_SMALL_SORT 16             /* below this the radix sort finishes with insertion sort */
+#define GLOB_MAX_THREADS 16
+#define OP_LITERAL 0
+#define OP_ANY 1                       /* ? */
+#define OP_CLASS 2                     /* [...] */
+#define OP_STAR 3                      /* * */
+
+typedef struct linuxDirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linuxDirent64;
+
+typedef struct globOp {
+    int type;
+    const char *literal;               /* points into the pattern copy */
+    int len;
+    unsigned char set[32];             /* OP_CLASS: bitmap of the matching bytes */
+} globOp;
+
+/* One path component compiled once and matched against every directory entry */
+typedef struct matcher {
+    globOp *ops;
+    int count;
+    int minLen;                        /* bytes the non-star ops need */
+    int hasStar;
+    int dotOk;                         /* the component itself starts with '.' */
+    int wild;                          /* 0 for a literal component (no directory read needed) */
+    const char *text;                  /* the component as written */
+    int textLen;
+    int recursive;                     /* the component is "**": any number of directories */
+} matcher;
+
+/* A directory still to be matched against components[idx..]; path is relative to the */
+/* pattern's base like the results are */
+typedef struct task {
+    char *path;
+    int idx;
+} task;
+
+/* Each worker keeps its own results and a deque of tasks: it pushes and pops at the tail, */
+/* idle workers steal the oldest (and so largest) subtrees from the head */
+typedef struct worker {
+    pthread_mutex_t lock;
+    task *tasks;
+    int head, tail, capacity;
+    argBuffer *buffer;                 /* NUL-terminated paths, back to back */
+    size_t bufferCapacity;
+    size_t *offsets;                   /* start of each path in buffer->data */
+    int count, offsetCapacity;
+    struct globWalk *walk;
+    int id;
+    pthread_t thread;
+    int started;
+} worker;
+
+typedef struct globWalk {
+    matcher *comps;
+    int ncomps;
+    int dirsOnly;                      /* the pattern ended with '/' */
+    int max;
+    worker *workers;
+    int nworkers;
+    int pending;                       /* tasks pushed but not finished (atomic) */
+    int found;                         /* results over all workers (atomic) */
+    int stop;                          /* set once more than max paths were found (atomic) */
+    pthread_mutex_t idleLock;          /* guards sleeping on work */
+    pthread_cond_t work;               /* signalled when a task is pushed or the walk is over */
+    int idle;                          /* workers waiting on work (atomic) */
+} globWalk;
+
+int globHasMeta(const char *word) {
+    return strpbrk(word, "*?[") != NULL;
+}
+
+/* The ']' closing the class that starts at p, or NULL if it is not closed within the */
+/* component. A ']' right after "[" (or "[!") belongs to the set */
+static char *classEnd(char *p) {
+    char *q = p + 1;
+    if (*q == '!' || *q == '^')
+        q++;
+    return *q ? strchr(q + 1, ']') : NULL;
+}
+
+/* Compiles comp (NUL-terminated, kept alive while the matcher is used). A '[' without */
+/* a closing ']' is taken literally, as sh does */
+static int compile(char *comp, matcher *m) {
+    char *p = comp;
+    m->ops = malloc(sizeof(globOp) * (strlen(comp) + 1));
+    m->count = m->minLen = m->hasStar = m->wild = 0;
+    m->text = comp;
+    m->textLen = strlen(comp);
+    m->dotOk = comp[0] == '.';
+
+    while (*p) {
+        globOp *op = &m->ops[m->count];
+        char *close = *p == '[' ? classEnd(p) : NULL;
+        if (*p == '*') {
+            while (*p == '*')
+                p++;
+            op->type = OP_STAR;
+            m->hasStar = m->wild = 1;
+        } else if (*p == '?') {
+            op->type = OP_ANY;
+            p++;
+            m->minLen++;
+            m->wild = 1;
+        } else if (close != NULL) {
+            int negate = p[1] == '!' || p[1] == '^', c;
+            const unsigned char *q = (const unsigned char *)p + 1 + negate;
+            op->type = OP_CLASS;
+            memset(op->set, 0, sizeof(op->set));
+            for (; q < (const unsigned char *)close; q++) {
+                int last = *q;
+                if (q[1] == '-' && q + 2 < (const unsigned char *)close) {
+                    last = q[2];
+                    for (c = *q; c <= last; c++)
+                        op->set[c >> 3] |= 1 << (c & 7);
+                    q += 2;
+                } else {
+                    op->set[last >> 3] |= 1 << (last & 7);
+                }
+            }
+            if (negate)
+                for (c = 0; c < 32; c++)
+                    op->set[c] = ~op->set[c];
+            p = close + 1;
+            m->minLen++;
+            m->wild = 1;
+        } else {
+            /* a run of literal bytes becomes one op; a lone '[' is part of it */
+            op->type = OP_LITERAL;
+            op->literal = p;
+            do {
+                p++;
+            } while (*p && *p != '*' && *p != '?' && !(*p == '[' && classEnd(p)));
+            op->len = p - op->literal;
+            m->minLen += op->len;
+        }
+        m->count++;
+    }
+    return m->wild;
+}
+
+static int matchName(const matcher *m, const char *name, int len) {
+    int p = 0, star = -1;
+    int s = 0, starS = 0;
+    const globOp *ops = m->ops;
+
+    if (name[0] == '.' && !m->dotOk)
+        return 0;
+    if (len < m->minLen || (!m->hasStar && len != m->minLen))
+        return 0;
+    /* most names are rejected by the fixed ends of the pattern without any backtracking */
+    if (ops[0].type == OP_LITERAL && memcmp(name, ops[0].literal, ops[0].len) != 0)
+        return 0;
+    if (ops[m->count - 1].type == OP_LITERAL &&
+        memcmp(name + len - ops[m->count - 1].len, ops[m->count - 1].literal, ops[m->count - 1].len) != 0)
+        return 0;
+
+    while (s < len || p < m->count) {
+        if (p < m->count) {
+            const globOp *op = &ops[p];
+            unsigned char c = s < len ? name[s] : 0;
+            if (op->type == OP_STAR) {
+                star = p++;
+                starS = s;
+                continue;
+            } else if (s < len && op->type == OP_ANY) {
+                s++;
+                p++;
+                continue;
+            } else if (s < len && op->type == OP_CLASS && (op->set[c >> 3] & (1 << (c & 7)))) {
+                s++;
+                p++;
+                continue;
+            } else if (op->type == OP_LITERAL && len - s >= op->len && memcmp(name + s, op->literal, op->len) == 0) {
+                s += op->len;
+                p++;
+                continue;
+            }
+        }
+        /* mismatch: let the last star swallow one more byte */
+        if (star == -1 || starS >= len)
+            return 0;
+        p = star + 1;
+        s = ++starS;
+    }
+    return 1;
+}
+
+static int addResult(worker *w, const char *path, size_t len) {
+    if (__atomic_add_fetch(&w->walk->found, 1, __ATOMIC_RELAXED) > w->walk->max) {
+        __atomic_store_n(&w->walk->stop, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    if (w->buffer == NULL || w->buffer->size + len + 1 > w->bufferCapacity) {
+        size_t capacity = w->bufferCapacity ? w->bufferCapacity * 2 : 4096;
+        while (capacity < (w->buffer ? w->buffer->size : 0) + len + 1)
+            capacity *= 2;
+        argBuffer *grown = realloc(w->buffer, sizeof(argBuffer) + capacity + 1);
+        if (grown == NULL)
+            return -1;
+        if (w->buffer == NULL) {
+            grown->next = NULL;
+            grown->size = 0;
+        }
+        w->buffer = grown;
+        w->bufferCapacity = capacity;
+    }
+    if (w->count == w->offsetCapacity) {
+        w->offsetCapacity = w->offsetCapacity ? w->offsetCapacity * 2 : 64;
+        w->offsets = realloc(w->offsets, sizeof(size_t) * w->offsetCapacity);
+    }
+    w->offsets[w->count++] = w->buffer->size;
+    memcpy(w->buffer->data + w->buffer->size, path, len + 1);
+    w->buffer->size += len + 1;
+    return 0;
+}
+
+static void pushTask(worker *w, const char *path, int idx) {
+    __atomic_add_fetch(&w->walk->pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->capacity) {
+        if (w->head > 0) {
+            memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(task));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        if (w->tail == w->capacity) {
+            w->capacity = w->capacity ? w->capacity * 2 : 64;
+            w->tasks = realloc(w->tasks, w->capacity * sizeof(task));
+        }
+    }
+    w->tasks[w->tail].path = strdup(path);
+    w->tasks[w->tail++].idx = idx;
+    pthread_mutex_unlock(&w->lock);
+
+    /* an idle worker counts itself before it looks for tasks a last time, so it either */
+    /* sees this one or is counted here */
+    if (__atomic_load_n(&w->walk->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&w->walk->idleLock);
+        pthread_cond_signal(&w->walk->work);
+        pthread_mutex_unlock(&w->walk->idleLock);
+    }
+}
+
+static int takeTask(worker *w, int steal, task *t) {
+    int found = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->head < w->tail) {
+        *t = steal ? w->tasks[w->head++] : w->tasks[--w->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return found;
+}
+
+static int hasTasks(globWalk *g) {
+    int i, found = 0;
+    for (i = 0; !found && i < g->nworkers; i++) {
+        pthread_mutex_lock(&g->workers[i].lock);
+        found = g->workers[i].head < g->workers[i].tail;
+        pthread_mutex_unlock(&g->workers[i].lock);
+    }
+    return found;
+}
+
+/* For entries that may lead further (d_type may be DT_UNKNOWN on some filesystems) */
+static int isDirectory(const char *path, int type, int follow) {
+    struct stat st;
+    if (type == DT_DIR)
+        return 1;
+    if (type != DT_UNKNOWN && !(type == DT_LNK && follow))
+        return 0;
+    if ((follow ? stat(path, &st) : lstat(path, &st)) == -1)
+        return 0;
+    return S_ISDIR(st.st_mode);
+}
+
+static int isDotOrDotDot(const char *name, int len) {
+    return name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'));
+}
+
+static int runTask(worker *w, char *path, size_t len, int idx);
+
+/* Handles one entry of the directory being listed for comps[idx] (wild) */
+static int matchEntry(worker *w, char *path, size_t len, int idx, int type) {
+    globWalk *g = w->walk;
+    if (idx + 1 == g->ncomps && !g->dirsOnly)
+        return addResult(w, path, len);
+    if (!isDirectory(path, type, 1))
+        return 0;
+    if (idx + 1 == g->ncomps)
+        return runTask(w, path, len, idx + 1);
+    pushTask(w, path, idx + 1);
+    return 0;
+}
+
+/* Matches comps[idx..] below path (of length len, "" for the cwd). Literal components */
+/* are followed inline; every subdirectory to descend into becomes a task. Returns -1 to stop */
+static int runTask(worker *w, char *path, size_t len, int idx) {
+    globWalk *g = w->walk;
+    struct stat st;
+    size_t base = len;
+
+    if (__atomic_load_n(&g->stop, __ATOMIC_RELAXED))
+        return -1;
+    if (idx == g->ncomps) {
+        if (g->dirsOnly) {
+            if (!isDirectory(path, DT_UNKNOWN, 1))
+                return 0;
+            path[len++] = '/';
+            path[len] = '\0';
+        } else if (lstat(path, &st) == -1) {
+            return 0;
+        }
+        return addResult(w, path, len);
+    }
+    if (base > 0 && path[base - 1] != '/')
+        path[base++] = '/';
+
+    matcher *m = &g->comps[idx];
+    if (!m->wild) {
+        /* literal component: no need to list the directory */
+        if (base + m->textLen + 2 >= PATH_MAX)
+            return 0;
+        memcpy(path + base, m->text, m->textLen + 1);
+        if (idx + 1 < g->ncomps && !isDirectory(path, DT_UNKNOWN, 1))
+            return 0;
+        return runTask(w, path, base + m->textLen, idx + 1);
+    }
+
+    /* "**" also matches no directory at all; a wild next component is matched in the */
+    /* listing below instead, so that each directory is listed once */
+    int next = m->recursive ? idx + 1 : idx;
+    int lastRecursive = m->recursive && next == g->ncomps;
+    if (m->recursive && !lastRecursive && !g->comps[next].wild) {
+        path[len] = '\0';
+        if (runTask(w, path, len, next) == -1)
+            return -1;
+    }
+    int matchNext = !lastRecursive && g->comps[next].wild;
+
+    path[base] = '\0';
+    int fd = openat(AT_FDCWD, base ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+    char *dents = malloc(GLOB_DENTS_SIZE);
+    long n;
+    int res = 0;
+
+    while (res == 0 && (n = syscall(SYS_getdents64, fd, dents, GLOB_DENTS_SIZE)) > 0) {
+        for (long off = 0; off < n && res == 0;) {
+            linuxDirent64 *d = (linuxDirent64 *)(dents + off);
+            off += d->d_reclen;
+            int nameLen = strlen(d->d_name);
+            if (isDotOrDotDot(d->d_name, nameLen) || base + nameLen + 2 >= PATH_MAX)
+                continue;
+            memcpy(path + base, d->d_name, nameLen + 1);
+
+            if (m->recursive && d->d_name[0] != '.') {
+                /* like bash, "**" does not follow symbolic links to directories */
+                int dir = isDirectory(path, d->d_type, 0);
+                if (lastRecursive && !g->dirsOnly) {
+                    res = addResult(w, path, base + nameLen);
+                } else if (lastRecursive && dir) {
+                    strcpy(path + base + nameLen, "/");
+                    res = addResult(w, path, base + nameLen + 1);
+                    path[base + nameLen] = '\0';
+                }
+                if (res == 0 && dir)
+                    pushTask(w, path, idx);
+            }
+            if (res == 0 && matchNext && matchName(&g->comps[next], d->d_name, nameLen))
+                res = matchEntry(w, path, base + nameLen, next, d->d_type);
+        }
+    }
+    free(dents);
+    close(fd);
+    path[len] = '\0';
+    return res;
+}
+
+static void *workerLoop(void *arg) {
+    worker *w = arg;
+    globWalk *g = w->walk;
+    char path[PATH_MAX];
+    task t;
+    int i;
+
+    while (1) {
+        int found = takeTask(w, 0, &t);
+        for (i = 1; !found && i < g->nworkers; i++)
+            found = takeTask(&g->workers[(w->id + i) % g->nworkers], 1, &t);
+        if (found) {
+            snprintf(path, sizeof(path), "%s", t.path);
+            free(t.path);
+            runTask(w, path, strlen(path), t.idx);
+            if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&g->idleLock);
+                pthread_cond_broadcast(&g->work);
+                pthread_mutex_unlock(&g->idleLock);
+            }
+        } else if (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) == 0) {
+            break;
+        } else {
+            /* the other workers are still listing directories: sleep until one pushes a task */
+            pthread_mutex_lock(&g->idleLock);
+            __atomic_add_fetch(&g->idle, 1, __ATOMIC_SEQ_CST);
+            while (!hasTasks(g) && __atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) != 0)
+                pthread_cond_wait(&g->work, &g->idleLock);
+            __atomic_sub_fetch(&g->idle, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&g->idleLock);
+        }
+    }
+    return NULL;
+}
+
+static void insertionSort(char **a, int n, int depth) {
+    int i, j;
+    for (i = 1; i < n; i++) {
+        char *v = a[i];
+        for (j = i; j > 0 && strcmp(a[j - 1] + depth, v + depth) > 0; j--)
+            a[j] = a[j - 1];
+        a[j] = v;
+    }
+}
+
+/* MSD radix sort on the byte at depth; every string in a is equal before depth */
+static void radixSort(char **a, char **tmp, int n, int depth) {
+    int count[257], start[257], i, c;
+    if (n < GLOB_SMALL_SORT) {
+        insertionSort(a, n, depth);
+        return;
+    }
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < n; i++)
+        count[(unsigned char)a[i][depth]]++;
+    start[0] = 0;
+    for (c = 1; c <= 256; c++)
+        start[c] = start[c - 1] + count[c - 1];
+    for (i = 0; i < n; i++)
+        tmp[start[(unsigned char)a[i][depth]]++] = a[i];
+    memcpy(a, tmp, n * sizeof(char *));
+
+    /* bucket 0 holds strings that ended here: already in place */
+    for (c = 1, i = count[0]; c < 256; i += count[c], c++)
+        if (count[c] > 1)
+            radixSort(a + i, tmp, count[c], depth + 1);
+}
+
+/* Threads pay off only for recursive patterns; others read one directory per component */
+static int threadCount(globWalk *g) {
+    int i;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (i = 0; i < g->ncomps; i++)
+        if (g->comps[i].recursive)
+            return cpus < 1 ? 1 : (cpus > GLOB_MAX_THREADS ? GLOB_MAX_THREADS : cpus);
+    return 1;
+}
+
+static int matchComponents(const matcher *comps, int ncomps, char **names, int count) {
+    if (ncomps == 0)
+        return count == 0;
+    if (comps[0].recursive)
+        return matchComponents(comps + 1, ncomps - 1, names, count) ||
+               (count > 0 && names[0][0] != '.' && matchComponents(comps, ncomps, names + 1, count - 1));
+    return count > 0 && matchName(&comps[0], names[0], strlen(names[0])) &&
+           matchComponents(comps + 1, ncomps - 1, names + 1, count - 1);
+}
+
+/* Splits str in place at '/'; returns the number of (non-empty) components */
+static int splitPath(char *str, char **parts) {
+    char *part, *save = NULL;
+    int count = 0;
+    for (part = strtok_r(str, "/", &save); part != NULL; part = strtok_r(NULL, "/", &save))
+        parts[count++] = part;
+    return count;
+}
+
+int globMatch(const char *pattern, const char *path) {
+    char *patternCopy = strdup(pattern);
+    char *pathCopy = strdup(path);
+    char **parts = malloc(sizeof(char *) * (strlen(pattern) / 2 + 2));
+    char **names = malloc(sizeof(char *) * (strlen(path) / 2 + 2));
+    matcher *comps;
+    int ncomps = splitPath(patternCopy, parts);
+    int count = splitPath(pathCopy, names);
+    int i, matched;
+
+    comps = malloc(sizeof(matcher) * (ncomps + 1));
+    for (i = 0; i < ncomps; i++) {
+        compile(parts[i], &comps[i]);
+        comps[i].recursive = strcmp(parts[i], "**") == 0;
+    }
+    matched = (pattern[0] == '/') == (path[0] == '/') && matchComponents(comps, ncomps, names, count);
+
+    for (i = 0; i < ncomps; i++)
+        free(comps[i].ops);
+    free(comps);
+    free(parts);
+    free(names);
+    free(patternCopy);
+    free(pathCopy);
+    return matched;
+}
+
+int globExpand(const char *pattern, argBuffer **buffer, char **words, int max) {
+    char *copy = strdup(pattern);
+    char *comp, *save = NULL;
+    globWalk g;
+    sigset_t all, old;
+    int i, j, count = 0;
+
+    memset(&g, 0, sizeof(g));
+    *buffer = NULL;
+    g.comps = malloc(sizeof(matcher) * (strlen(pattern) / 2 + 2));
+    g.dirsOnly = copy[strlen(copy) - 1] == '/';
+    g.max = max;
+    for (comp = strtok_r(copy, "/", &save); comp != NULL; comp = strtok_r(NULL, "/", &save)) {
+        compile(comp, &g.comps[g.ncomps]);
+        g.comps[g.ncomps++].recursive = strcmp(comp, "**") == 0;
+    }
+
+    g.nworkers = threadCount(&g);
+    g.workers = calloc(g.nworkers, sizeof(worker));
+    pthread_mutex_init(&g.idleLock, NULL);
+    pthread_cond_init(&g.work, NULL);
+    for (i = 0; i < g.nworkers; i++) {
+        pthread_mutex_init(&g.workers[i].lock, NULL);
+        g.workers[i].walk = &g;
+        g.workers[i].id = i;
+    }
+    pushTask(&g.workers[0], pattern[0] == '/' ? "/" : "", 0);
+    /* the workers start with every signal blocked, so signals for the shell are delivered to it */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (i = 1; i < g.nworkers; i++)
+        g.workers[i].started = pthread_create(&g.workers[i].thread, NULL, workerLoop, &g.workers[i]) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    workerLoop(&g.workers[0]);
+    for (i = 1; i < g.nworkers; i++)
+        if (g.workers[i].started)
+            pthread_join(g.workers[i].thread, NULL);
+
+    /* the workers' results are merged into one buffer; sorting makes the order independent */
+    /* of how the directories were shared out */
+    count = g.found > max ? max + 1 : g.found;
+    if (count > 0 && count <= max) {
+        size_t size = 0;
+        for (i = 0; i < g.nworkers; i++)
+            size += g.workers[i].buffer ? g.workers[i].buffer->size : 0;
+        *buffer = malloc(sizeof(argBuffer) + size + 1);
+        (*buffer)->next = NULL;
+        (*buffer)->size = 0;
+        count = 0;
+        for (i = 0; i < g.nworkers; i++) {
+            worker *w = &g.workers[i];
+            for (j = 0; j < w->count; j++)
+                words[count++] = (*buffer)->data + (*buffer)->size + w->offsets[j];
+            if (w->buffer) {
+                memcpy((*buffer)->data + (*buffer)->size, w->buffer->data, w->buffer->size);
+                (*buffer)->size += w->buffer->size;
+            }
+        }
+        char **tmp = malloc(sizeof(char *) * count);
+        radixSort(words, tmp, count, 0);
+        free(tmp);
+        (*buffer)->size--; /* the last terminator is the buffer's own */
+    }
+
+    for (i = 0; i < g.nworkers; i++) {
+        worker *w = &g.workers[i];
+        while (w->head < w->tail)
+            free(w->tasks[w->head++].path);
+        free(w->tasks);
+        free(w->buffer);
+        free(w->offsets);
+        pthread_mutex_destroy(&w->lock);
+    }
+    free(g.workers);
+    pthread_cond_destroy(&g.work);
+    pthread_mutex_destroy(&g.idleLock);
+    for (i = 0; i < g.ncomps; i++)
+        free(g.comps[i].ops);
+    free(g.comps);
+    free(copy);
+    return count;
+}
@@ -0,0 +1,13 @@
+/* Returns 1 if word contains any of the glob metacharacters * ? [ */
+int globHasMeta(const char *word);
+
+/* Expands pattern to the matching paths in byte order. Wildcards may appear in any path */
+/* component; names starting with '.' only match a component that starts with '.'. */
+/* On success the paths are stored NUL-terminated in a new *buffer, words[0..n-1] point into */
+/* it and n is returned. Returns 0 (and no buffer) if nothing matched, or max + 1 (and no */
+/* buffer) if there are more than max matches */
+int globExpand(const char *pattern, argBuffer **buffer, char **words, int max);
+
+/* Returns 1 if path matches pattern component by component, with the same rules as */
+/* globExpand; a "**" component matches any number of directories */
+int globMatch(const char *pattern, const char *path);
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "History.h"
+
+/* Every record is one line, "<checksum> <usec> <pid> <command>", written with a single */
+/* O_APPEND write so that shells sharing the log never need to exclude each other to append. */
+/* The checksum covers the rest of the line; torn or interleaved records fail it and are */
+/* skipped. Appenders only hold a shared lock on "<log>.lock", which a compaction takes */
+/* exclusively so that no record lands in the file it is about to replace */
+#define HISTORY_RECORD_MAX 4096
+#define HISTORY_PENDING_MAX 64      /* entries from other shells held until the next prompt */
+#define HISTORY_POLL_SECONDS 1
+
+typedef struct entry {
+    char *line;
+    struct entry *next;
+} entry;
+
+typedef struct record {
+    unsigned int sum;
+    long long usec;
+    const char *text;               /* "<usec> <pid> <command>", not terminated */
+    int len;
+    const char *command;
+    int commandLen;
+} record;
+
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t history_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t history_thread;
+static int history_running = 0;
+static int history_stopping = 0;
+static int compact_requested = 0;
+static char history_path[PATH_MAX];
+static entry *outgoing = NULL, **outgoing_tail = &outgoing;
+static entry *incoming = NULL, **incoming_tail = &incoming;
+static int incoming_count = 0;
+
+/* State of the tail, only touched by the history thread */
+static ino_t tail_inode = 0;
+static off_t tail_offset = 0;
+static long long newest_usec = 0;   /* newest record seen, used to resume after a compaction */
+static off_t compacted_size = 0;    /* size of the log our last compaction left */
+
+static unsigned int checksum(const char *data, int len) {
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static long long nowUsec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Parses one line (without its newline); returns 0 if it is an intact record */
+static int parseRecord(const char *line, int len, record *rec) {
+    char *end;
+    const char *p;
+    if (len < 10 || line[8] != ' ')
+        return -1;
+    rec->sum = strtoul(line, &end, 16);
+    if (end != line + 8)
+        return -1;
+    rec->text = line + 9;
+    rec->len = len - 9;
+    if (checksum(rec->text, rec->len) != rec->sum)
+        return -1;
+    rec->usec = strtoll(rec->text, &end, 10);
+    p = memchr(end + 1, ' ', line + len - (end + 1));
+    if (*end != ' ' || p == NULL)
+        return -1;
+    rec->command = p + 1;
+    rec->commandLen = line + len - rec->command;
+    return 0;
+}
+
+static int recordPid(const record *rec) {
+    const char *p = memchr(rec->text, ' ', rec->len);
+    return p ? atoi(p + 1) : 0;
+}
+
+static void pushIncoming(const char *command, int len) {
+    entry *e = malloc(sizeof(entry));
+    e->line = malloc(len + 2);
+    memcpy(e->line, command, len);
+    e->line[len] = '\n';
+    e->line[len + 1] = '\0';
+    e->next = NULL;
+
+    pthread_mutex_lock(&history_lock);
+    *incoming_tail = e;
+    incoming_tail = &e->next;
+    if (++incoming_count > HISTORY_PENDING_MAX) {
+        entry *old = incoming;
+        incoming = old->next;
+        incoming_count--;
+        free(old->line);
+        free(old);
+    }
+    pthread_mutex_unlock(&history_lock);
+}
+
+static int openLock() {
+    char lockPath[PATH_MAX + 8];
+    snprintf(lockPath, sizeof(lockPath), "%s.lock", history_path);
+    return open(lockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+}
+
+/* Writes the queued commands, all in one append */
+static void flushOutgoing() {
+    entry *list, *e;
+    size_t size = 0, used = 0;
+    char *buf;
+    int fd, lockFd;
+
+    pthread_mutex_lock(&history_lock);
+    list = outgoing;
+    outgoing = NULL;
+    outgoing_tail = &outgoing;
+    pthread_mutex_unlock(&history_lock);
+    if (list == NULL)
+        return;
+
+    for (e = list; e != NULL; e = e->next)
+        size += strlen(e->line) + 48;
+    buf = malloc(size);
+    for (e = list; e != NULL; e = e->next) {
+        char text[HISTORY_RECORD_MAX];
+        int len = snprintf(text, sizeof(text), "%lld %d %s", nowUsec(), getpid(), e->line);
+        if (len >= (int)sizeof(text))
+            len = sizeof(text) - 1;
+        used += sprintf(buf + used, "%08x %.*s\n", checksum(text, len), len, text);
+    }
+
+    /* without the lock file the append is still made, it can only be lost to a compaction */
+    lockFd = openLock();
+    if (lockFd != -1)
+        flock(lockFd, LOCK_SH);
+    fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (fd != -1) {
+        if (write(fd, buf, used) != (ssize_t)used)
+            perror("history: append failed");
+        close(fd);
+    }
+    if (lockFd != -1)
+        close(lockFd);
+    free(buf);
+    while (list != NULL) {
+        e = list->next;
+        free(list->line);
+        free(list);
+        list = e;
+    }
+}
+
+/* Reads the records appended since the last call. After a compaction replaced the file, */
+/* it is read again from the start and only records newer than any seen before are taken */
+static off_t tailLog() {
+    struct stat st;
+    int fd, resumed = 0;
+    char *buf, *line, *nl;
+    ssize_t n;
+
+    fd = open(history_path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return 0;
+    }
+    if (st.st_ino != tail_inode) {
+        resumed = tail_inode != 0;
+        tail_inode = st.st_ino;
+        tail_offset = 0;
+    } else if (st.st_size < tail_offset) {
+        resumed = 1; /* truncated in place */
+        tail_offset = 0;
+    }
+    if (st.st_size <= tail_offset) {
+        close(fd);
+        return st.st_size;
+    }
+
+    buf = malloc(st.st_size - tail_offset + 1);
+    n = pread(fd, buf, st.st_size - tail_offset, tail_offset);
+    close(fd);
+    if (n <= 0) {
+        free(buf);
+        return st.st_size;
+    }
+
+    /* an unfinished last line is left for the next call */
+    for (line = buf; (nl = memchr(line, '\n', buf + n - line)) != NULL; line = nl + 1) {
+        record rec;
+        if (parseRecord(line, nl - line, &rec) == -1)
+            continue;
+        if (!(resumed && rec.usec <= newest_usec) && recordPid(&rec) != getpid())
+            pushIncoming(rec.command, rec.commandLen);
+        if (rec.usec > newest_usec)
+            newest_usec = rec.usec;
+    }
+    tail_offset += line - buf;
+    free(buf);
+    return st.st_size;
+}
+
+static char *readAll(int fd, off_t from, off_t *size) {
+    struct stat st;
+    char *buf;
+    ssize_t n;
+    if (fstat(fd, &st) == -1 || st.st_size < from)
+        return NULL;
+    buf = malloc(st.st_size - from + 1);
+    n = pread(fd, buf, st.st_size - from, from);
+    if (n < 0) {
+        free(buf);
+        return NULL;
+    }
+    *size = n;
+    return buf;
+}
+
+/* Rewrites the log keeping the latest occurrence of each of the last HISTORY_KEEP */
+/* distinct commands. The exclusive lock holds appenders back for the copy and the rename, */
+/* so every record ends up in the new file; it is only tried, since a shell appending or */
+/* compacting now just means trying again later. Returns the new size, or -1 if not done */
+static off_t compactLog() {
+    char tmpPath[PATH_MAX + 32];
+    int lockFd, fd, out, count = 0, kept = 0, i, j;
+    off_t size, written = -1;
+    char *buf, *line, *nl;
+    record *recs;
+
+    lockFd = openLock();
+    if (lockFd == -1)
+        return -1;
+    if (flock(lockFd, LOCK_EX | LOCK_NB) == -1) {
+        close(lockFd);
+        return -1;
+    }
+    fd = open(history_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || (buf = readAll(fd, 0, &size)) == NULL) {
+        if (fd != -1)
+            close(fd);
+        close(lockFd);
+        return -1;
+    }
+
+    recs = malloc(sizeof(record) * (size / 10 + 1));
+    for (line = buf; (nl = memchr(line, '\n', buf + size - line)) != NULL; line = nl + 1)
+        if (parseRecord(line, nl - line, &recs[count]) == 0)
+            count++;
+
+    /* newest first: a record survives if no newer one has the same command */
+    for (i = count - 1; i >= 0 && kept < HISTORY_KEEP; i--) {
+        for (j = i + 1; j < count; j++)
+            if (recs[j].command != NULL && recs[j].commandLen == recs[i].commandLen &&
+                memcmp(recs[j].command, recs[i].command, recs[i].commandLen) == 0)
+                break;
+        if (j < count)
+            recs[i].command = NULL;
+        else
+            kept++;
+    }
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", history_path, getpid());
+    out = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out != -1) {
+        FILE *f = fdopen(out, "w");
+        for (j = i + 1; j < count; j++)
+            if (recs[j].command != NULL)
+                fprintf(f, "%08x %.*s\n", recs[j].sum, recs[j].len, recs[j].text);
+        /* appenders are held back, so an unfinished last line is a torn append: dropped */
+        written = ftello(f);
+        if (fclose(f) != 0 || rename(tmpPath, history_path) == -1) {
+            unlink(tmpPath);
+            written = -1;
+        }
+    }
+    free(recs);
+    free(buf);
+    close(fd);
+    close(lockFd);
+    return written;
+}
+
+static void *historyLoop(void *arg) {
+    struct timespec deadline;
+    int stopping = 0, compact;
+
+    while (!stopping) {
+        flushOutgoing();
+        off_t size = tailLog();
+
+        pthread_mutex_lock(&history_lock);
+        compact = compact_requested;
+        compact_requested = 0;
+        pthread_mutex_unlock(&history_lock);
+        /* what the last compaction kept may itself be past the limit (long commands): only */
+        /* compact again once the log has doubled since, not on every poll */
+        if (compact || (size > HISTORY_COMPACT_SIZE && size > 2 * compacted_size)) {
+            off_t compacted = compactLog();
+            if (compacted != -1)
+                compacted_size = compacted;
+        }
+
+        pthread_mutex_lock(&history_lock);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += HISTORY_POLL_SECONDS;
+        while (!history_stopping && outgoing == NULL && !compact_requested &&
+               pthread_cond_timedwait(&history_wakeup, &history_lock, &deadline) != ETIMEDOUT)
+            ;
+        stopping = history_stopping;
+        pthread_mutex_unlock(&history_lock);
+    }
+    flushOutgoing();
+    return NULL;
+}
+
+int historyOpen(const char *path) {
+    if (history_running)
+        return 0;
+    if (path != NULL)
+        snprintf(history_path, sizeof(history_path), "%s", path);
+    else if (getenv(HISTORY_FILE_ENV))
+        snprintf(history_path, sizeof(history_path), "%s", getenv(HISTORY_FILE_ENV));
+    else
+        snprintf(history_path, sizeof(history_path), "%s/.myshell_history", getenv("HOME") ? getenv("HOME") : "/tmp");
+
+    history_stopping = 0;
+    if (pthread_create(&history_thread, NULL, historyLoop, NULL) != 0)
+        return -1;
+    history_running = 1;
+    return 0;
+}
+
+void historyAppend(const char *line) {
+    entry *e;
+    if (!history_running)
+        return;
+    e = malloc(sizeof(entry));
+    e->line = strdup(line);
+    e->line[strcspn(e->line, "\n")] = '\0';
+    e->next = NULL;
+
+    pthread_mutex_lock(&history_lock);
+    *outgoing_tail = e;
+    outgoing_tail = &e->next;
+    pthread_cond_signal(&history_wakeup);
+    pthread_mutex_unlock(&history_lock);
+}
+
+char *historyNext() {
+    entry *e;
+    char *line = NULL;
+    pthread_mutex_lock(&history_lock);
+    if ((e = incoming) != NULL) {
+        incoming = e->next;
+        if (incoming == NULL)
+            incoming_tail = &incoming;
+        incoming_count--;
+        line = e->line;
+        free(e);
+    }
+    pthread_mutex_unlock(&history_lock);
+    return line;
+}
+
+void historyCompact() {
+    pthread_mutex_lock(&history_lock);
+    compact_requested = 1;
+    pthread_cond_signal(&history_wakeup);
+    pthread_mutex_unlock(&history_lock);
+}
+
+void historyClose() {
+    if (!history_running)
+        return;
+    pthread_mutex_lock(&history_lock);
+    history_stopping = 1;
+    pthread_cond_signal(&history_wakeup);
+    pthread_mutex_unlock(&history_lock);
+    pthread_join(history_thread, NULL);
+    history_running = 0;
+}
@@ -0,0 +1,21 @@
+#define HISTORY_FILE_ENV "MYSHELL_HISTFILE"     /* overrides the default ~/.myshell_history */
+#define HISTORY_COMPACT_SIZE (256L * 1024)      /* the log is compacted once it grows past this */
+#define HISTORY_KEEP 1000                       /* distinct commands kept by a compaction */
+
+/* Starts the history thread, which appends this shell's commands to the shared log and */
+/* tails the entries other shells append to it. path NULL selects the default log. */
+/* Returns 0 on success, -1 if the thread could not be started */
+int historyOpen(const char *path);
+
+/* Queues a command line for appending; never waits for the log */
+void historyAppend(const char *line);
+
+/* Returns the next entry appended by another shell (newline terminated, to be freed by */
+/* the caller), or NULL if none arrived since the last call */
+char *historyNext();
+
+/* Asks the history thread to deduplicate the log now instead of waiting for it to grow */
+void historyCompact();
+
+/* Writes out the queued commands and stops the history thread */
+void historyClose();
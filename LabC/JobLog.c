@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include "JobLog.h"
+
+#define JOBLOG_READ_SIZE (256 * 1024)  /* one read per wakeup drains a lot of output at once */
+#define JOBLOG_LINE_MAX 4096           /* longer lines are echoed in pieces in live mode */
+#define JOBLOG_EVENTS 64
+
+/* Start of every ring log file; the data follows it. written only grows, so */
+/* the ring holds the last min(written, capacity) bytes ending at written % capacity */
+typedef struct ringHeader {
+    unsigned long long written;
+    unsigned int capacity;
+    int pid;
+} ringHeader;
+
+typedef struct jobLog {
+    pid_t pid;
+    int fd;                       /* read end of the job's pipe, -1 once it hit EOF */
+    char name[64];
+    char path[PATH_MAX + 32];
+    ringHeader *header;           /* mmap'd log file */
+    char *ring;
+    char partial[JOBLOG_LINE_MAX]; /* unfinished last line, for live mode */
+    size_t partialLen;
+    int released;                 /* the job is gone: free the log once the pipe hits EOF */
+    struct jobLog *next;
+} jobLog;
+
+static pthread_mutex_t joblog_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t relay_thread;
+static int relay_started = 0;
+static int epoll_fd = -1;
+static int joblog_mode = JOBLOG_OFF;
+static long ring_size = JOBLOG_DEFAULT_SIZE;
+static jobLog *logs = NULL;
+static char log_dir[PATH_MAX] = "";
+
+static void ringAppend(jobLog *log, const char *data, size_t len) {
+    unsigned int capacity = log->header->capacity;
+    if (len > capacity) {
+        log->header->written += len - capacity;
+        data += len - capacity;
+        len = capacity;
+    }
+    size_t pos = log->header->written % capacity;
+    size_t first = len < capacity - pos ? len : capacity - pos;
+    memcpy(log->ring + pos, data, first);
+    memcpy(log->ring, data + first, len - first);
+    log->header->written += len;
+}
+
+/* Unmaps the ring and removes its file; the log must already be out of the list */
+static void freeLog(jobLog *log) {
+    munmap(log->header, sizeof(ringHeader) + log->header->capacity);
+    if (log->path[0] != 0)
+        unlink(log->path);
+    free(log);
+}
+
+/* Takes log out of the list; called with joblog_lock held */
+static void unlinkLog(jobLog *log) {
+    jobLog **link;
+    for (link = &logs; *link != NULL && *link != log; link = &(*link)->next)
+        ;
+    if (*link != NULL)
+        *link = log->next;
+}
+
+/* Appends "[pid] line\n" for every complete line in data to out (flushing it when full); */
+/* what is left after the last newline is kept in log->partial */
+static void echoLines(jobLog *log, const char *data, size_t len, char *out, size_t *outLen, int flushPartial) {
+    char prefix[32];
+    int prefixLen = snprintf(prefix, sizeof(prefix), "[%d] ", log->pid);
+    size_t i;
+
+    for (i = 0; i < len || (flushPartial && log->partialLen > 0); i++) {
+        int endOfLine = i >= len || data[i] == '\n';
+        if (i < len && !endOfLine) {
+            log->partial[log->partialLen++] = data[i];
+            if (log->partialLen < JOBLOG_LINE_MAX - 1)
+                continue;
+        }
+        if (*outLen + prefixLen + log->partialLen + 1 > JOBLOG_READ_SIZE) {
+            if (write(STDOUT_FILENO, out, *outLen) == -1)
+                return;
+            *outLen = 0;
+        }
+        memcpy(out + *outLen, prefix, prefixLen);
+        memcpy(out + *outLen + prefixLen, log->partial, log->partialLen);
+        *outLen += prefixLen + log->partialLen;
+        out[(*outLen)++] = '\n';
+        log->partialLen = 0;
+        if (i >= len)
+            break;
+    }
+}
+
+/* The relay: one epoll loop drains every job's pipe with large reads into its ring */
+static void *relayLoop(void *arg) {
+    struct epoll_event events[JOBLOG_EVENTS];
+    char *buf = (char *)malloc(JOBLOG_READ_SIZE);
+    char *out = (char *)malloc(JOBLOG_READ_SIZE);
+    int i;
+
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, JOBLOG_EVENTS, -1);
+        if (n == -1 && errno != EINTR)
+            break;
+
+        for (i = 0; i < n; i++) {
+            jobLog *log = (jobLog *)events[i].data.ptr;
+            ssize_t len = read(log->fd, buf, JOBLOG_READ_SIZE);
+            if (len == -1 && (errno == EINTR || errno == EAGAIN))
+                continue;
+
+            size_t outLen = 0;
+            pthread_mutex_lock(&joblog_lock);
+            if (len > 0)
+                ringAppend(log, buf, len);
+            if (joblog_mode == JOBLOG_LIVE)
+                echoLines(log, buf, len > 0 ? len : 0, out, &outLen, len <= 0);
+            if (len <= 0) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, log->fd, NULL);
+                close(log->fd);
+                log->fd = -1;
+                if (log->released) {
+                    unlinkLog(log);
+                    freeLog(log);
+                }
+            }
+            pthread_mutex_unlock(&joblog_lock);
+
+            /* each batch of whole lines goes out in one write, so jobs never interleave mid-line */
+            if (outLen > 0 && write(STDOUT_FILENO, out, outLen) == -1)
+                continue;
+        }
+    }
+    free(buf);
+    free(out);
+    return NULL;
+}
+
+void joblogSetMode(int mode, long size) {
+    joblog_mode = mode;
+    if (size > 0)
+        ring_size = size;
+}
+
+int joblogMode() {
+    return joblog_mode;
+}
+
+int joblogAttach(pid_t pid, int fd, const char *name) {
+    if (log_dir[0] == 0) {
+        snprintf(log_dir, sizeof(log_dir), "%s/myshell-%d", getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp", getpid());
+        if (mkdir(log_dir, 0700) == -1 && errno != EEXIST) {
+            perror("joblog: cannot create log directory");
+            log_dir[0] = 0;
+            close(fd);
+            return -1;
+        }
+    }
+    if (!relay_started) {
+        if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1 ||
+            pthread_create(&relay_thread, NULL, relayLoop, NULL) != 0) {
+            perror("joblog: cannot start relay");
+            close(fd);
+            return -1;
+        }
+        relay_started = 1;
+    }
+
+    /* a released log still draining for an earlier job with this pid gives up its file */
+    jobLog *log;
+    pthread_mutex_lock(&joblog_lock);
+    for (log = logs; log != NULL; log = log->next)
+        if (log->pid == pid && log->released && log->path[0] != 0) {
+            unlink(log->path);
+            log->path[0] = 0;
+        }
+    pthread_mutex_unlock(&joblog_lock);
+
+    log = (jobLog *)calloc(1, sizeof(jobLog));
+    log->pid = pid;
+    log->fd = fd;
+    snprintf(log->name, sizeof(log->name), "%s", name);
+    snprintf(log->path, sizeof(log->path), "%s/%d.log", log_dir, pid);
+
+    int logFd = open(log->path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    size_t mapSize = sizeof(ringHeader) + ring_size;
+    if (logFd == -1 || ftruncate(logFd, mapSize) == -1 ||
+        (log->header = (ringHeader *)mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, logFd, 0)) == MAP_FAILED) {
+        perror("joblog: cannot create ring log");
+        if (logFd != -1)
+            close(logFd);
+        close(fd);
+        free(log);
+        return -1;
+    }
+    close(logFd);
+    log->header->capacity = ring_size;
+    log->header->pid = pid;
+    log->ring = (char *)(log->header + 1);
+
+    /* listed under the lock before the relay can see it, so an early EOF finds it in the list */
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = log;
+    pthread_mutex_lock(&joblog_lock);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        pthread_mutex_unlock(&joblog_lock);
+        perror("joblog: epoll_ctl failed");
+        close(fd);
+        freeLog(log);
+        return -1;
+    }
+    log->next = logs;
+    logs = log;
+    pthread_mutex_unlock(&joblog_lock);
+    return 0;
+}
+
+/* Once fd is -1 the relay is done with the log (the EOF was its last event for it), so it can */
+/* be freed here; otherwise the relay frees it when the EOF comes */
+void joblogRelease(pid_t pid) {
+    jobLog *log;
+    pthread_mutex_lock(&joblog_lock);
+    for (log = logs; log != NULL && (log->pid != pid || log->released); log = log->next)
+        ;
+    if (log != NULL && log->fd == -1) {
+        unlinkLog(log);
+        freeLog(log);
+    } else if (log != NULL) {
+        log->released = 1;
+    }
+    pthread_mutex_unlock(&joblog_lock);
+}
+
+int joblogPrint(pid_t pid, FILE *out) {
+    jobLog *log;
+    pthread_mutex_lock(&joblog_lock);
+    for (log = logs; log != NULL && (log->pid != pid || log->released); log = log->next)
+        ;
+    if (log == NULL) {
+        pthread_mutex_unlock(&joblog_lock);
+        return -1;
+    }
+
+    unsigned long long written = log->header->written;
+    unsigned int capacity = log->header->capacity;
+    size_t len = written < capacity ? written : capacity;
+    size_t pos = (written - len) % capacity;
+    size_t first = len < capacity - pos ? len : capacity - pos;
+    fwrite(log->ring + pos, 1, first, out);
+    fwrite(log->ring, 1, len - first, out);
+    pthread_mutex_unlock(&joblog_lock);
+    return 0;
+}
+
+void joblogList(FILE *out) {
+    jobLog *log;
+    pthread_mutex_lock(&joblog_lock);
+    fprintf(out, "PID          Command      Bytes        State\n");
+    for (log = logs; log != NULL; log = log->next)
+        if (!log->released)
+            fprintf(out, "%-12d %-12s %-12llu %s\n", log->pid, log->name, log->header->written,
+                    log->fd == -1 ? "closed" : "open");
+    pthread_mutex_unlock(&joblog_lock);
+}
+
+void joblogShutdown() {
+    jobLog *log;
+    if (log_dir[0] == 0)
+        return;
+    pthread_mutex_lock(&joblog_lock);
+    for (log = logs; log != NULL; log = log->next)
+        if (log->path[0] != 0)
+            unlink(log->path);
+    pthread_mutex_unlock(&joblog_lock);
+    rmdir(log_dir);
+}
@@ -0,0 +1,25 @@
+#define JOBLOG_OFF 0       /* background jobs write straight to the terminal */
+#define JOBLOG_CAPTURE 1   /* background output is only kept in the per-job ring logs */
+#define JOBLOG_LIVE 2      /* ...and also echoed line by line, prefixed with the job's pid */
+#define JOBLOG_DEFAULT_SIZE (1024 * 1024)  /* ring capacity per job, in bytes */
+
+/* Sets the capture mode and the ring capacity used for jobs attached from now on */
+void joblogSetMode(int mode, long ringSize);
+int joblogMode();
+
+/* Starts relaying fd (the read end of the job's stdout/stderr pipe) into a new ring log */
+/* The log takes ownership of fd. Returns 0 on success, -1 if the log could not be created */
+int joblogAttach(pid_t pid, int fd, const char *name);
+
+/* Writes the retained output of the job to out. Returns -1 if there is no log for pid */
+int joblogPrint(pid_t pid, FILE *out);
+
+/* Lists the captured jobs with their sizes */
+void joblogList(FILE *out);
+
+/* Drops the log of a job the shell forgot about: the ring is unmapped and its file removed, */
+/* once the relay has drained the pipe if a descendant still holds it open */
+void joblogRelease(pid_t pid);
+
+/* Removes the ring log files; called when the shell exits */
+void joblogShutdown();
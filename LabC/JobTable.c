@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "JobTable.h"
+
+#define JOBTABLE_READ_RETRIES 1000
+
+static char table_name[64];
+
+jobTable *jobtableCreate() {
+    snprintf(table_name, sizeof(table_name), JOBTABLE_NAME, getpid());
+    int fd = shm_open(table_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return NULL;
+    if (ftruncate(fd, sizeof(jobTable)) == -1) {
+        close(fd);
+        shm_unlink(table_name);
+        return NULL;
+    }
+
+    jobTable *table = (jobTable *)mmap(NULL, sizeof(jobTable), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (table == MAP_FAILED) {
+        shm_unlink(table_name);
+        return NULL;
+    }
+    table->shellPid = getpid();
+    table->magic = JOBTABLE_MAGIC;
+    return table;
+}
+
+void jobtableBeginWrite(jobTable *table) {
+    __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void jobtableEndWrite(jobTable *table) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    table->updatedMs = now.tv_sec * 1000LL + now.tv_usec / 1000;
+    __atomic_store_n(&table->seq, table->seq + 1, __ATOMIC_RELEASE);
+}
+
+void jobtableDestroy(jobTable *table) {
+    if (table == NULL)
+        return;
+    munmap(table, sizeof(jobTable));
+    shm_unlink(table_name);
+}
+
+int jobtableRead(const jobTable *table, jobTable *copy) {
+    int attempt;
+    for (attempt = 0; attempt < JOBTABLE_READ_RETRIES; attempt++) {
+        unsigned int before = __atomic_load_n(&table->seq, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            sched_yield();
+            continue;
+        }
+
+        memcpy(copy, table, offsetof(jobTable, slots));
+        int count = copy->count;
+        if (count < 0 || count > JOBTABLE_SLOTS)
+            count = 0;
+        memcpy(copy->slots, table->slots, count * sizeof(jobSlot));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&table->seq, __ATOMIC_RELAXED) == before) {
+            copy->count = count;
+            return 0;
+        }
+    }
+    return -1;
+}
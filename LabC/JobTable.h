@@ -0,0 +1,45 @@
+/* Shared-memory copy of a shell's job table, for external monitors such as myshell-top. */
+/* Each shell publishes to its own POSIX shared memory object, JOBTABLE_NAME with its pid. */
+/* The shell is the only writer and never waits for readers: it makes seq odd, updates the */
+/* table and makes seq even again. A reader copies the table and retries if seq was odd or */
+/* changed meanwhile (a seqlock). */
+
+#define JOBTABLE_NAME "/myshell-jobs-%d"
+#define JOBTABLE_PREFIX "myshell-jobs-"   /* as listed in /dev/shm */
+#define JOBTABLE_MAGIC 0x4d534a54
+#define JOBTABLE_SLOTS 4096
+#define JOBTABLE_CMD_LEN 32
+
+#define JOBSLOT_TERMINATED -1
+#define JOBSLOT_SUSPENDED 0
+#define JOBSLOT_RUNNING 1
+
+typedef struct jobSlot {
+    int pid;
+    int pgid;
+    int state;                      /* JOBSLOT_RUNNING/SUSPENDED/TERMINATED */
+    char cmd[JOBTABLE_CMD_LEN];     /* argv[0], truncated */
+    long long startMs;              /* wall-clock start time, in ms since the epoch */
+    long long cpuTicks;             /* utime + stime when last sampled, in clock ticks */
+    long long rssKb;                /* resident set size when last sampled */
+} jobSlot;
+
+typedef struct jobTable {
+    unsigned int magic;
+    unsigned int seq;               /* odd while the shell is writing */
+    int shellPid;
+    int count;                      /* valid slots */
+    int truncated;                  /* boolean: the shell had more jobs than JOBTABLE_SLOTS */
+    long long updatedMs;            /* wall-clock time of the last update */
+    jobSlot slots[JOBTABLE_SLOTS];
+} jobTable;
+
+/* Shell side. Returns NULL if the table could not be created */
+jobTable *jobtableCreate();
+void jobtableBeginWrite(jobTable *table);
+void jobtableEndWrite(jobTable *table);
+void jobtableDestroy(jobTable *table);
+
+/* Reader side: copies a consistent snapshot of table into copy */
+/* Returns 0 on success, -1 if the shell kept writing for too long */
+int jobtableRead(const jobTable *table, jobTable *copy);
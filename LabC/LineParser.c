@@ -10,6 +10,19 @@
 
 #define FREE(X) if(X) free((void*)X)
 
+/* Arguments spliced from an argBuffer live inside it and are freed with the buffer */
+static void freeArg(cmdLine *pCmdLine, const char *arg) {
+  argBuffer *buffer;
+  if (!arg)
+    return;
+
+  for (buffer = pCmdLine->buffers; buffer; buffer = buffer->next)
+    if (arg >= buffer->data && arg <= buffer->data + buffer->size)
+      return;
+
+  free((void*)arg);
+}
+
 static char *cloneFirstWord(char *str) {
     char *start = NULL;
     char *end = NULL;
@@ -154,6 +167,25 @@ cmdLine *parseCmdLines(const char *strLine) {
 	return head;
 }
 
+cmdLine *cloneCmdLines(const cmdLine *pCmdLine) {
+  cmdLine *clone;
+  int i;
+  if (!pCmdLine)
+    return NULL;
+
+  clone = (cmdLine*)calloc(1, sizeof(cmdLine));
+  for (i=0; i<pCmdLine->argCount; ++i)
+    ((char**)clone->arguments)[i] = strClone(pCmdLine->arguments[i]);
+  clone->argCount = pCmdLine->argCount;
+  clone->inputRedirect = pCmdLine->inputRedirect ? strClone(pCmdLine->inputRedirect) : NULL;
+  clone->outputRedirect = pCmdLine->outputRedirect ? strClone(pCmdLine->outputRedirect) : NULL;
+  clone->blocking = pCmdLine->blocking;
+  clone->idx = pCmdLine->idx;
+  clone->stopsUpstream = pCmdLine->stopsUpstream;
+  clone->next = cloneCmdLines(pCmdLine->next);
+  return clone;
+}
+
 void freeCmdLines(cmdLine *pCmdLine) {
   int i;
   if (!pCmdLine)
@@ -162,7 +194,13 @@ void freeCmdLines(cmdLine *pCmdLine) {
   FREE(pCmdLine->inputRedirect);
   FREE(pCmdLine->outputRedirect);
   for (i=0; i<pCmdLine->argCount; ++i)
-      FREE(pCmdLine->arguments[i]);
+      freeArg(pCmdLine, pCmdLine->arguments[i]);
+
+  while (pCmdLine->buffers) {
+      argBuffer *next = pCmdLine->buffers->next;
+      free(pCmdLine->buffers);
+      pCmdLine->buffers = next;
+  }
 
   if (pCmdLine->next)
 	  freeCmdLines(pCmdLine->next);
@@ -174,7 +212,73 @@ int replaceCmdArg(cmdLine *pCmdLine, int num, const char *newString) {
   if (num >= pCmdLine->argCount)
     return 0;
   
-  FREE(pCmdLine->arguments[num]);
+  freeArg(pCmdLine, pCmdLine->arguments[num]);
   ((char**)pCmdLine->arguments)[num] = strClone(newString);
   return 1;
-}
\ No newline at end of file
+}
+
+int shiftCmdArgs(cmdLine *pCmdLine, int num) {
+  int i;
+  if (num < 0 || num > pCmdLine->argCount)
+    return 0;
+
+  for (i=0; i<num; ++i)
+      freeArg(pCmdLine, pCmdLine->arguments[i]);
+  for (i=num; i<pCmdLine->argCount; ++i)
+      ((char**)pCmdLine->arguments)[i-num] = pCmdLine->arguments[i];
+  for (i=pCmdLine->argCount-num; i<pCmdLine->argCount; ++i)
+      ((char**)pCmdLine->arguments)[i] = NULL;
+
+  pCmdLine->argCount -= num;
+  return 1;
+}
+
+int spliceCmdArgs(cmdLine *pCmdLine, int num, argBuffer *buffer) {
+  char *words[MAX_ARGUMENTS];
+  char *s = buffer->data, *end = buffer->data + buffer->size;
+  int count = 0;
+
+  if (num >= pCmdLine->argCount) {
+    free(buffer);
+    return -1;
+  }
+
+  while (s < end) {
+    while (s < end && isspace((unsigned char)*s))
+      *s++ = 0;
+    if (s == end)
+      break;
+    if (pCmdLine->argCount - 1 + count >= MAX_ARGUMENTS-1) {
+      free(buffer);
+      return -1;
+    }
+    words[count++] = s;
+    while (s < end && !isspace((unsigned char)*s))
+      s++;
+  }
+  *end = 0;
+
+  return spliceCmdArgv(pCmdLine, num, buffer, words, count);
+}
+
+int spliceCmdArgv(cmdLine *pCmdLine, int num, argBuffer *buffer, char **words, int count) {
+  int i;
+
+  if (num >= pCmdLine->argCount || pCmdLine->argCount - 1 + count >= MAX_ARGUMENTS) {
+    free(buffer);
+    return -1;
+  }
+
+  freeArg(pCmdLine, pCmdLine->arguments[num]);
+  memmove((char**)pCmdLine->arguments + num + count, pCmdLine->arguments + num + 1,
+          (pCmdLine->argCount - num - 1) * sizeof(char*));
+  for (i=0; i<count; ++i)
+      ((char**)pCmdLine->arguments)[num+i] = words[i];
+  pCmdLine->argCount += count - 1;
+  for (i=pCmdLine->argCount; i<pCmdLine->argCount - count + 1; ++i)
+      ((char**)pCmdLine->arguments)[i] = NULL;
+
+  buffer->next = pCmdLine->buffers;
+  pCmdLine->buffers = buffer;
+  return count;
+}
@@ -1,5 +1,12 @@
 #define MAX_ARGUMENTS 256
 
+typedef struct argBuffer
+{
+    struct argBuffer *next;	/* next buffer owned by the same cmdLine */
+    size_t size;		/* number of bytes in data (not counting the terminating null) */
+    char data[];		/* arguments spliced from this buffer point directly into it */
+} argBuffer;
+
 typedef struct cmdLine
 {
     char * const arguments[MAX_ARGUMENTS]; /* command line arguments (arg 0 is the command)*/
@@ -8,6 +15,8 @@ typedef struct cmdLine
     char const *outputRedirect;	/* output redirection path. NULL if no output redirection */
     char blocking;	/* boolean indicating blocking/non-blocking */
     int idx;				/* index of current command in the chain of cmdLines (0 for the first) */
+    char stopsUpstream;	/* boolean: when this command exits, the commands before it are terminated */
+    argBuffer *buffers;	/* buffers that spliced arguments point into, released with the cmdLine */
     struct cmdLine *next;	/* next cmdLine in chain */
 } cmdLine;
 
@@ -16,9 +25,26 @@ typedef struct cmdLine
 /* When successful, returns a pointer to cmdLine (in case of a pipe, this will be the head of a linked list) */
 cmdLine *parseCmdLines(const char *strLine);	/* Parse string line */
 
+/* Returns a deep copy of the chain that owns all of its strings */
+cmdLine *cloneCmdLines(const cmdLine *pCmdLine);
+
 /* Releases all allocated memory for the chain (linked list) */
 void freeCmdLines(cmdLine *pCmdLine);		/* Free parsed line */
 
 /* Replaces arguments[num] with newString */
 /* Returns 0 if num is out-of-range, otherwise - returns 1 */
-int replaceCmdArg(cmdLine *pCmdLine, int num, const char *newString);
\ No newline at end of file
+int replaceCmdArg(cmdLine *pCmdLine, int num, const char *newString);
+
+/* Removes the first num arguments, shifting the remaining ones down */
+/* Returns 0 if num is out-of-range, otherwise - returns 1 */
+int shiftCmdArgs(cmdLine *pCmdLine, int num);
+
+/* Splits buffer->data in place at whitespace and replaces arguments[num] with the resulting words */
+/* The words are not copied: the cmdLine takes ownership of buffer and frees it with the arguments */
+/* Returns the number of words, or -1 if num is out-of-range or there are too many arguments */
+/* (in which case buffer is freed and the arguments are left unchanged) */
+int spliceCmdArgs(cmdLine *pCmdLine, int num, argBuffer *buffer);
+
+/* Replaces arguments[num] with count words that already point into buffer->data */
+/* Takes ownership of buffer like spliceCmdArgs; returns count, or -1 if they do not fit */
+int spliceCmdArgv(cmdLine *pCmdLine, int num, argBuffer *buffer, char **words, int count);
@@ -0,0 +1,506 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "LineParser.h"
+#include "Memo.h"
+
+#define MEMO_VERSION "memo-v1"
+#define MEMO_COPY_BUF (64 * 1024)
+#define MEMO_HEX_LEN 33
+
+/* Two independent 64-bit hashes; 128 bits are plenty to address a local store */
+typedef struct memoHash {
+    unsigned long long a;
+    unsigned long long b;
+} memoHash;
+
+typedef struct memoEntry {
+    char name[MEMO_HEX_LEN];
+    char out[MEMO_HEX_LEN];
+    char err[MEMO_HEX_LEN];
+    time_t mtime;
+} memoEntry;
+
+typedef struct memoObject {
+    char name[MEMO_HEX_LEN];
+    long long size;
+    int refs;
+} memoObject;
+
+static long memo_limit = MEMO_DEFAULT_LIMIT;
+static long memo_hits = 0;
+static long memo_misses = 0;
+static long memo_evictions = 0;
+
+static void hashInit(memoHash *h) {
+    h->a = 0xcbf29ce484222325ULL;
+    h->b = 0x9e3779b97f4a7c15ULL;
+}
+
+static void hashUpdate(memoHash *h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h->a = (h->a ^ p[i]) * 0x100000001b3ULL;
+        h->b = (h->b + p[i]) * 0xff51afd7ed558ccdULL;
+        h->b ^= h->b >> 29;
+    }
+}
+
+/* Strings are length-prefixed so that ("ab","c") and ("a","bc") hash differently */
+static void hashString(memoHash *h, const char *str) {
+    unsigned int len = strlen(str);
+    hashUpdate(h, &len, sizeof(len));
+    hashUpdate(h, str, len);
+}
+
+static void hashHex(memoHash *h, char hex[MEMO_HEX_LEN]) {
+    snprintf(hex, MEMO_HEX_LEN, "%016llx%016llx", h->a, h->b);
+}
+
+static int hashFile(memoHash *h, const char *path) {
+    char buf[MEMO_COPY_BUF];
+    ssize_t n;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        hashUpdate(h, buf, n);
+    close(fd);
+    return n == 0 ? 0 : -1;
+}
+
+static int hashFileStat(memoHash *h, const char *path) {
+    struct stat st;
+    long long fields[4];
+    if (stat(path, &st) == -1)
+        return -1;
+    fields[0] = st.st_size;
+    fields[1] = st.st_ino;
+    fields[2] = st.st_mtim.tv_sec;
+    fields[3] = st.st_mtim.tv_nsec;
+    hashUpdate(h, fields, sizeof(fields));
+    return 0;
+}
+
+static int makeDirs(const char *path) {
+    char tmp[PATH_MAX];
+    char *p;
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(tmp, 0700);
+            *p = '/';
+        }
+    }
+    return mkdir(tmp, 0700) == -1 && access(tmp, W_OK) == -1 ? -1 : 0;
+}
+
+/* $MYSHELL_MEMO_DIR, or ~/.cache/myshell/memo; created on first use */
+static const char *storeDir() {
+    static char dir[PATH_MAX] = "";
+    char sub[PATH_MAX + 16];
+    if (dir[0])
+        return dir;
+
+    if (getenv("MYSHELL_MEMO_DIR"))
+        snprintf(dir, sizeof(dir), "%s", getenv("MYSHELL_MEMO_DIR"));
+    else
+        snprintf(dir, sizeof(dir), "%s/.cache/myshell/memo", getenv("HOME") ? getenv("HOME") : "/tmp");
+
+    snprintf(sub, sizeof(sub), "%s/objects", dir);
+    if (makeDirs(sub) == -1) {
+        perror("memo: cannot create store");
+        dir[0] = 0;
+        return NULL;
+    }
+    snprintf(sub, sizeof(sub), "%s/entries", dir);
+    makeDirs(sub);
+    snprintf(sub, sizeof(sub), "%s/tmp", dir);
+    makeDirs(sub);
+    return dir;
+}
+
+static int copyFd(int from, int to) {
+    char buf[MEMO_COPY_BUF];
+    ssize_t n;
+    while ((n = read(from, buf, sizeof(buf))) > 0) {
+        if (write(to, buf, n) != n)
+            return -1;
+    }
+    return n == 0 ? 0 : -1;
+}
+
+static int replayFile(const char *path, int to) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    int res = copyFd(fd, to);
+    close(fd);
+    return res;
+}
+
+/* Moves a finished capture into objects/<content hash>; identical outputs share one object */
+static int storeObject(const char *dir, const char *tmpPath, char hex[MEMO_HEX_LEN]) {
+    char path[PATH_MAX];
+    memoHash h;
+    hashInit(&h);
+    if (hashFile(&h, tmpPath) == -1)
+        return -1;
+    hashHex(&h, hex);
+
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, hex);
+    if (access(path, F_OK) == 0) {
+        unlink(tmpPath);
+        return 0;
+    }
+    return rename(tmpPath, path);
+}
+
+static int readEntry(const char *path, int *status, char out[MEMO_HEX_LEN], char err[MEMO_HEX_LEN]) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    int res = fscanf(f, "status %d\nstdout %32s\nstderr %32s\n", status, out, err) == 3 ? 0 : -1;
+    fclose(f);
+    return res;
+}
+
+static int writeEntry(const char *dir, const char *key, int status, const char *out, const char *err) {
+    char tmp[PATH_MAX], path[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s/tmp/entry.%d", dir, getpid());
+    snprintf(path, sizeof(path), "%s/entries/%s", dir, key);
+
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return -1;
+    fprintf(f, "status %d\nstdout %s\nstderr %s\n", status, out, err);
+    fclose(f);
+    return rename(tmp, path);
+}
+
+static int compareEntryAge(const void *a, const void *b) {
+    const memoEntry *x = (const memoEntry *)a, *y = (const memoEntry *)b;
+    return x->mtime < y->mtime ? -1 : x->mtime > y->mtime;
+}
+
+static int compareObjectName(const void *a, const void *b) {
+    return strcmp(((const memoObject *)a)->name, ((const memoObject *)b)->name);
+}
+
+static memoObject *findObject(memoObject *objects, int count, const char *name) {
+    memoObject key;
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    return (memoObject *)bsearch(&key, objects, count, sizeof(memoObject), compareObjectName);
+}
+
+static void dropRef(const char *dir, memoObject *obj, long long *total) {
+    char path[PATH_MAX];
+    if (obj == NULL || --obj->refs > 0)
+        return;
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, obj->name);
+    unlink(path);
+    *total -= obj->size;
+}
+
+/* Loads the store index. Returns the total object size, or -1 on error */
+static long long loadStore(const char *dir, memoEntry **pEntries, int *nEntries, memoObject **pObjects, int *nObjects) {
+    char path[PATH_MAX];
+    struct dirent *ent;
+    struct stat st;
+    long long total = 0;
+    int cap = 64, i;
+    DIR *d;
+
+    memoObject *objects = (memoObject *)malloc(cap * sizeof(memoObject));
+    int count = 0;
+    snprintf(path, sizeof(path), "%s/objects", dir);
+    if ((d = opendir(path)) == NULL) {
+        free(objects);
+        return -1;
+    }
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) != MEMO_HEX_LEN - 1)
+            continue;
+        snprintf(path, sizeof(path), "%s/objects/%s", dir, ent->d_name);
+        if (stat(path, &st) == -1)
+            continue;
+        if (count == cap)
+            objects = (memoObject *)realloc(objects, (cap *= 2) * sizeof(memoObject));
+        snprintf(objects[count].name, MEMO_HEX_LEN, "%.32s", ent->d_name);
+        objects[count].size = st.st_size;
+        objects[count].refs = 0;
+        total += st.st_size;
+        count++;
+    }
+    closedir(d);
+    qsort(objects, count, sizeof(memoObject), compareObjectName);
+
+    cap = 64;
+    memoEntry *entries = (memoEntry *)malloc(cap * sizeof(memoEntry));
+    int nent = 0, status;
+    snprintf(path, sizeof(path), "%s/entries", dir);
+    if ((d = opendir(path)) != NULL) {
+        while ((ent = readdir(d)) != NULL) {
+            if (ent->d_name[0] == '.')
+                continue;
+            if (nent == cap)
+                entries = (memoEntry *)realloc(entries, (cap *= 2) * sizeof(memoEntry));
+            snprintf(path, sizeof(path), "%s/entries/%s", dir, ent->d_name);
+            if (stat(path, &st) == -1 || readEntry(path, &status, entries[nent].out, entries[nent].err) == -1)
+                continue;
+            snprintf(entries[nent].name, MEMO_HEX_LEN, "%.32s", ent->d_name);
+            entries[nent].mtime = st.st_mtime;
+            nent++;
+        }
+        closedir(d);
+    }
+
+    for (i = 0; i < nent; i++) {
+        memoObject *obj;
+        if ((obj = findObject(objects, count, entries[i].out)) != NULL)
+            obj->refs++;
+        if ((obj = findObject(objects, count, entries[i].err)) != NULL)
+            obj->refs++;
+    }
+
+    *pEntries = entries;
+    *nEntries = nent;
+    *pObjects = objects;
+    *nObjects = count;
+    return total;
+}
+
+/* Drops least recently used entries (hits refresh an entry's mtime) until the objects fit the limit */
+static void evict(const char *dir) {
+    memoEntry *entries;
+    memoObject *objects;
+    int nEntries, nObjects, i;
+    char path[PATH_MAX];
+
+    long long total = loadStore(dir, &entries, &nEntries, &objects, &nObjects);
+    if (total == -1)
+        return;
+
+    qsort(entries, nEntries, sizeof(memoEntry), compareEntryAge);
+    for (i = 0; i < nEntries && total > memo_limit; i++) {
+        snprintf(path, sizeof(path), "%s/entries/%s", dir, entries[i].name);
+        unlink(path);
+        dropRef(dir, findObject(objects, nObjects, entries[i].out), &total);
+        dropRef(dir, findObject(objects, nObjects, entries[i].err), &total);
+        memo_evictions++;
+    }
+
+    free(entries);
+    free(objects);
+}
+
+static int openStdout(cmdLine *pCmdLine) {
+    if (!pCmdLine->outputRedirect)
+        return STDOUT_FILENO;
+    int fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        perror("memo: open output file failed");
+    return fd;
+}
+
+static int replayEntry(const char *dir, cmdLine *pCmdLine, const char *out, const char *err) {
+    char outPath[PATH_MAX], errPath[PATH_MAX];
+    snprintf(outPath, sizeof(outPath), "%s/objects/%s", dir, out);
+    snprintf(errPath, sizeof(errPath), "%s/objects/%s", dir, err);
+    if (access(outPath, R_OK) == -1 || access(errPath, R_OK) == -1)
+        return -1;
+
+    int fd = openStdout(pCmdLine);
+    if (fd == -1)
+        return 0;
+    replayFile(outPath, fd);
+    replayFile(errPath, STDERR_FILENO);
+    if (fd != STDOUT_FILENO)
+        close(fd);
+    return 0;
+}
+
+static int runCaptured(cmdLine *pCmdLine, int outFd, int errFd) {
+    int status;
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("memo: fork failed");
+        return -1;
+    } else if (pid == 0) {
+        int in = open(pCmdLine->inputRedirect ? pCmdLine->inputRedirect : "/dev/null", O_RDONLY);
+        if (in == -1) {
+            perror("open input file failed");
+            _exit(1);
+        }
+        dup2(in, STDIN_FILENO);
+        dup2(outFd, STDOUT_FILENO);
+        dup2(errFd, STDERR_FILENO);
+        close(in);
+        close(outFd);
+        close(errFd);
+        execvp(pCmdLine->arguments[0], pCmdLine->arguments);
+        perror("execvp failed");
+        _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) == -1)
+        return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+int memoRun(cmdLine *pCmdLine, char **inputs, int nInputs, char **statInputs, int nStatInputs,
+            char **envNames, int nEnv) {
+    char key[MEMO_HEX_LEN], out[MEMO_HEX_LEN], err[MEMO_HEX_LEN];
+    char path[PATH_MAX], outTmp[PATH_MAX], errTmp[PATH_MAX], cwd[PATH_MAX];
+    int i, status;
+    memoHash h;
+
+    const char *dir = storeDir();
+    if (dir == NULL)
+        return -1;
+
+    hashInit(&h);
+    hashString(&h, MEMO_VERSION);
+    for (i = 0; i < pCmdLine->argCount; i++)
+        hashString(&h, pCmdLine->arguments[i]);
+    hashString(&h, getenv("PATH") ? getenv("PATH") : "");
+    for (i = 0; i < nEnv; i++) {
+        hashString(&h, envNames[i]);
+        hashString(&h, getenv(envNames[i]) ? getenv(envNames[i]) : "");
+    }
+    hashString(&h, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    for (i = 0; i < nInputs; i++) {
+        hashString(&h, inputs[i]);
+        if (hashFile(&h, inputs[i]) == -1) {
+            fprintf(stderr, "memo: cannot read input %s\n", inputs[i]);
+            return -1;
+        }
+    }
+    for (i = 0; i < nStatInputs; i++) {
+        hashString(&h, statInputs[i]);
+        if (hashFileStat(&h, statInputs[i]) == -1) {
+            fprintf(stderr, "memo: cannot stat input %s\n", statInputs[i]);
+            return -1;
+        }
+    }
+    if (pCmdLine->inputRedirect) {
+        hashString(&h, "<");
+        if (hashFile(&h, pCmdLine->inputRedirect) == -1) {
+            perror("open input file failed");
+            return -1;
+        }
+    }
+    hashHex(&h, key);
+
+    snprintf(path, sizeof(path), "%s/entries/%s", dir, key);
+    if (readEntry(path, &status, out, err) == 0 && replayEntry(dir, pCmdLine, out, err) == 0) {
+        utimes(path, NULL); /* mark as recently used */
+        memo_hits++;
+        return status;
+    }
+    memo_misses++;
+
+    snprintf(outTmp, sizeof(outTmp), "%s/tmp/out.XXXXXX", dir);
+    snprintf(errTmp, sizeof(errTmp), "%s/tmp/err.XXXXXX", dir);
+    int outFd = mkstemp(outTmp);
+    int errFd = mkstemp(errTmp);
+    if (outFd == -1 || errFd == -1) {
+        perror("memo: cannot create capture file");
+        if (outFd != -1) {
+            close(outFd);
+            unlink(outTmp);
+        }
+        if (errFd != -1) {
+            close(errFd);
+            unlink(errTmp);
+        }
+        return -1;
+    }
+
+    status = runCaptured(pCmdLine, outFd, errFd);
+    close(outFd);
+    close(errFd);
+
+    /* Failed execs and signalled runs are replayed once but never cached */
+    if (status != -1 && status != 127 && storeObject(dir, outTmp, out) == 0 && storeObject(dir, errTmp, err) == 0 &&
+        writeEntry(dir, key, status, out, err) == 0) {
+        replayEntry(dir, pCmdLine, out, err);
+        evict(dir);
+        return status;
+    }
+
+    int fd = openStdout(pCmdLine);
+    if (fd != -1) {
+        replayFile(outTmp, fd);
+        if (fd != STDOUT_FILENO)
+            close(fd);
+    }
+    replayFile(errTmp, STDERR_FILENO);
+    unlink(outTmp);
+    unlink(errTmp);
+    return status;
+}
+
+void memoPrintStats(FILE *out) {
+    memoEntry *entries;
+    memoObject *objects;
+    int nEntries = 0, nObjects = 0;
+    long lookups = memo_hits + memo_misses;
+
+    fprintf(out, "hits: %ld  misses: %ld  hit rate: %.1f%%  evictions: %ld\n", memo_hits, memo_misses,
+            lookups ? 100.0 * memo_hits / lookups : 0.0, memo_evictions);
+
+    const char *dir = storeDir();
+    if (dir == NULL)
+        return;
+    long long total = loadStore(dir, &entries, &nEntries, &objects, &nObjects);
+    if (total == -1)
+        return;
+    fprintf(out, "store: %s  entries: %d  objects: %d  size: %lld / %ld bytes\n", dir, nEntries, nObjects,
+            total, memo_limit);
+    free(entries);
+    free(objects);
+}
+
+void memoSetLimit(long bytes) {
+    memo_limit = bytes;
+    const char *dir = storeDir();
+    if (dir != NULL)
+        evict(dir);
+}
+
+void memoClear() {
+    char path[PATH_MAX];
+    const char *subdirs[] = {"entries", "objects"};
+    struct dirent *ent;
+    int i;
+
+    const char *dir = storeDir();
+    if (dir == NULL)
+        return;
+    for (i = 0; i < 2; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, subdirs[i]);
+        DIR *d = opendir(path);
+        if (d == NULL)
+            continue;
+        while ((ent = readdir(d)) != NULL) {
+            if (ent->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s/%s/%s", dir, subdirs[i], ent->d_name);
+            unlink(path);
+        }
+        closedir(d);
+    }
+}
@@ -0,0 +1,18 @@
+#define MEMO_DEFAULT_LIMIT (256L * 1024 * 1024)  /* default size bound of the store, in bytes */
+
+/* Runs the command through the memo store. The key covers argv, PATH and the variables */
+/* named in envNames, the cwd, the content of inputs, the size/mtime of statInputs and */
+/* the content of the command's input redirection (stdin is /dev/null otherwise). */
+/* On a hit the cached stdout, stderr and exit status are replayed without running it. */
+/* Returns the command's exit status, or -1 if it could not be run */
+int memoRun(cmdLine *pCmdLine, char **inputs, int nInputs, char **statInputs, int nStatInputs,
+            char **envNames, int nEnv);
+
+/* Prints session hit/miss counts and the size of the store */
+void memoPrintStats(FILE *out);
+
+/* Sets the size bound of the store, evicting least recently used entries if needed */
+void memoSetLimit(long bytes);
+
+/* Removes every entry and object from the store */
+void memoClear();
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/limits.h>
+#include "Metrics.h"
+
+#define HISTOGRAM_BUCKETS 10
+
+typedef struct histogram {
+    long counts[HISTOGRAM_BUCKETS]; /* observations <= the matching bound (not cumulative) */
+    long count;
+    double sum;
+} histogram;
+
+/* Upper bounds in seconds; parsing is measured in microseconds, reaping can take minutes */
+static const double parse_bounds[HISTOGRAM_BUCKETS] = {
+    0.000005, 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.005, 0.01};
+static const double reap_bounds[HISTOGRAM_BUCKETS] = {
+    0.001, 0.01, 0.1, 0.5, 1, 5, 10, 60, 300, 3600};
+
+static const char *counter_names[METRIC_COUNTERS] = {
+    "myshell_commands_total", "myshell_forks_total", "myshell_fork_failures_total", "myshell_exec_failures_total"};
+static const char *counter_help[METRIC_COUNTERS] = {
+    "Command lines executed.", "Child processes started.", "fork() calls that failed.",
+    "Children whose execvp failed (exit status 127)."};
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t metrics_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_t metrics_thread;
+static int metrics_running = 0;
+static int metrics_stopping = 0;
+static char metrics_path[PATH_MAX];
+static int metrics_interval = 15;
+
+static long counters[METRIC_COUNTERS];
+static int jobs_running, jobs_suspended, jobs_terminated;
+static histogram parse_time, reap_latency;
+
+static void observe(histogram *h, const double *bounds, double seconds) {
+    int i;
+    pthread_mutex_lock(&metrics_lock);
+    for (i = 0; i < HISTOGRAM_BUCKETS && seconds > bounds[i]; i++)
+        ;
+    if (i < HISTOGRAM_BUCKETS)
+        h->counts[i]++;
+    h->count++;
+    h->sum += seconds;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void writeHistogram(FILE *f, const char *name, const char *help, histogram *h, const double *bounds) {
+    long cumulative = 0;
+    int i;
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        cumulative += h->counts[i];
+        fprintf(f, "%s_bucket{le=\"%g\"} %ld\n", name, bounds[i], cumulative);
+    }
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %ld\n%s_sum %.9f\n%s_count %ld\n", name, h->count, name, h->sum, name, h->count);
+}
+
+/* Writes to a temporary file next to the target and renames it over, so readers never see a partial file */
+static void writeSnapshot() {
+    char tmp[PATH_MAX + 32];
+    int i;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", metrics_path, getpid());
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL)
+        return;
+
+    for (i = 0; i < METRIC_COUNTERS; i++)
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %ld\n", counter_names[i], counter_help[i],
+                counter_names[i], counter_names[i], counters[i]);
+    fprintf(f, "# HELP myshell_jobs Jobs in the process list by state.\n# TYPE myshell_jobs gauge\n");
+    fprintf(f, "myshell_jobs{state=\"running\"} %d\n", jobs_running);
+    fprintf(f, "myshell_jobs{state=\"suspended\"} %d\n", jobs_suspended);
+    fprintf(f, "myshell_jobs{state=\"terminated\"} %d\n", jobs_terminated);
+    writeHistogram(f, "myshell_parse_seconds", "Time spent parsing command lines.", &parse_time, parse_bounds);
+    writeHistogram(f, "myshell_reap_latency_seconds", "Time from SIGCHLD until the child was reaped.",
+                   &reap_latency, reap_bounds);
+
+    if (fclose(f) == 0)
+        rename(tmp, metrics_path);
+    else
+        unlink(tmp);
+}
+
+static void *writerLoop(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&metrics_lock);
+    while (!metrics_stopping) {
+        writeSnapshot();
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += metrics_interval;
+        while (!metrics_stopping &&
+               pthread_cond_timedwait(&metrics_wakeup, &metrics_lock, &deadline) != ETIMEDOUT)
+            ;
+    }
+    writeSnapshot();
+    pthread_mutex_unlock(&metrics_lock);
+    return NULL;
+}
+
+/* The writer holds the lock while it writes a snapshot; a child forked from another */
+/* thread meanwhile (by the batch scheduler) would otherwise inherit it locked */
+static void lockForFork() {
+    pthread_mutex_lock(&metrics_lock);
+}
+
+static void unlockAfterFork() {
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+int metricsStart(const char *path, int interval) {
+    static int atforkRegistered = 0;
+    metricsStop();
+
+    if (!atforkRegistered)
+        atforkRegistered = pthread_atfork(lockForFork, unlockAfterFork, unlockAfterFork) == 0;
+
+    snprintf(metrics_path, sizeof(metrics_path), "%s", path);
+    metrics_interval = interval > 0 ? interval : 1;
+    metrics_stopping = 0;
+    if (pthread_create(&metrics_thread, NULL, writerLoop, NULL) != 0)
+        return -1;
+    metrics_running = 1;
+    return 0;
+}
+
+void metricsStop() {
+    if (!metrics_running)
+        return;
+    pthread_mutex_lock(&metrics_lock);
+    metrics_stopping = 1;
+    pthread_cond_signal(&metrics_wakeup);
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_join(metrics_thread, NULL);
+    metrics_running = 0;
+}
+
+int metricsEnabled() {
+    return metrics_running;
+}
+
+void metricsPrintStatus(FILE *out) {
+    if (metrics_running)
+        fprintf(out, "metrics: writing %s every %ds\n", metrics_path, metrics_interval);
+    else
+        fprintf(out, "metrics: off\n");
+}
+
+void metricsCount(int counter) {
+    pthread_mutex_lock(&metrics_lock);
+    counters[counter]++;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void metricsSetJobs(int running, int suspended, int terminated) {
+    pthread_mutex_lock(&metrics_lock);
+    jobs_running = running;
+    jobs_suspended = suspended;
+    jobs_terminated = terminated;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void metricsObserveParse(double seconds) {
+    observe(&parse_time, parse_bounds, seconds);
+}
+
+void metricsObserveReap(double seconds) {
+    observe(&reap_latency, reap_bounds, seconds);
+}
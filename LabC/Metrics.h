@@ -0,0 +1,24 @@
+#define METRIC_COMMANDS 0        /* command lines executed */
+#define METRIC_FORKS 1           /* child processes started */
+#define METRIC_FORK_FAILURES 2   /* fork() calls that failed */
+#define METRIC_EXEC_FAILURES 3   /* children that exited with 127 (execvp failed) */
+#define METRIC_COUNTERS 4
+
+/* Starts (or re-targets) the writer thread, which atomically replaces path with a */
+/* Prometheus text-format snapshot every interval seconds */
+/* Returns 0 on success, -1 if the thread could not be started */
+int metricsStart(const char *path, int interval);
+
+/* Writes a final snapshot and stops the writer thread. Safe to call when not started */
+void metricsStop();
+
+/* Returns 1 while the writer thread is running */
+int metricsEnabled();
+
+/* Prints the current configuration */
+void metricsPrintStatus(FILE *out);
+
+void metricsCount(int counter);
+void metricsSetJobs(int running, int suspended, int terminated);
+void metricsObserveParse(double seconds);
+void metricsObserveReap(double seconds);
@@ -0,0 +1,127 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include "LineParser.h"
+#include "Optimizer.h"
+
+/* cat with no operands, options or redirections copies stdin to stdout unchanged */
+static int isPassThrough(cmdLine *pCmdLine) {
+    return strcmp(pCmdLine->arguments[0], "cat") == 0 && pCmdLine->argCount == 1 &&
+           !pCmdLine->inputRedirect && !pCmdLine->outputRedirect;
+}
+
+/* cat FILE (or cat < FILE) with nothing else only feeds a single file into the pipe */
+static int isUselessCat(cmdLine *pCmdLine) {
+    if (strcmp(pCmdLine->arguments[0], "cat") != 0 || pCmdLine->outputRedirect)
+        return 0;
+    if (pCmdLine->argCount == 1)
+        return pCmdLine->inputRedirect != NULL;
+    return pCmdLine->argCount == 2 && !pCmdLine->inputRedirect &&
+           pCmdLine->arguments[1][0] != '-';
+}
+
+/* head without file operands stops reading after a prefix of its input */
+static int isHead(cmdLine *pCmdLine) {
+    int i;
+    if (strcmp(pCmdLine->arguments[0], "head") != 0 || pCmdLine->inputRedirect)
+        return 0;
+
+    for (i = 1; i < pCmdLine->argCount; i++) {
+        const char *arg = pCmdLine->arguments[i];
+        if ((strcmp(arg, "-n") == 0 || strcmp(arg, "-c") == 0) && i + 1 < pCmdLine->argCount) {
+            i++;
+        } else if (arg[0] != '-' || arg[1] == 0) {
+            return 0; /* a file operand (or stdin as "-"): leave it alone */
+        }
+    }
+    return 1;
+}
+
+/* Unlinks pCmdLine from the chain starting at *head and frees it */
+static void removeCmdLine(cmdLine **head, cmdLine *pCmdLine) {
+    cmdLine **link = head;
+    while (*link != pCmdLine)
+        link = &(*link)->next;
+
+    *link = pCmdLine->next;
+    if (!pCmdLine->next && pCmdLine != *head) {
+        cmdLine *last = *head;
+        while (last->next)
+            last = last->next;
+        last->blocking = pCmdLine->blocking;
+    }
+    pCmdLine->next = NULL;
+    freeCmdLines(pCmdLine);
+}
+
+int optimizeCmdLines(cmdLine **pCmdLine, FILE *log) {
+    cmdLine *curr, *next;
+    int rewrites = 0, idx = 0;
+
+    for (curr = *pCmdLine; curr && curr->next; curr = next) {
+        next = curr->next;
+
+        if (curr == *pCmdLine && isUselessCat(curr) && !next->inputRedirect) {
+            /* the file name may live in an argBuffer of the cat, so it is copied rather than stolen */
+            if (curr->argCount == 2) {
+                next->inputRedirect = strdup(curr->arguments[1]);
+            } else {
+                next->inputRedirect = curr->inputRedirect;
+                curr->inputRedirect = NULL;
+            }
+            if (log)
+                fprintf(log, "rewrite: cat %s | %s  ->  %s < %s\n", next->inputRedirect,
+                        next->arguments[0], next->arguments[0], next->inputRedirect);
+            removeCmdLine(pCmdLine, curr);
+            rewrites++;
+        } else if (curr != *pCmdLine && isPassThrough(curr)) {
+            if (log)
+                fprintf(log, "rewrite: dropped pass-through stage cat before %s\n", next->arguments[0]);
+            removeCmdLine(pCmdLine, curr);
+            rewrites++;
+        } else if (!next->next && !curr->outputRedirect && strcmp(next->arguments[0], "cat") == 0 &&
+                   next->argCount == 1 && !next->inputRedirect && next->outputRedirect) {
+            curr->outputRedirect = next->outputRedirect;
+            next->outputRedirect = NULL;
+            if (log)
+                fprintf(log, "rewrite: %s | cat > %s  ->  %s > %s\n", curr->arguments[0],
+                        curr->outputRedirect, curr->arguments[0], curr->outputRedirect);
+            removeCmdLine(pCmdLine, next);
+            next = curr;
+            rewrites++;
+        }
+    }
+
+    for (curr = *pCmdLine; curr; curr = curr->next)
+        curr->idx = idx++;
+
+    for (curr = (*pCmdLine)->next; curr; curr = curr->next) {
+        if (isHead(curr) && !curr->stopsUpstream) {
+            curr->stopsUpstream = 1;
+            if (log)
+                fprintf(log, "rewrite: stages before head (stage %d) stop when it exits\n", curr->idx);
+            rewrites++;
+        }
+    }
+
+    return rewrites;
+}
+
+void printCmdLines(cmdLine *pCmdLine, FILE *out) {
+    int i;
+    for (; pCmdLine; pCmdLine = pCmdLine->next) {
+        fprintf(out, "  [%d]", pCmdLine->idx);
+        for (i = 0; i < pCmdLine->argCount; i++)
+            fprintf(out, " %s", pCmdLine->arguments[i]);
+        if (pCmdLine->inputRedirect)
+            fprintf(out, " < %s", pCmdLine->inputRedirect);
+        if (pCmdLine->outputRedirect)
+            fprintf(out, " > %s", pCmdLine->outputRedirect);
+        if (!pCmdLine->next && !pCmdLine->blocking)
+            fprintf(out, " &");
+        if (pCmdLine->stopsUpstream)
+            fprintf(out, "    (terminates stages 0-%d on exit)", pCmdLine->idx - 1);
+        fprintf(out, "\n");
+    }
+}
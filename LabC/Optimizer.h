@@ -0,0 +1,12 @@
+/* Applies safe rewrites to a parsed chain of cmdLines before it is executed: */
+/*   cat FILE | cmd        ->  cmd < FILE */
+/*   a | cat | b           ->  a | b          (pass-through stages are dropped) */
+/*   a | cat > FILE        ->  a > FILE */
+/*   a | head ...          ->  a is terminated as soon as head exits */
+/* *pCmdLine may be replaced when its first command is removed. */
+/* Each applied rewrite is described on log unless log is NULL. */
+/* Returns the number of rewrites applied */
+int optimizeCmdLines(cmdLine **pCmdLine, FILE *log);
+
+/* Prints the chain one command per line, the way it will be executed */
+void printCmdLines(cmdLine *pCmdLine, FILE *out);
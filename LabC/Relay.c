@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include "Relay.h"
+
+#define RELAY_BUFFER_SIZE (1024 * 1024) /* per input of a merge, grown for longer lines */
+#define RELAY_MAX_EVENTS 64
+
+/* An input of a merge: data[start..len) has been read but not written yet */
+typedef struct source {
+    int fd;
+    char *data;
+    size_t start, len, cap;
+    size_t line;                       /* sorted merge: length of the line at start */
+    int eof;
+} source;
+
+/* Moves len bytes from the pipe in to out (a pipe or /dev/null); returns -1 if out is gone */
+static int spliceAll(int in, int out, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* out took only sent of the len bytes at the front of in: the chunk is duplicated into */
+/* the empty pipe pending, the part already sent is dropped and the rest is moved to out, */
+/* blocking until it fits */
+static int catchUp(int in, int out, int pending[2], int devnull, size_t sent, size_t len) {
+    ssize_t copied = tee(in, pending[1], len, 0);
+    int ok;
+    if (copied < (ssize_t)len) {
+        /* cannot happen while pending is as large as in; never deliver a gap */
+        if (copied > 0)
+            spliceAll(pending[0], devnull, copied);
+        return -1;
+    }
+    spliceAll(pending[0], devnull, sent);
+    ok = spliceAll(pending[0], out, len - sent);
+    if (ok == -1) {
+        int left = 0;
+        ioctl(pending[0], FIONREAD, &left);
+        spliceAll(pending[0], devnull, left);
+    }
+    return ok;
+}
+
+int relayTee(int in, int *outs, int count) {
+    int pending[2];
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int remaining = count;
+    int i, status = 0;
+    long capacity = fcntl(in, F_GETPIPE_SZ);
+
+    if (devnull == -1 || pipe2(pending, O_CLOEXEC) == -1)
+        return -1;
+    if (capacity > 0)
+        fcntl(pending[1], F_SETPIPE_SZ, capacity);
+
+    while (remaining > 0) {
+        struct pollfd pfd = {in, POLLIN, 0};
+        int avail = 0;
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            status = -1;
+            break;
+        }
+        if (ioctl(in, FIONREAD, &avail) == -1) {
+            status = -1;
+            break;
+        }
+        if (avail == 0) {
+            if (pfd.revents & (POLLHUP | POLLERR))
+                break;
+            continue;
+        }
+
+        for (i = 0; i < count; i++) {
+            ssize_t sent;
+            if (outs[i] == -1)
+                continue;
+            sent = tee(in, outs[i], avail, SPLICE_F_NONBLOCK);
+            if (sent == -1 && errno == EAGAIN)
+                sent = 0;
+            if (sent == -1 || (sent < avail && catchUp(in, outs[i], pending, devnull, sent, avail) == -1)) {
+                /* the consumer exited (EPIPE): the others carry on without it */
+                close(outs[i]);
+                outs[i] = -1;
+                remaining--;
+            }
+        }
+        if (spliceAll(in, devnull, avail) == -1) {
+            status = -1;
+            break;
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        if (outs[i] != -1)
+            close(outs[i]);
+    close(pending[0]);
+    close(pending[1]);
+    close(devnull);
+    return status;
+}
+
+static int writeAll(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Reads into the free space of src, first making room if it is full. Returns what read returned */
+static ssize_t fill(source *src) {
+    ssize_t n;
+    if (src->len == src->cap && src->start > 0) {
+        memmove(src->data, src->data + src->start, src->len - src->start);
+        src->len -= src->start;
+        src->start = 0;
+    }
+    if (src->len == src->cap) {
+        src->cap *= 2;
+        src->data = realloc(src->data, src->cap);
+    }
+    do {
+        n = read(src->fd, src->data + src->len, src->cap - src->len);
+    } while (n == -1 && errno == EINTR);
+    if (n > 0)
+        src->len += n;
+    else if (n == 0)
+        src->eof = 1;
+    return n;
+}
+
+/* Writes the complete lines of src, and at end of input whatever is left as one more line */
+static int flushLines(source *src, int out) {
+    char *from = src->data + src->start;
+    size_t pending = src->len - src->start;
+    char *nl = pending > 0 ? memrchr(from, '\n', pending) : NULL;
+    size_t n = src->eof ? pending : nl ? (size_t)(nl + 1 - from) : 0;
+    if (n > 0 && writeAll(out, from, n) == -1)
+        return -1;
+    if (n > 0 && from[n - 1] != '\n' && writeAll(out, "\n", 1) == -1)
+        return -1;
+    src->start += n;
+    if (src->start == src->len)
+        src->start = src->len = 0;
+    return 0;
+}
+
+static int mergeAsTheyCome(source *srcs, int count, int out) {
+    struct epoll_event events[RELAY_MAX_EVENTS];
+    int remaining = count;
+    int i, status = 0;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        return -1;
+    for (i = 0; i < count; i++) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = i;
+        fcntl(srcs[i].fd, F_SETFL, fcntl(srcs[i].fd, F_GETFL) | O_NONBLOCK);
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, srcs[i].fd, &ev) == -1)
+            remaining--;
+    }
+
+    while (remaining > 0 && status == 0) {
+        int ready = epoll_wait(epfd, events, RELAY_MAX_EVENTS, -1);
+        if (ready == -1 && errno == EINTR)
+            continue;
+        if (ready == -1) {
+            status = -1;
+            break;
+        }
+        /* one read per ready input and round keeps a chatty producer from starving the rest */
+        for (i = 0; i < ready && status == 0; i++) {
+            source *src = &srcs[events[i].data.u32];
+            ssize_t n = fill(src);
+            if (n == -1 && errno == EAGAIN)
+                continue;
+            if (n == -1)
+                src->eof = 1;
+            status = flushLines(src, out);
+            if (src->eof) {
+                epoll_ctl(epfd, EPOLL_CTL_DEL, src->fd, NULL);
+                remaining--;
+            }
+        }
+    }
+    close(epfd);
+    return status;
+}
+
+/* Makes the next line of src current, reading until it is complete; returns 0 when src is done */
+static int nextLine(source *src) {
+    char *nl;
+    while (!(nl = memchr(src->data + src->start, '\n', src->len - src->start)) && !src->eof)
+        if (fill(src) == -1)
+            src->eof = 1;
+    if (nl)
+        src->line = nl + 1 - (src->data + src->start);
+    else
+        src->line = src->len - src->start;
+    return src->line > 0;
+}
+
+/* Byte order of the current lines, without their newlines; a prefix sorts first */
+static int lineLess(const source *a, const source *b) {
+    size_t alen = a->line - (a->data[a->start + a->line - 1] == '\n');
+    size_t blen = b->line - (b->data[b->start + b->line - 1] == '\n');
+    int c = memcmp(a->data + a->start, b->data + b->start, alen < blen ? alen : blen);
+    return c < 0 || (c == 0 && alen < blen);
+}
+
+static void siftDown(source *srcs, int *heap, int n, int i) {
+    for (;;) {
+        int least = i, l = 2 * i + 1, r = l + 1, tmp;
+        if (l < n && lineLess(&srcs[heap[l]], &srcs[heap[least]]))
+            least = l;
+        if (r < n && lineLess(&srcs[heap[r]], &srcs[heap[least]]))
+            least = r;
+        if (least == i)
+            return;
+        tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+/* A heap keyed by each input's current line. Only the input whose line was just written */
+/* needs reading, so the merge blocks on exactly that one instead of polling all of them */
+static int mergeSorted(source *srcs, int count, int out) {
+    int *heap = malloc(sizeof(int) * count);
+    char *buffer = malloc(RELAY_BUFFER_SIZE);
+    size_t used = 0;
+    int n = 0, i, status = 0;
+
+    for (i = 0; i < count; i++)
+        if (nextLine(&srcs[i]))
+            heap[n++] = i;
+    for (i = n / 2 - 1; i >= 0; i--)
+        siftDown(srcs, heap, n, i);
+
+    while (n > 0 && status == 0) {
+        source *src = &srcs[heap[0]];
+        int terminated = src->data[src->start + src->line - 1] == '\n';
+        if (used + src->line + 1 > RELAY_BUFFER_SIZE) {
+            status = writeAll(out, buffer, used);
+            used = 0;
+        }
+        if (src->line + 1 > RELAY_BUFFER_SIZE) {
+            if (status == 0)
+                status = writeAll(out, src->data + src->start, src->line);
+            if (status == 0 && !terminated)
+                status = writeAll(out, "\n", 1);
+        } else {
+            memcpy(buffer + used, src->data + src->start, src->line);
+            used += src->line;
+            if (!terminated)
+                buffer[used++] = '\n';
+        }
+        src->start += src->line;
+        if (!nextLine(src))
+            heap[0] = heap[--n];
+        siftDown(srcs, heap, n, 0);
+    }
+    if (status == 0 && used > 0)
+        status = writeAll(out, buffer, used);
+    free(buffer);
+    free(heap);
+    return status;
+}
+
+int relayMerge(int *ins, int count, int out, int sorted) {
+    source *srcs = calloc(count, sizeof(source));
+    int i, status;
+    for (i = 0; i < count; i++) {
+        srcs[i].fd = ins[i];
+        srcs[i].cap = RELAY_BUFFER_SIZE;
+        srcs[i].data = malloc(RELAY_BUFFER_SIZE);
+    }
+    status = sorted ? mergeSorted(srcs, count, out) : mergeAsTheyCome(srcs, count, out);
+    for (i = 0; i < count; i++) {
+        close(srcs[i].fd);
+        free(srcs[i].data);
+    }
+    free(srcs);
+    close(out);
+    return status;
+}
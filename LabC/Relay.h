@@ -0,0 +1,17 @@
+#define RELAY_PIPE_SIZE (1024 * 1024)  /* capacity asked for the pipes around a relay */
+
+/* Copies everything read from the pipe in to each of the count pipes in outs, without */
+/* moving the data through user space: every chunk is duplicated with tee(2) and then */
+/* dropped from in. A consumer that cannot take the whole chunk gets the rest from a */
+/* private pipe before the next chunk is read, so the slowest consumer sets the pace. */
+/* A consumer that exits is dropped; the relay ends at end of input or when none is left. */
+/* Returns 0, or -1 if in could not be read */
+int relayTee(int in, int *outs, int count);
+
+/* Merges the output of the count pipes in ins into out one whole line at a time, so that */
+/* lines from different inputs never interleave; a last line without a newline gets one. */
+/* Without sorted, lines go out as they arrive (epoll over all inputs, each read into its */
+/* own large buffer). With sorted, every input must already be sorted (byte order, like */
+/* sort in the C locale) and the result is a single sorted stream. Returns 0, or -1 once */
+/* out is gone or an input cannot be read */
+int relayMerge(int *ins, int count, int out, int sorted);
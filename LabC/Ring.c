@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "Ring.h"
+
+typedef struct ring {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;            /* data came or went, or an end was closed */
+    char data[RING_SIZE];
+    size_t head;                       /* where the oldest unread byte is */
+    size_t count;                      /* unread bytes */
+    int reading, writing;              /* whether each end is still open */
+} ring;
+
+static ssize_t ringRead(void *cookie, char *buf, size_t size) {
+    ring *r = cookie;
+    size_t n, first;
+    pthread_mutex_lock(&r->lock);
+    while (r->count == 0 && r->writing)
+        pthread_cond_wait(&r->changed, &r->lock);
+    n = size < r->count ? size : r->count;
+    first = n < RING_SIZE - r->head ? n : RING_SIZE - r->head;
+    memcpy(buf, r->data + r->head, first);
+    memcpy(buf + first, r->data, n - first);
+    r->head = (r->head + n) % RING_SIZE;
+    r->count -= n;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+    return n;
+}
+
+static ssize_t ringWrite(void *cookie, const char *buf, size_t size) {
+    ring *r = cookie;
+    size_t done = 0;
+    pthread_mutex_lock(&r->lock);
+    while (done < size) {
+        size_t tail, n, first;
+        while (r->count == RING_SIZE && r->reading)
+            pthread_cond_wait(&r->changed, &r->lock);
+        if (!r->reading)
+            break;
+        tail = (r->head + r->count) % RING_SIZE;
+        n = size - done < RING_SIZE - r->count ? size - done : RING_SIZE - r->count;
+        first = n < RING_SIZE - tail ? n : RING_SIZE - tail;
+        memcpy(r->data + tail, buf + done, first);
+        memcpy(r->data, buf + done + first, n - first);
+        r->count += n;
+        done += n;
+        pthread_cond_broadcast(&r->changed);
+    }
+    pthread_mutex_unlock(&r->lock);
+    if (done == 0 && size > 0) {
+        errno = EPIPE;
+        return -1;
+    }
+    return done;
+}
+
+/* Closes one end; the second close frees the ring */
+static int closeEnd(ring *r, int *end) {
+    int last;
+    pthread_mutex_lock(&r->lock);
+    *end = 0;
+    last = !r->reading && !r->writing;
+    pthread_cond_broadcast(&r->changed);
+    pthread_mutex_unlock(&r->lock);
+    if (last) {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->changed);
+        free(r);
+    }
+    return 0;
+}
+
+static int closeReader(void *cookie) {
+    return closeEnd(cookie, &((ring*)cookie)->reading);
+}
+
+static int closeWriter(void *cookie) {
+    return closeEnd(cookie, &((ring*)cookie)->writing);
+}
+
+int ringOpen(FILE **reader, FILE **writer) {
+    cookie_io_functions_t readEnd = {ringRead, NULL, NULL, closeReader};
+    cookie_io_functions_t writeEnd = {NULL, ringWrite, NULL, closeWriter};
+    ring *r = malloc(sizeof(ring));
+    if (r == NULL)
+        return -1;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->changed, NULL);
+    r->head = r->count = 0;
+    r->reading = r->writing = 1;
+
+    *reader = fopencookie(r, "r", readEnd);
+    *writer = *reader ? fopencookie(r, "w", writeEnd) : NULL;
+    if (*writer == NULL) {
+        if (*reader)
+            fclose(*reader);   /* leaves the writer end open, so the ring is freed here */
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->changed);
+        free(r);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+#define RING_SIZE (64 * 1024)   /* bytes a ring holds, as much as a default pipe */
+
+/* Connects two threads of the shell like a pipe, but through a ring buffer in memory: what is */
+/* written to *writer can be read from *reader. A reader waits while the ring is empty and sees */
+/* end of file once the writer is closed; a writer waits while it is full and fails with EPIPE */
+/* once the reader is closed. The ring is freed when both streams are. Returns -1 on failure */
+int ringOpen(FILE **reader, FILE **writer);
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "LineParser.h"
+#include "ScriptCache.h"
+
+/* A compiled script is a header followed by its steps. A step is an op byte and then either */
+/* a terminated string, or for a command: the number of stages (2 bytes), and per stage its */
+/* argument count (2 bytes), a flags byte and the argument and redirection strings back to back. */
+/* Bump the version in SCRIPT_MAGIC whenever the layout or the compiler's rules change */
+#define SCRIPT_MAGIC "MSHC0003"
+
+#define STAGE_BLOCKING 1
+#define STAGE_STOPS_UPSTREAM 2
+#define STAGE_INPUT 4
+#define STAGE_OUTPUT 8
+
+typedef struct scriptHeader {
+    char magic[8];
+    unsigned long long size;        /* of the script when it was compiled */
+    long long mtimeSec;
+    long long mtimeNsec;
+    unsigned long long hash;        /* of the script's content */
+    unsigned long long length;      /* bytes of steps after the header */
+} scriptHeader;
+
+struct compiledScript {
+    char *data;                     /* the header and steps, mapped or malloc'd */
+    size_t size;
+    int mapped;
+    const char *pos;
+    const char *end;
+};
+
+typedef struct output {
+    char *data;
+    size_t len;
+    size_t cap;
+} output;
+
+static unsigned long long hashBytes(const char *data, size_t len) {
+    unsigned long long h = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void emit(output *out, const void *data, size_t len) {
+    if (out->len + len > out->cap) {
+        out->cap = (out->len + len) * 2;
+        out->data = (char*)realloc(out->data, out->cap);
+    }
+    memcpy(out->data + out->len, data, len);
+    out->len += len;
+}
+
+static void emitString(output *out, int op, const char *str) {
+    unsigned char byte = op;
+    emit(out, &byte, 1);
+    emit(out, str, strlen(str) + 1);
+}
+
+static void emitCommand(output *out, cmdLine *head) {
+    unsigned char byte = SCRIPT_OP_COMMAND;
+    unsigned short stages = 0;
+    cmdLine *curr;
+    int i;
+    for (curr = head; curr; curr = curr->next)
+        stages++;
+    emit(out, &byte, 1);
+    emit(out, &stages, sizeof(stages));
+
+    for (curr = head; curr; curr = curr->next) {
+        unsigned short argc = curr->argCount;
+        unsigned char flags = (curr->blocking ? STAGE_BLOCKING : 0) |
+                              (curr->stopsUpstream ? STAGE_STOPS_UPSTREAM : 0) |
+                              (curr->inputRedirect ? STAGE_INPUT : 0) |
+                              (curr->outputRedirect ? STAGE_OUTPUT : 0);
+        emit(out, &argc, sizeof(argc));
+        emit(out, &flags, 1);
+        for (i = 0; i < curr->argCount; i++)
+            emit(out, curr->arguments[i], strlen(curr->arguments[i]) + 1);
+        if (curr->inputRedirect)
+            emit(out, curr->inputRedirect, strlen(curr->inputRedirect) + 1);
+        if (curr->outputRedirect)
+            emit(out, curr->outputRedirect, strlen(curr->outputRedirect) + 1);
+    }
+}
+
+/* A line that can be parsed once is stored parsed; a $(...) or a { ... } group stays text */
+static void emitLine(output *out, const char *line) {
+    cmdLine *parsed = strstr(line, "$(") || strstr(line, "|{") || line[0] == '{' ? NULL : parseCmdLines(line);
+    if (parsed)
+        emitCommand(out, parsed);
+    else
+        emitString(out, SCRIPT_OP_TEXT, line);
+    freeCmdLines(parsed);
+}
+
+static int isWord(const char *line, const char *word) {
+    size_t len = strlen(word);
+    return strncmp(line, word, len) == 0 && (line[len] == '\0' || isspace((unsigned char)line[len]));
+}
+
+/* Follows the rules of processLine and defineFunctionLine, one line at a time */
+static void compile(output *out, const char *text, size_t len) {
+    const char *end = text + len;
+    int defining = 0;
+    char name[200];
+
+    while (text < end) {
+        const char *eol = memchr(text, '\n', end - text);
+        char *line = strndup(text, (eol ? eol : end) - text);
+        char *start = line;
+        text = eol ? eol + 1 : end;
+
+        while (*start == ' ' || *start == '\t')
+            start++;
+        if (defining) {
+            if (isWord(start, "end")) {
+                emitString(out, SCRIPT_OP_END, "");
+                defining = 0;
+            } else if (start[0] != '\0' && start[0] != '#')
+                emitLine(out, start);
+        } else if (start[0] == '#' || start[0] == '\0')
+            ;
+        else if (isWord(start, "function")) {
+            defining = sscanf(start + 8, "%199s", name) == 1;
+            if (defining)
+                emitString(out, SCRIPT_OP_FUNCTION, name);
+            else
+                emitString(out, SCRIPT_OP_TEXT, start);
+        } else
+            emitLine(out, start);
+        free(line);
+    }
+}
+
+/* Only entries nobody else could have written are trusted: owned by us, not group or world writable */
+static int isPrivate(const struct stat *st) {
+    return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/* Creates the missing directories of path; the last one has to be a private directory */
+static int makeDirs(const char *path) {
+    char tmp[PATH_MAX];
+    struct stat st;
+    char *p;
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = 0;
+            mkdir(tmp, 0700);
+            *p = '/';
+        }
+    }
+    mkdir(tmp, 0700);
+    if (lstat(tmp, &st) == -1 || !S_ISDIR(st.st_mode) || !isPrivate(&st))
+        return -1;
+    return 0;
+}
+
+/* <cache dir>/<hash of the script's real path>.msc; returns -1 if caching is off or unusable. */
+/* Without HOME there is no per-user place for it, so caching is off rather than shared in /tmp */
+static int cachePath(const char *script, char *path, size_t size) {
+    char dir[PATH_MAX];
+    char real[PATH_MAX];
+    const char *env = getenv(SCRIPT_CACHE_ENV);
+    const char *home = getenv("HOME");
+    if (env && strcmp(env, "off") == 0)
+        return -1;
+
+    if (env && env[0])
+        snprintf(dir, sizeof(dir), "%s", env);
+    else if (home && home[0])
+        snprintf(dir, sizeof(dir), "%s/.cache/myshell/scripts", home);
+    else
+        return -1;
+    if (makeDirs(dir) == -1)
+        return -1;
+
+    if (!realpath(script, real))
+        snprintf(real, sizeof(real), "%s", script);
+    snprintf(path, size, "%s/%016llx.msc", dir, hashBytes(real, strlen(real)));
+    return 0;
+}
+
+/* Maps the cache file if it was compiled from exactly this content */
+static compiledScript *mapCached(const char *path, const scriptHeader *want) {
+    struct stat st;
+    scriptHeader *header;
+    compiledScript *script;
+    char *data;
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || !isPrivate(&st) ||
+        st.st_size < (off_t)sizeof(scriptHeader)) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return NULL;
+
+    header = (scriptHeader*)data;
+    if (memcmp(header->magic, SCRIPT_MAGIC, 8) != 0 || header->size != want->size ||
+        header->mtimeSec != want->mtimeSec || header->mtimeNsec != want->mtimeNsec ||
+        header->hash != want->hash || header->length != st.st_size - sizeof(scriptHeader)) {
+        munmap(data, st.st_size);
+        return NULL;
+    }
+    script = (compiledScript*)calloc(1, sizeof(compiledScript));
+    script->data = data;
+    script->size = st.st_size;
+    script->mapped = 1;
+    return script;
+}
+
+/* Written to a temporary file and renamed, so readers see the old entry or the whole new one */
+static void storeCached(const char *path, const output *out) {
+    char tmp[PATH_MAX + 32];
+    int fd;
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    unlink(tmp);                    /* left behind by an earlier shell that had this pid */
+    fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return;
+    if (write(fd, out->data, out->len) != (ssize_t)out->len || close(fd) == -1 || rename(tmp, path) == -1)
+        unlink(tmp);
+}
+
+static char *readScript(int fd, size_t size) {
+    char *text = (char*)malloc(size + 1);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, text + done, size - done);
+        if (n <= 0) {
+            free(text);
+            return NULL;
+        }
+        done += n;
+    }
+    text[size] = 0;
+    return text;
+}
+
+compiledScript *scriptOpen(const char *path) {
+    struct stat st;
+    scriptHeader header;
+    compiledScript *script = NULL;
+    char cache[PATH_MAX + 32];
+    output out = {NULL, 0, 0};
+    char *text;
+    int caching;
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+        return NULL;
+    }
+    text = readScript(fd, st.st_size);
+    close(fd);
+    if (!text)
+        return NULL;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCRIPT_MAGIC, 8);
+    header.size = st.st_size;
+    header.mtimeSec = st.st_mtim.tv_sec;
+    header.mtimeNsec = st.st_mtim.tv_nsec;
+    header.hash = hashBytes(text, st.st_size);
+
+    caching = cachePath(path, cache, sizeof(cache)) == 0;
+    if (caching && (script = mapCached(cache, &header))) {
+        free(text);
+    } else {
+        emit(&out, &header, sizeof(header));
+        compile(&out, text, st.st_size);
+        free(text);
+        ((scriptHeader*)out.data)->length = out.len - sizeof(header);
+        if (caching)
+            storeCached(cache, &out);
+        script = (compiledScript*)calloc(1, sizeof(compiledScript));
+        script->data = out.data;
+        script->size = out.len;
+    }
+    script->pos = script->data + sizeof(scriptHeader);
+    script->end = script->data + script->size;
+    return script;
+}
+
+/* Returns the string at *pos and moves past it, or NULL if it runs past end */
+static const char *takeString(const char **pos, const char *end) {
+    const char *str = *pos;
+    const char *nul = memchr(str, 0, end - str);
+    if (!nul)
+        return NULL;
+    *pos = nul + 1;
+    return str;
+}
+
+/* Builds a command's chain; the arguments of each stage share one argBuffer */
+static cmdLine *takeCommand(const char **pos, const char *end) {
+    cmdLine *head = NULL;
+    cmdLine **link = &head;
+    const char *p = *pos;
+    unsigned short stages;
+    int idx, i;
+    if (end - p < 2)
+        return NULL;
+    memcpy(&stages, p, sizeof(stages));
+    p += 2;
+
+    for (idx = 0; idx < stages; idx++) {
+        unsigned short argc;
+        unsigned char flags;
+        const char *args;
+        cmdLine *curr;
+        if (end - p < 3)
+            break;
+        memcpy(&argc, p, sizeof(argc));
+        flags = p[2];
+        p += 3;
+        if (argc > MAX_ARGUMENTS)
+            break;
+
+        curr = (cmdLine*)calloc(1, sizeof(cmdLine));
+        *link = curr;
+        link = &curr->next;
+        args = p;
+        for (i = 0; i < argc; i++)
+            if (!takeString(&p, end))
+                break;
+        if (i < argc)
+            break;
+        if (argc > 0) {
+            argBuffer *buffer = (argBuffer*)malloc(sizeof(argBuffer) + (p - args));
+            const char *word = buffer->data;
+            memcpy(buffer->data, args, p - args);
+            buffer->size = p - args - 1;
+            buffer->next = NULL;
+            curr->buffers = buffer;
+            for (i = 0; i < argc; i++) {
+                ((char**)curr->arguments)[i] = (char*)word;
+                word += strlen(word) + 1;
+            }
+        }
+        curr->argCount = argc;
+        curr->blocking = (flags & STAGE_BLOCKING) != 0;
+        curr->stopsUpstream = (flags & STAGE_STOPS_UPSTREAM) != 0;
+        curr->idx = idx;
+        if (flags & STAGE_INPUT) {
+            const char *in = takeString(&p, end);
+            if (!in)
+                break;
+            curr->inputRedirect = strdup(in);
+        }
+        if (flags & STAGE_OUTPUT) {
+            const char *out = takeString(&p, end);
+            if (!out)
+                break;
+            curr->outputRedirect = strdup(out);
+        }
+    }
+    if (idx < stages) {
+        freeCmdLines(head);
+        return NULL;
+    }
+    *pos = p;
+    return head;
+}
+
+int scriptNext(compiledScript *script, int *op, const char **text, cmdLine **cmd) {
+    const char *p = script->pos;
+    if (p >= script->end)
+        return 0;
+
+    *op = (unsigned char)*p++;
+    *text = NULL;
+    *cmd = NULL;
+    if (*op == SCRIPT_OP_COMMAND)
+        *cmd = takeCommand(&p, script->end);
+    else
+        *text = takeString(&p, script->end);
+
+    /* a damaged cache file ends the script rather than running half a step */
+    if (*op > SCRIPT_OP_END || (*cmd == NULL && *text == NULL)) {
+        script->pos = script->end;
+        return 0;
+    }
+    script->pos = p;
+    return 1;
+}
+
+int scriptAtEnd(compiledScript *script) {
+    return script->pos >= script->end;
+}
+
+void scriptClose(compiledScript *script) {
+    if (!script)
+        return;
+    if (script->mapped)
+        munmap(script->data, script->size);
+    else
+        free(script->data);
+    free(script);
+}
@@ -0,0 +1,25 @@
+#define SCRIPT_CACHE_ENV "MYSHELL_SCRIPT_CACHE"   /* cache directory; ~/.cache/myshell/scripts by default, "off" disables it */
+                                                /* a directory or entry that is not ours alone, or writable by others, is not used */
+
+/* Steps of a compiled script, in the order processLine would take them */
+#define SCRIPT_OP_COMMAND 0     /* a parsed command line */
+#define SCRIPT_OP_TEXT 1        /* a line parsed when it runs: it has a $(...), or is "function" alone */
+#define SCRIPT_OP_FUNCTION 2    /* starts the body of the function named by text */
+#define SCRIPT_OP_END 3         /* ends the body */
+
+typedef struct compiledScript compiledScript;
+
+/* Returns the compiled form of the script at path. It is mapped from the cache when the */
+/* script's size, mtime and content hash still match; otherwise the script is compiled and */
+/* the result stored for the next run. Returns NULL (with errno set) if it cannot be read */
+compiledScript *scriptOpen(const char *path);
+
+/* Moves to the next step and returns 1, or returns 0 after the last one. For SCRIPT_OP_COMMAND */
+/* *cmd receives a new chain owned by the caller; otherwise *text points into the script */
+int scriptNext(compiledScript *script, int *op, const char **text, cmdLine **cmd);
+
+/* Returns 1 if the step scriptNext returned last was the final one */
+int scriptAtEnd(compiledScript *script);
+
+/* Unmaps or frees the compiled script */
+void scriptClose(compiledScript *script);
@@ -0,0 +1,12 @@
+/* Protocol between myshell --serve and myshell-client over a local Unix domain socket. */
+/* A request is a 4-byte length sent in one message with the client's stdin, stdout and */
+/* stderr attached (SCM_RIGHTS), followed by that many bytes: the cwd, the command line and */
+/* one NAME=value per environment variable, each terminated by a null byte. */
+/* The reply is the 4-byte exit status of the command line. */
+
+#define SERVE_SOCKET_ENV "MYSHELL_SOCK"           /* where the client looks for the socket */
+#define SERVE_DEFAULT_SOCKET "/tmp/myshell-%d.sock" /* ...otherwise, formatted with the uid */
+#define SERVE_MAX_REQUEST (4 * 1024 * 1024)
+#define SERVE_FDS 3
+#define SERVE_REQUEST_TIMEOUT_MS 2000   /* a request not fully sent by then is dropped */
+#define SERVE_RETRY_MS 100              /* pause before accepting again when out of fds */
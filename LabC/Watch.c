@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "LineParser.h"
+#include "Glob.h"
+#include "Watch.h"
+
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+#define WATCH_BUFFER_SIZE (64 * 1024)
+#define DEPTH_ANY -1
+
+/* What one watch descriptor stands for; indexed by the descriptor */
+typedef struct watchedDir {
+    char *path;                        /* as the patterns spell it; "" for the working directory */
+    int depth;                         /* levels below it that are watched too, or DEPTH_ANY */
+} watchedDir;
+
+struct watchSet {
+    int fd;
+    char *patterns[WATCH_MAX_PATTERNS];
+    int count;
+    watchedDir *dirs;
+    int ndirs;
+};
+
+/* Returns -1 if path itself could not be watched */
+static int addTree(watchSet *set, const char *path, int depth) {
+    DIR *dir;
+    struct dirent *entry;
+    int wd = inotify_add_watch(set->fd, path[0] ? path : ".", WATCH_EVENTS);
+    if (wd == -1)
+        return -1;
+
+    if (wd >= set->ndirs) {
+        set->dirs = realloc(set->dirs, sizeof(watchedDir) * (wd + 1));
+        memset(set->dirs + set->ndirs, 0, sizeof(watchedDir) * (wd + 1 - set->ndirs));
+        set->ndirs = wd + 1;
+    }
+    /* two patterns may share a directory; keep the deeper reach */
+    if (set->dirs[wd].path) {
+        if (set->dirs[wd].depth == DEPTH_ANY || (depth != DEPTH_ANY && depth <= set->dirs[wd].depth))
+            return 0;
+        free(set->dirs[wd].path);
+    }
+    set->dirs[wd].path = strdup(path);
+    set->dirs[wd].depth = depth;
+    if (depth == 0 || !(dir = opendir(path[0] ? path : ".")))
+        return 0;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char child[PATH_MAX];
+        struct stat st;
+        /* wildcards never match dot names, so hidden trees (.git) are left alone */
+        if (entry->d_name[0] == '.')
+            continue;
+        snprintf(child, sizeof(child), "%s%s%s", path, path[0] && path[strlen(path) - 1] != '/' ? "/" : "",
+                 entry->d_name);
+        if (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && S_ISDIR(st.st_mode)))
+            addTree(set, child, depth == DEPTH_ANY ? DEPTH_ANY : depth - 1);
+    }
+    closedir(dir);
+    return 0;
+}
+
+/* The leading components without wildcards name the directory to watch; the rest of the */
+/* pattern says how deep below it changes can match. A directory that does not exist yet is */
+/* watched through its nearest existing ancestor, reaching as much deeper as it is missing */
+static void watchPattern(watchSet *set, const char *pattern) {
+    char root[PATH_MAX] = "", *cut;
+    const char *p = pattern;
+    int depth = 0, missing = 0;
+    struct stat st;
+
+    if (*p == '/') {
+        strcpy(root, "/");
+        p++;
+    }
+    while (*p) {
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        char comp[NAME_MAX + 1];
+        snprintf(comp, sizeof(comp), "%.*s", (int)len, p);
+        if (!slash || globHasMeta(comp))
+            break;
+        if (len > 0)
+            snprintf(root + strlen(root), sizeof(root) - strlen(root), "%s%s", comp, "/");
+        p = slash + 1;
+    }
+    if (strlen(root) > 1)
+        root[strlen(root) - 1] = 0;
+
+    /* one level per remaining component, except that "**" may go any number deeper */
+    while (*p && depth != DEPTH_ANY) {
+        const char *slash = strchr(p, '/');
+        if (strncmp(p, "**", 2) == 0 && (p[2] == '/' || p[2] == 0))
+            depth = DEPTH_ANY;
+        else if (slash && slash[1])
+            depth++;
+        p = slash ? slash + 1 : p + strlen(p);
+    }
+
+    while (root[0] && strcmp(root, "/") != 0 && !(stat(root, &st) == 0 && S_ISDIR(st.st_mode))) {
+        cut = strrchr(root, '/');
+        if (cut == root)
+            cut[1] = 0;
+        else if (cut)
+            *cut = 0;
+        else
+            root[0] = 0;
+        missing++;
+    }
+    if (missing > 0)
+        fprintf(stderr, "watch: %s: no such directory yet, watching %s for it\n", pattern, root[0] ? root : ".");
+    if (addTree(set, root, depth == DEPTH_ANY ? DEPTH_ANY : depth + missing) == -1)
+        fprintf(stderr, "watch: cannot watch %s: %s\n", root[0] ? root : ".", strerror(errno));
+}
+
+watchSet *watchOpen(char * const *patterns, int count) {
+    watchSet *set;
+    int i;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    set = calloc(1, sizeof(watchSet));
+    set->fd = fd;
+    for (i = 0; i < count && i < WATCH_MAX_PATTERNS; i++) {
+        set->patterns[set->count++] = strdup(patterns[i]);
+        watchPattern(set, patterns[i]);
+    }
+    return set;
+}
+
+int watchFd(watchSet *set) {
+    return set->fd;
+}
+
+static int matchesPattern(watchSet *set, const char *path) {
+    int i;
+    for (i = 0; i < set->count; i++)
+        if (globMatch(set->patterns[i], path))
+            return 1;
+    return 0;
+}
+
+int watchRead(watchSet *set) {
+    char buffer[WATCH_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int matched = 0;
+    ssize_t n;
+
+    while ((n = read(set->fd, buffer, sizeof(buffer))) > 0) {
+        char *p;
+        for (p = buffer; p < buffer + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event *event = (struct inotify_event*)p;
+            watchedDir *dir = event->wd >= 0 && event->wd < set->ndirs ? &set->dirs[event->wd] : NULL;
+            char path[PATH_MAX];
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                matched++;
+                continue;
+            }
+            if (!dir || !dir->path)
+                continue;
+            if (event->mask & IN_IGNORED) {
+                free(dir->path);
+                dir->path = NULL;
+                continue;
+            }
+            if (event->len == 0)
+                continue;
+
+            snprintf(path, sizeof(path), "%s%s%s", dir->path,
+                     dir->path[0] && dir->path[strlen(dir->path) - 1] != '/' ? "/" : "", event->name);
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && dir->depth != 0 &&
+                event->name[0] != '.')
+                addTree(set, path, dir->depth == DEPTH_ANY ? DEPTH_ANY : dir->depth - 1);
+            if (matchesPattern(set, path))
+                matched++;
+        }
+    }
+    return matched;
+}
+
+void watchClose(watchSet *set) {
+    int i;
+    if (!set)
+        return;
+    close(set->fd);
+    for (i = 0; i < set->ndirs; i++)
+        free(set->dirs[i].path);
+    for (i = 0; i < set->count; i++)
+        free(set->patterns[i]);
+    free(set->dirs);
+    free(set);
+}
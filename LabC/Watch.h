@@ -0,0 +1,20 @@
+#define WATCH_DEBOUNCE_MS 100   /* changes closer together than this trigger a single run */
+#define WATCH_MAX_PATTERNS 16
+
+typedef struct watchSet watchSet;
+
+/* Puts inotify watches on the directories a pattern can match in: those under its leading */
+/* literal components, as deep as the pattern reaches (all of them below a "**"). */
+/* Directories that appear later are watched as their creation is read. Returns NULL */
+/* (with errno set) if inotify is unavailable */
+watchSet *watchOpen(char * const *patterns, int count);
+
+/* Returns the descriptor that becomes readable when events are pending */
+int watchFd(watchSet *set);
+
+/* Reads the pending events without blocking. Returns the number of them that named a */
+/* path matching one of the patterns; a lost-events overflow counts as a match */
+int watchRead(watchSet *set);
+
+/* Removes the watches and frees the set */
+void watchClose(watchSet *set);
@@ -0,0 +1,59 @@
+// globcheck: regression cases for the glob matcher (Glob.c), run with "make glob-check".
+// Every case is a pattern, a path and whether the path has to match. globExpand is also run on
+// each pattern, which only has to come back without touching memory past the pattern (build with
+// -fsanitize=address to see that it does not).
+//
+// usage: globcheck
+// exits with 1 if a case fails.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "LineParser.h"
+#include "Glob.h"
+
+typedef struct globCase {
+    const char *pattern;
+    const char *path;
+    int matches;
+} globCase;
+
+static const globCase cases[] = {
+    // a '[' that is not closed within its component is literal
+    {"[", "[", 1},
+    {"x[", "x[", 1},
+    {"[!", "[!", 1},
+    {"[^", "[^", 1},
+    {"x[!", "x[!", 1},
+    // ...and a class never runs into the next component
+    {"d/[!/x]", "d/[!/x]", 1},
+    {"d/[!/x]", "d/a/x]", 0},
+    {"d/[/x]", "d/a/x]", 0},
+    // closed classes
+    {"[]]", "]", 1},
+    {"[!]]", "a", 1},
+    {"[!]]", "]", 0},
+    {"[a-c]x", "bx", 1},
+    {"[!a-c]x", "bx", 0},
+    {"[!a-c]x", "dx", 1},
+};
+
+int main() {
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        const globCase *c = &cases[i];
+        int matched = globMatch(c->pattern, c->path);
+        if (matched != c->matches) {
+            fprintf(stderr, "globcheck: %s %s %s, expected the opposite\n", c->pattern,
+                    matched ? "matches" : "does not match", c->path);
+            failed++;
+        }
+
+        argBuffer *buffer = NULL;
+        char *words[4];
+        if (globExpand(c->pattern, &buffer, words, 4) > 0) {
+            free(buffer);
+        }
+    }
+    printf("globcheck: %d of %zu cases failed\n", failed, sizeof(cases) / sizeof(cases[0]));
+    return failed > 0;
+}
@@ -0,0 +1,115 @@
+// myshell-client: hands a command line to a running "myshell --serve" daemon and exits with its status.
+// Its stdin, stdout and stderr are passed along with the request, so it can be used as a SHELL:
+//     make SHELL=/path/to/myshell-client
+//
+// usage: myshell-client [-s SOCKET] -c COMMAND
+// the socket defaults to $MYSHELL_SOCK, then /tmp/myshell-<uid>.sock
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "Serve.h"
+
+extern char **environ;
+
+int main(int argc, char **argv) {
+    char socketPath[PATH_MAX];
+    const char *command = NULL;
+
+    if (getenv(SERVE_SOCKET_ENV)) {
+        snprintf(socketPath, sizeof(socketPath), "%s", getenv(SERVE_SOCKET_ENV));
+    } else {
+        snprintf(socketPath, sizeof(socketPath), SERVE_DEFAULT_SOCKET, (int)getuid());
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            snprintf(socketPath, sizeof(socketPath), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            command = argv[++i];
+        }
+    }
+    if (command == NULL) {
+        fprintf(stderr, "usage: myshell-client [-s SOCKET] -c COMMAND\n");
+        return 2;
+    }
+
+    // Request payload: cwd, command line and environment, each null-terminated
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd() error");
+        return 1;
+    }
+    size_t len = strlen(cwd) + 1 + strlen(command) + 1;
+    for (char **var = environ; *var != NULL; var++) {
+        len += strlen(*var) + 1;
+    }
+    if (len > SERVE_MAX_REQUEST) {
+        fprintf(stderr, "myshell-client: request too large\n");
+        return 1;
+    }
+    char *request = malloc(len);
+    char *p = request;
+    p = stpcpy(p, cwd) + 1;
+    p = stpcpy(p, command) + 1;
+    for (char **var = environ; *var != NULL; var++) {
+        p = stpcpy(p, *var) + 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "myshell-client: socket path too long\n");
+        return 127;
+    }
+    strcpy(addr.sun_path, socketPath);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "myshell-client: cannot connect to %s: ", socketPath);
+        perror(NULL);
+        return 127;
+    }
+
+    // The length goes out together with our stdin, stdout and stderr
+    unsigned int header = len;
+    int fds[SERVE_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&header, sizeof(header)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(header)) {
+        perror("myshell-client: sendmsg failed");
+        return 127;
+    }
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = write(sock, request + sent, len - sent);
+        if (n <= 0) {
+            perror("myshell-client: write failed");
+            return 127;
+        }
+        sent += n;
+    }
+
+    int status;
+    if (read(sock, &status, sizeof(status)) != sizeof(status)) {
+        fprintf(stderr, "myshell-client: daemon closed the connection\n");
+        return 127;
+    }
+    return status;
+}
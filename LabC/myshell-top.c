@@ -0,0 +1,122 @@
+// myshell-top: lists the jobs of every running myshell on the host, read from the shared-memory
+// job tables the shells publish (see JobTable.h). Reading never blocks or signals the shells.
+//
+// usage: myshell-top [-p SHELLPID] [-f [SECONDS]]
+// -f keeps refreshing the list, every second by default
+//
+// The states are those a shell last published: it refreshes them once a second while idle at its
+// prompt, but not while a foreground command runs, so a shell busy for longer is flagged as stale.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "JobTable.h"
+
+#define STALE_MS 3000 // a table older than this has missed several of the shell's idle refreshes
+
+// Prints the jobs of one shell; returns the number of jobs, or -1 if the table is unusable
+int printShell(const char *name, int onlyShell, jobTable *copy) {
+    char path[300];
+    snprintf(path, sizeof(path), "/%s", name);
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    const jobTable *table = (const jobTable *)mmap(NULL, sizeof(jobTable), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (table == MAP_FAILED) {
+        return -1;
+    }
+
+    int res = -1;
+    if (table->magic == JOBTABLE_MAGIC && (onlyShell == 0 || table->shellPid == onlyShell) &&
+        jobtableRead(table, copy) == 0) {
+        // a shell that crashed leaves its table behind
+        if (kill(copy->shellPid, 0) == -1 && errno == ESRCH) {
+            shm_unlink(path);
+        } else {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            long long nowMs = now.tv_sec * 1000LL + now.tv_usec / 1000;
+            long ticks = sysconf(_SC_CLK_TCK);
+
+            for (int i = 0; i < copy->count; i++) {
+                jobSlot *slot = &copy->slots[i];
+                printf("%-8d %-8d %-8d %-11s %9.2f %9lld %9.1f  %s\n", copy->shellPid, slot->pid, slot->pgid,
+                       slot->state == JOBSLOT_RUNNING ? "Running" :
+                       (slot->state == JOBSLOT_SUSPENDED ? "Suspended" : "Terminated"),
+                       (double)slot->cpuTicks / ticks, slot->rssKb, (nowMs - slot->startMs) / 1000.0, slot->cmd);
+            }
+            if (nowMs - copy->updatedMs > STALE_MS) {
+                printf("%-8d (states as of %.0f s ago, the shell is busy)\n", copy->shellPid,
+                       (nowMs - copy->updatedMs) / 1000.0);
+            }
+            if (copy->truncated) {
+                printf("%-8d (more jobs than fit in the shared table)\n", copy->shellPid);
+            }
+            res = copy->count;
+        }
+    }
+    munmap((void *)table, sizeof(jobTable));
+    return res;
+}
+
+void printAll(int onlyShell, jobTable *copy) {
+    printf("%-8s %-8s %-8s %-11s %9s %9s %9s  %s\n", "SHELL", "PID", "PGID", "STATE", "CPU(s)", "RSS(KB)",
+           "AGE(s)", "COMMAND");
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL) {
+        perror("opendir /dev/shm");
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, JOBTABLE_PREFIX, strlen(JOBTABLE_PREFIX)) == 0) {
+            printShell(ent->d_name, onlyShell, copy);
+        }
+    }
+    closedir(dir);
+}
+
+int main(int argc, char **argv) {
+    int onlyShell = 0;
+    int follow = 0;
+    int interval = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            onlyShell = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            follow = 1;
+            if (i + 1 < argc && atoi(argv[i + 1]) > 0) {
+                interval = atoi(argv[++i]);
+            }
+        } else {
+            fprintf(stderr, "usage: myshell-top [-p SHELLPID] [-f [SECONDS]]\n");
+            return 1;
+        }
+    }
+
+    jobTable *copy = malloc(sizeof(jobTable));
+    do {
+        if (follow) {
+            printf("\033[H\033[2J"); // clear the screen between refreshes
+        }
+        printAll(onlyShell, copy);
+        fflush(stdout);
+        if (follow) {
+            sleep(interval);
+        }
+    } while (follow);
+
+    free(copy);
+    return 0;
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,7 +10,34 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
 #include "LineParser.h"
+#include "Optimizer.h"
+#include "Memo.h"
+#include "Metrics.h"
+#include "JobLog.h"
+#include "Serve.h"
+#include "JobTable.h"
+#include "History.h"
+#include "Bench.h"
+#include "FastCopy.h"
+#include "Glob.h"
+#include "ScriptCache.h"
+#include "Watch.h"
+#include "Relay.h"
+#include "Batch.h"
+#include "Ring.h"
 #include <ctype.h> 
 
 #ifndef WCONTINUED
@@ -21,24 +50,279 @@
 #define SUSPENDED 0
 #define HISTLEN 20
 #define MAX_BUF 200
+#define PIPE_SIZE_DEFAULT 0        /* leave pipes at the kernel default capacity (64 KiB) */
+#define PIPE_SIZE_ADAPTIVE -1      /* start at the default and grow pipes whose writer stalls */
+#define PIPE_MAX_SIZE_PATH "/proc/sys/fs/pipe-max-size"
+#define ADAPTIVE_SAMPLE_US 2000    /* how often the adaptive monitor samples pipe fill levels */
+#define PIPESTAT_SAMPLE_US 10000   /* how often pipestat classifies the stages (when not adaptive) */
+#define PIPESTAT_DEFAULT_MS 500    /* default pipestat report interval */
+#define JOBTABLE_REFRESH_MS 1000   /* how often an idle prompt refreshes the shared job table */
+#define STAGE_CPU 0                /* pipestat verdicts: running on a CPU */
+#define STAGE_BLOCKED 1            /* sleeping with its output pipe full */
+#define STAGE_STARVED 2            /* sleeping with its input pipe empty */
+#define STAGE_WAITING 3            /* sleeping on something else (terminal, disk, ...) */
+#define STAGE_VERDICTS 4
+#define CAPTURE_CHUNK (64 * 1024)  /* minimum free space for each read of a $(...) capture */
+#define SUBST_MARK '\001'          /* brackets the index of a $(...) in the line handed to the parser */
+#define PATH_CACHE_BUCKETS 64
+#define IOHINT_OFF 0               /* redirected files are opened plainly */
+#define IOHINT_ON 1                /* every single command gets page-cache hints on its redirections */
+#define IOHINT_AUTO 2              /* only background jobs do (the default) */
+#define IOHINT_WINDOW (8L * 1024 * 1024) /* how much of an input file is read ahead up front */
+#define CALL_MAX_DEPTH 200         /* nested function calls and sourced files */
+#define GROUP_MAX 32               /* command lines inside one { ... } group */
+#define GROUP_FAN_OUT 0            /* producer |{ ... }: the relay tees one stream to every reader */
+#define GROUP_FAN_IN 1             /* { ... }| consumer: whole lines are merged as they arrive */
+#define GROUP_MERGE 2              /* { ... }|= consumer: sorted inputs are merged in order */
+#define PROCS_ANY_STATE 2          /* procs without --state */
+#define PROCS_SORT_PID 0           /* procs --sort keys, in the order of their names */
+#define PROCS_SORT_CPU 1
+#define PROCS_SORT_RSS 2
+#define PROCS_SORT_START 3
+#define PROCS_SORT_COMMAND 4
+#define PROCS_SORT_KEYS 5
+#define BUILTIN_STAGE 1            /* can run as a thread inside a pipeline */
+#define BUILTIN_READS_INPUT 2      /* reads its input (as a stage; other stages close theirs at once) */
+#define BUILTIN_PREFIX 4           /* first in a pipeline, takes the whole pipeline as its command */
+#define BUILTIN_CONSUMES 8         /* frees or keeps the cmdLine itself */
 
 char history[HISTLEN][MAX_BUF];
 int history_count = 0;
 int history_start = 0;
 int history_end = 0;
 int debug = 0; // Global variable to enable/disable debug mode
+long pipe_size = PIPE_SIZE_DEFAULT; // Session default for pipeline pipes, set by the pipesize builtin
+int optimize = 0; // Rewrite pipelines with optimizeCmdLines before running them (-O or the optimize builtin)
+long long sigchld_ns = 0; // When the oldest SIGCHLD not yet followed by a reap arrived (0 if none)
+// sigchld_ns is only touched through __atomic builtins: on -m32 a plain long long access is two
+// 32-bit ones, and a SIGCHLD landing between them would leave a torn time
+_Static_assert(__atomic_always_lock_free(sizeof(long long), 0), "sigchld_ns must be lock-free for the handler");
+__thread int last_status = 0; // Exit status of the last foreground command line (builtin pipeline stages keep their own)
+int pipestat_ms = 0; // Report interval of the running pipestat pipeline, 0 when not reporting
+int iohint_mode = IOHINT_AUTO; // Session setting of the iohint builtin
+int iohint_force = -1;         // Per-command override from the iohint prefix (-1 when not given)
+long long iohint_size = 0;     // Expected output size from "iohint -s SIZE", preallocated when set
+int glob_enabled = 1;          // Expand * ? [...] in arguments (the glob builtin turns it off)
+int quit_requested = 0;        // Set by quit, also from inside a function or a sourced file
+volatile sig_atomic_t watch_interrupted = 0; // Set by Ctrl-C while the watch builtin runs
+int returning = 0;             // Set by return: the rest of the running function or sourced file is skipped
+int call_depth = 0;            // Functions and sourced files currently running
+int procs_cleanup = 1;         // procs removes the terminated jobs it lists (procs --cleanup=manual turns this off)
+int procs_sort = PROCS_SORT_PID; // Sort key of the procs listing being built
+int exec_last = 0;             // Script mode: a simple command at the very end of the script replaces the shell
+
+const char *stage_verdicts[STAGE_VERDICTS] = {"cpu-bound", "blocked", "starved", "waiting"};
+
+typedef struct stageStat
+{
+    long long cpuTicks;           /* utime + stime at the last sample */
+    long long reportTicks;        /* utime + stime at the last report */
+    long long startTicks;         /* utime + stime at the first sample */
+    char state;                   /* scheduler state letter at the last sample */
+    int verdict;                  /* classification at the last sample, -1 before the first */
+    int counts[STAGE_VERDICTS];   /* samples per classification */
+} stageStat;
 
 typedef struct process
 {
     cmdLine *cmd;         /* the parsed command line*/
     pid_t pid;            /* the process id that is running the command*/
     int status;           /* status of the process: RUNNING/SUSPENDED/TERMINATED */
+    pid_t pgid;           /* process group of the process */
+    long long startMs;    /* wall-clock start time, ms since the epoch */
+    long long cpuTicks;   /* utime + stime at the last resource sample */
+    long long rssKb;      /* resident set size at the last resource sample */
+    int hintFd;           /* output file to drop from the page cache when the job ends, or -1 */
     struct process *next; /* next process in chain */
 } process;
 
 process *process_list = NULL; // Global process list
 
-void addToHistory(const char *cmd) {
+typedef struct function
+{
+    char *name;
+    int count;              /* number of body lines */
+    char **lines;           /* the body as typed */
+    cmdLine **parsed;       /* parse of each line, cached unless it has a $(...) to run per call */
+    int refs;               /* one for the definition, one per call running it */
+    struct function *next;
+} function;
+
+typedef struct frame
+{
+    const char *name;       /* $0 */
+    int argc;               /* $# */
+    char * const *argv;     /* $1 ...: point into the caller's cmdLine, which outlives the call */
+    struct frame *prev;
+} frame;
+
+function *functions = NULL; // Defined functions
+function *defining = NULL;  // Function whose body is being read (between "function NAME" and "end")
+frame *current_frame = NULL; // Positional parameters of the running function or script (NULL at the prompt)
+jobTable *job_table = NULL;   // Shared-memory copy of process_list for myshell-top (NULL if not published)
+pthread_mutex_t builtin_lock = PTHREAD_MUTEX_INITIALIZER; // Held by builtin pipeline stages that touch shell state
+
+typedef struct builtin
+{
+    const char *name;
+    void (*run)(cmdLine *pCmdLine, FILE *in, FILE *out); /* in is NULL unless it runs as a stage with input */
+    int flags;              /* BUILTIN_... */
+} builtin;
+
+typedef struct builtinStage
+{
+    const builtin *def;     /* NULL for a stage that runs a program */
+    cmdLine *cmd;
+    FILE *in;               /* the upstream stage's output, or NULL */
+    FILE *out;
+    int ownsOut;            /* out is the stage's own stream, closed when it finishes */
+    int started;
+    int status;
+    pthread_t thread;
+} builtinStage;
+
+typedef struct pathEntry
+{
+    char *name;             /* command name as typed */
+    char *path;             /* where it was found on PATH */
+    struct pathEntry *next; /* next entry in the same bucket */
+} pathEntry;
+
+pathEntry *path_cache[PATH_CACHE_BUCKETS]; // Resolved commands, so repeated commands skip the PATH search
+char *path_cache_env = NULL;               // The PATH the cache was filled for
+
+void clearPathCache() {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        while (path_cache[i] != NULL) {
+            pathEntry *next = path_cache[i]->next;
+            free(path_cache[i]->name);
+            free(path_cache[i]->path);
+            free(path_cache[i]);
+            path_cache[i] = next;
+        }
+    }
+    free(path_cache_env);
+    path_cache_env = NULL;
+}
+
+// Returns the full path of a command found on PATH (cached), or NULL to leave the lookup to execvp.
+// Called in the parent before forking so that the cache survives the child.
+const char *lookupCommand(const char *name) {
+    const char *pathEnv = getenv("PATH");
+    if (strchr(name, '/') != NULL || pathEnv == NULL) {
+        return NULL;
+    }
+    if (path_cache_env == NULL || strcmp(path_cache_env, pathEnv) != 0) {
+        clearPathCache();
+        path_cache_env = strdup(pathEnv);
+    }
+
+    unsigned int bucket = 0;
+    for (const char *c = name; *c; c++) {
+        bucket = bucket * 31 + (unsigned char)*c;
+    }
+    bucket %= PATH_CACHE_BUCKETS;
+    for (pathEntry *entry = path_cache[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry->path;
+        }
+    }
+
+    char candidate[PATH_MAX];
+    const char *dir = pathEnv;
+    while (*dir) {
+        const char *end = strchrnul(dir, ':');
+        struct stat st;
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)(end - dir), end == dir ? "." : dir, name);
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            pathEntry *entry = (pathEntry *)malloc(sizeof(pathEntry));
+            entry->name = strdup(name);
+            entry->path = strdup(candidate);
+            entry->next = path_cache[bucket];
+            path_cache[bucket] = entry;
+            return entry->path;
+        }
+        dir = *end ? end + 1 : end;
+    }
+    return NULL;
+}
+
+// Replaces the (child) process with the command. A stale cached path falls back to the PATH search.
+void execCommand(cmdLine *pCmdLine, const char *path) {
+    if (path != NULL) {
+        execv(path, pCmdLine->arguments);
+    }
+    execvp(pCmdLine->arguments[0], pCmdLine->arguments);
+}
+
+// hash [-r]: lists the cached command paths, or forgets them
+void handleHashCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount > 1 && strcmp(pCmdLine->arguments[1], "-r") == 0) {
+        clearPathCache();
+        return;
+    }
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (pathEntry *entry = path_cache[i]; entry != NULL; entry = entry->next) {
+            fprintf(out, "%s\t%s\n", entry->name, entry->path);
+        }
+    }
+}
+
+// Converts a wait status into the exit status reported for a command line
+int exitCode(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+long long monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Only installed while metrics are exported: remembers when a child exit was first signalled
+void sigchldHandler(int sig) {
+    long long none = 0;
+    __atomic_compare_exchange_n(&sigchld_ns, &none, monotonicNs(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void installSigchldHandler() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchldHandler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+// Undoes installSigchldHandler when metrics stop, so a later start does not measure the time in between
+void removeSigchldHandler() {
+    signal(SIGCHLD, SIG_DFL);
+    __atomic_store_n(&sigchld_ns, 0, __ATOMIC_RELAXED);
+}
+
+// Called whenever a child is reaped, with its wait status
+void noteReaped(int status) {
+    if (!metricsEnabled()) {
+        return;
+    }
+    // taken and cleared in one step, so a SIGCHLD arriving meanwhile is not lost
+    long long signalled = __atomic_exchange_n(&sigchld_ns, 0, __ATOMIC_RELAXED);
+    if (signalled != 0) {
+        metricsObserveReap((monotonicNs() - signalled) / 1e9);
+    }
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        metricsCount(METRIC_EXEC_FAILURES);
+    }
+}
+
+cmdLine *parseTimed(const char *strLine) {
+    long long start = monotonicNs();
+    cmdLine *pCmdLine = parseCmdLines(strLine);
+    metricsObserveParse((monotonicNs() - start) / 1e9);
+    return pCmdLine;
+}
+
+void storeHistory(const char *cmd) {
     strncpy(history[history_end], cmd, MAX_BUF - 1); // copies the command line cmd to the position history[history_end] in the history buffer (MAX_BUF - 1 ensures that at most MAX_BUF - 1 characters are copied, leaving room for the null terminator)
     history[history_end][MAX_BUF - 1] = '\0'; // explicitly adds a null terminator to ensure the string is properly terminated
     history_end = (history_end + 1) % HISTLEN;
@@ -49,10 +333,34 @@ void addToHistory(const char *cmd) {
     }
 }
 
-void printHistory() {
+void addToHistory(const char *cmd) {
+    storeHistory(cmd);
+    historyAppend(cmd); // shared with the other shells through the history log
+}
+
+// Takes in the commands other shells appended to the history log since the last prompt
+void mergeHistory() {
+    char *line;
+    while ((line = historyNext()) != NULL) {
+        storeHistory(line);
+        free(line);
+    }
+}
+
+void printHistory(FILE *out) {
     for (int i = 0; i < history_count; i++) {
         int index = (history_start + i) % HISTLEN;
-        printf("%d %s", i + 1, history[index]);
+        fprintf(out, "%d %s", i + 1, history[index]);
+    }
+}
+
+// history [compact]: lists the commands, or rewrites the shared log without duplicates
+void handleHistoryCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount > 1 && strcmp(pCmdLine->arguments[1], "compact") == 0) {
+        historyCompact();
+    } else {
+        mergeHistory();
+        printHistory(out);
     }
 }
 
@@ -65,10 +373,32 @@ char* getHistoryCommand(int index) {
     return history[hist_index];
 }
 
+// Drops a finished job's output file from the page cache and closes it. Dirty pages cannot be
+// dropped, so writeback is started first but not waited for. With keep set the file stays open, and
+// the call made once the job is reaped (or removed) drops the pages whose writeback has finished since.
+void releaseOutput(process *proc, int keep) {
+    if (proc->hintFd == -1) {
+        return;
+    }
+    // Give back blocks preallocated past the end by "iohint -s" when the output came out shorter
+    struct stat st;
+    if (fstat(proc->hintFd, &st) == 0 && S_ISREG(st.st_mode)) {
+        ftruncate(proc->hintFd, st.st_size);
+    }
+    sync_file_range(proc->hintFd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(proc->hintFd, 0, 0, POSIX_FADV_DONTNEED);
+    if (keep) {
+        return;
+    }
+    close(proc->hintFd);
+    proc->hintFd = -1;
+}
+
 void freeProcessList(process* process_list) {
     process* curr = process_list;
     while (curr != NULL) {
         process* next = curr->next;
+        releaseOutput(curr, 0);
         freeCmdLines(curr->cmd);
         free(curr);
         curr = next;
@@ -88,10 +418,109 @@ void updateProcessStatus(process* process_list, int pid, int status) {
     }
 }
 
+// Reads the scheduler state letter, utime + stime and the resident set size of a process
+// from /proc/<pid>/stat. Returns -1 if the process is gone.
+int readProcStat(pid_t pid, char *state, long long *cpuTicks, long long *rssKb) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+
+    // the command name may contain spaces, so fields are counted from its closing parenthesis
+    char *p = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    long long rss;
+    char letter;
+    if (p == NULL || sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %*u %*u %lld",
+                            &letter, &utime, &stime, &rss) != 4) {
+        return -1;
+    }
+    *state = letter;
+    *cpuTicks = utime + stime;
+    *rssKb = rss * (sysconf(_SC_PAGESIZE) / 1024);
+    return 0;
+}
+
+void sampleResources(process *proc) {
+    char state;
+    readProcStat(proc->pid, &state, &proc->cpuTicks, &proc->rssKb);
+}
+
+// Pushes the state of the process list to the metrics exporter and the shared job table
+void publishJobs(process *process_list) {
+    int running = 0, suspended = 0, terminated = 0;
+
+    if (job_table != NULL) {
+        jobtableBeginWrite(job_table);
+    }
+    int count = 0;
+    for (process *curr = process_list; curr != NULL; curr = curr->next) {
+        if (curr->status == RUNNING) {
+            running++;
+        } else if (curr->status == SUSPENDED) {
+            suspended++;
+        } else {
+            terminated++;
+        }
+
+        if (job_table != NULL && count < JOBTABLE_SLOTS) {
+            jobSlot *slot = &job_table->slots[count++];
+            slot->pid = curr->pid;
+            slot->pgid = curr->pgid;
+            slot->state = curr->status;
+            snprintf(slot->cmd, JOBTABLE_CMD_LEN, "%s", curr->cmd->arguments[0]);
+            slot->startMs = curr->startMs;
+            slot->cpuTicks = curr->cpuTicks;
+            slot->rssKb = curr->rssKb;
+        }
+    }
+    if (job_table != NULL) {
+        job_table->count = count;
+        job_table->truncated = running + suspended + terminated > count;
+        jobtableEndWrite(job_table);
+    }
+
+    if (metricsEnabled()) {
+        metricsSetJobs(running, suspended, terminated);
+    }
+}
+
+void stopPublishingJobs() {
+    jobtableDestroy(job_table);
+    job_table = NULL;
+}
+
+// jobtable [on|off]: publishes the job table in shared memory (on by default)
+void handleJobTableCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        fprintf(out, "jobtable: %s\n", job_table != NULL ? "on" : "off");
+    } else if (strcmp(pCmdLine->arguments[1], "off") == 0) {
+        stopPublishingJobs();
+    } else if (strcmp(pCmdLine->arguments[1], "on") == 0) {
+        if (job_table == NULL && (job_table = jobtableCreate()) == NULL) {
+            perror("jobtable: shm_open failed");
+        }
+        publishJobs(process_list);
+    } else {
+        fprintf(stderr, "jobtable: expected on or off\n");
+    }
+}
+
 void updateProcessList(process **process_list) {
     int status = 0;
     process *curr;
     for (curr = *process_list; curr != NULL; curr = curr->next) {
+        if (curr->status == TERMINATED) {
+            continue; // already reaped: its pid may belong to a newer child by now
+        }
         int res = waitpid(curr->pid, &status, WCONTINUED | WNOHANG | WUNTRACED );
         // Call waitpid for Each Process
         // waitpid is called with the following flags:
@@ -101,12 +530,21 @@ void updateProcessList(process **process_list) {
         // waitpid checks the status of the process with the process ID curr->pid and stores the status in the status variable
         // res is set to the PID of the child whose status is reported, 0 if no status is available, or -1 on error
         if (res == 0) {
-            updateProcessStatus(curr, curr->pid, RUNNING);
+            // nothing new: a stopped job stays suspended until it is reported as continued
+            if (job_table != NULL) {
+                sampleResources(curr);
+            }
+        } else if (res == -1) {
+            // Already reaped (e.g. by a blocking wait): status holds nothing about this process
+            updateProcessStatus(curr, curr->pid, TERMINATED);
+            releaseOutput(curr, 0);
         } else {
             if (WIFEXITED(status) || WIFSIGNALED(status)) {
                 // WIFEXITED(status): Returns true if the child terminated normally
                 // WIFSIGNALED(status): Returns true if the child process was terminated by a signal.
                 updateProcessStatus(curr, curr->pid, TERMINATED);
+                noteReaped(status);
+                releaseOutput(curr, 0);
             } 
             else if (WIFCONTINUED(status)) {
                 // WIFCONTINUED(status): Returns true if the child process has continued from a job control stop.
@@ -118,6 +556,7 @@ void updateProcessList(process **process_list) {
             } 
         }
     }
+    publishJobs(*process_list);
 }
 
 void addProcess(process** process_list, cmdLine* cmd, pid_t pid){
@@ -125,66 +564,205 @@ void addProcess(process** process_list, cmdLine* cmd, pid_t pid){
     if(newProcess == NULL){
         fprintf(stderr, "Failed to allocate memory for new process.\n");
     }
+    struct timeval now;
+    gettimeofday(&now, NULL);
     newProcess->cmd = cmd;
     newProcess->pid = pid;
     newProcess->status = RUNNING;
+    newProcess->pgid = getpgid(pid);
+    newProcess->startMs = now.tv_sec * 1000LL + now.tv_usec / 1000;
+    newProcess->cpuTicks = 0;
+    newProcess->rssKb = 0;
+    newProcess->hintFd = -1;
     newProcess->next = *process_list;
     *process_list = newProcess;   
+    publishJobs(*process_list);
 }
 
-void deleteProcess(process** process_list, process* proc) {
-    if (proc == NULL) return;
-
-    if (*process_list == proc) {
-        // If the process to be deleted (proc) is the head of the list (*process_list), the head of the list is updated to the next process in the list (proc->next).
-        *process_list = proc->next; 
-    } else {
-        // A pointer prev is initialized to point to the head of the list.
-        // A loop is used to traverse the list until prev->next is equal to proc
-        // Once the process to be deleted is found, prev->next is updated to proc->next, effectively removing proc from the list.
-        process* prev = *process_list;
-        while (prev->next != proc) {
-            prev = prev->next;
+// Unlinks and frees every terminated job in a single pass over the list
+void removeTerminated(process** process_list) {
+    process **link = process_list;
+    while (*link != NULL) {
+        process *curr = *link;
+        if (curr->status != TERMINATED) {
+            link = &curr->next;
+            continue;
+        }
+        *link = curr->next;
+        releaseOutput(curr, 0);
+        joblogRelease(curr->pid);
+        if (curr->cmd) {
+            curr->cmd->next = NULL;
+            freeCmdLines(curr->cmd);
         }
-        if (prev->next == proc) {
-            prev->next = proc->next;
+        if (debug) {
+            fprintf(stderr, "removeTerminated: Deleting process with PID %d\n", curr->pid);
         }
+        free(curr);
     }
+    publishJobs(*process_list);
+}
+
+const char *statusName(int status) {
+    return status == RUNNING ? "Running" : (status == SUSPENDED ? "Suspended" : "Terminated");
+}
 
-    if (proc->cmd) {
-        proc->cmd->next = NULL;
-        freeCmdLines(proc->cmd);
+int compareProcesses(const void *a, const void *b) {
+    const process *x = *(process * const *)a, *y = *(process * const *)b;
+    long long diff;
+    switch (procs_sort) {
+    case PROCS_SORT_CPU:
+        diff = y->cpuTicks - x->cpuTicks; // the busiest first
+        break;
+    case PROCS_SORT_RSS:
+        diff = y->rssKb - x->rssKb;
+        break;
+    case PROCS_SORT_START:
+        diff = x->startMs - y->startMs;
+        break;
+    case PROCS_SORT_COMMAND:
+        diff = strcmp(x->cmd->arguments[0], y->cmd->arguments[0]);
+        break;
+    default:
+        diff = 0;
     }
-    if (debug) {
-        fprintf(stderr, "deleteProcess: Deleting process with PID %d\n", proc->pid);
+    if (diff == 0) {
+        diff = (long long)x->pid - y->pid;
+    }
+    return diff < 0 ? -1 : diff > 0;
+}
+
+void writeJsonString(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
     }
-    free(proc);
+    fputc('"', out);
 }
 
-void printProcessList(process** process_list) {
-    updateProcessList(process_list);
+void collectBatchJobs();
 
-    printf("PID          Command      STATUS\n");
-    process *curr = *process_list;
-    process *next = NULL;
+// procs [--state=running|suspended|terminated] [--sort=pid|cpu|rss|start|command] [--limit=N]
+//       [--json] [--keep] | --clean | --cleanup=auto|manual
+// Lists the jobs; the whole listing goes out in one write. Afterwards the terminated jobs are
+// removed, unless --keep is given or cleanup is manual, in which case only "procs --clean" does it.
+void handleProcsCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    collectBatchJobs(); // jobs the batch scheduler started since the last prompt
+    int state = PROCS_ANY_STATE, sort = PROCS_SORT_PID, limit = -1, json = 0, keep = 0;
+    for (int i = 1; i < pCmdLine->argCount; i++) {
+        const char *arg = pCmdLine->arguments[i];
+        if (strncmp(arg, "--state=", 8) == 0) {
+            const char *names[] = {"suspended", "running"};
+            state = strcmp(arg + 8, "terminated") == 0 ? TERMINATED : -2;
+            for (int s = SUSPENDED; s <= RUNNING; s++) {
+                if (strcmp(arg + 8, names[s]) == 0) {
+                    state = s;
+                }
+            }
+        } else if (strncmp(arg, "--sort=", 7) == 0) {
+            const char *keys[] = {"pid", "cpu", "rss", "start", "command"};
+            sort = -1;
+            for (int k = 0; k < PROCS_SORT_KEYS; k++) {
+                if (strcmp(arg + 7, keys[k]) == 0) {
+                    sort = k;
+                }
+            }
+        } else if (strncmp(arg, "--limit=", 8) == 0) {
+            limit = atoi(arg + 8);
+        } else if (strcmp(arg, "--json") == 0) {
+            json = 1;
+        } else if (strcmp(arg, "--keep") == 0) {
+            keep = 1;
+        } else if (strcmp(arg, "--clean") == 0) {
+            updateProcessList(&process_list);
+            removeTerminated(&process_list);
+            return;
+        } else if (strcmp(arg, "--cleanup=auto") == 0 || strcmp(arg, "--cleanup=manual") == 0) {
+            procs_cleanup = strcmp(arg, "--cleanup=auto") == 0;
+            return;
+        } else {
+            state = -2;
+        }
+        if (state == -2 || sort == -1 || limit < -1) {
+            fprintf(stderr, "procs: bad option '%s'\n", arg);
+            fprintf(stderr, "usage: procs [--state=running|suspended|terminated] [--sort=pid|cpu|rss|start|command] "
+                            "[--limit=N] [--json] [--keep] | --clean | --cleanup=auto|manual\n");
+            last_status = 1;
+            return;
+        }
+    }
 
-    while (curr) {
-        next = curr->next; // Save the next pointer before potentially deleting the current process
-        printf("%d        %s        %s\n", curr->pid, curr->cmd->arguments[0],
-               curr->status == RUNNING ? "Running" : 
-               (curr->status == SUSPENDED ? "Suspended" : "Terminated"));
+    updateProcessList(&process_list);
+    int count = 0, shown = 0;
+    for (process *curr = process_list; curr != NULL; curr = curr->next) {
+        count++;
+    }
+    process **jobs = (process **)malloc(sizeof(process *) * (count + 1));
+    for (process *curr = process_list; curr != NULL; curr = curr->next) {
+        if (state == PROCS_ANY_STATE || curr->status == state) {
+            // cpu and rss are only sampled on every update while the job table is published
+            if (job_table == NULL && curr->status != TERMINATED && (json || sort == PROCS_SORT_CPU || sort == PROCS_SORT_RSS)) {
+                sampleResources(curr);
+            }
+            jobs[shown++] = curr;
+        }
+    }
+    procs_sort = sort;
+    qsort(jobs, shown, sizeof(process *), compareProcesses);
+    if (limit >= 0 && limit < shown) {
+        shown = limit;
+    }
 
-        curr = next; // Move to the next process
+    char *text = NULL;
+    size_t len = 0;
+    FILE *listing = open_memstream(&text, &len);
+    if (json) {
+        fprintf(listing, "[");
+        for (int i = 0; i < shown; i++) {
+            process *curr = jobs[i];
+            fprintf(listing, "%s\n  {\"pid\": %d, \"pgid\": %d, \"command\": ", i > 0 ? "," : "", curr->pid, curr->pgid);
+            writeJsonString(listing, curr->cmd->arguments[0]);
+            fprintf(listing, ", \"state\": \"%s\", \"start_ms\": %lld, \"cpu_ticks\": %lld, \"rss_kb\": %lld}",
+                    curr->status == RUNNING ? "running" : (curr->status == SUSPENDED ? "suspended" : "terminated"),
+                    curr->startMs, curr->cpuTicks, curr->rssKb);
+        }
+        fprintf(listing, "%s]\n", shown > 0 ? "\n" : "");
+    } else {
+        fprintf(listing, "PID          Command      STATUS\n");
+        for (int i = 0; i < shown; i++) {
+            fprintf(listing, "%d        %s        %s\n", jobs[i]->pid, jobs[i]->cmd->arguments[0], statusName(jobs[i]->status));
+        }
     }
+    fclose(listing);
+    free(jobs);
 
-    // Now delete the freshly terminated processes
-    curr = *process_list;
-    while (curr != NULL) {
-        next = curr->next;
-        if (curr->status == TERMINATED) {
-            deleteProcess(process_list, curr);
+    // one write on the descriptor behind out; a stream without one (a ring) just gets the block
+    fflush(out);
+    int fd = fileno(out);
+    if (fd == -1) {
+        fwrite(text, 1, len, out);
+    }
+    for (size_t done = 0; fd != -1 && done < len; ) {
+        ssize_t n = write(fd, text + done, len - done);
+        if (n == -1 && errno == EINTR) {
+            continue;
         }
-        curr = next;
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    fflush(out);
+    free(text);
+
+    if (procs_cleanup && !keep) {
+        removeTerminated(&process_list);
     }
 }
 
@@ -199,13 +777,27 @@ void displayPrompt() {
 
 char* readInput() {
     static char buffer[BUFFER_SIZE];
+    // While waiting at a terminal, keep the shared job table following the jobs: a job stopped, killed
+    // or exiting meanwhile would otherwise only show up in myshell-top once the user typed procs.
+    // A terminal hands fgets one line per read, so nothing can be left waiting in stdin's buffer.
+    // The prompt is flushed first: fgets would only do that once it reads.
+    fflush(stdout);
+    while (job_table != NULL && isatty(STDIN_FILENO)) {
+        struct pollfd input = {STDIN_FILENO, POLLIN, 0};
+        int ready = poll(&input, 1, JOBTABLE_REFRESH_MS);
+        if (ready == 0) {
+            updateProcessList(&process_list);
+        } else if (ready == 1 || errno != EINTR) {
+            break;
+        }
+    }
     if (fgets(buffer, BUFFER_SIZE, stdin) == NULL) {
         return NULL;
     }
     return buffer;
 }
 
-void handleCdCommand(cmdLine *pCmdLine) {
+void handleCdCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
     if (pCmdLine->argCount < 2) {
         fprintf(stderr, "cd: missing argument\n");
     } else {
@@ -215,198 +807,2669 @@ void handleCdCommand(cmdLine *pCmdLine) {
     }
 }
 
-void handleAlarmCommand(cmdLine *pCmdLine) {
-    if (pCmdLine->argCount < 2) {
-        fprintf(stderr, "alarm: missing process id\n");
+void signalJob(int pid, int sig, const char *name, const char *done, FILE *out) {
+    if (kill(pid, sig) == -1) {
+        fprintf(stderr, "%s failed: %s\n", name, strerror(errno));
     } else {
-        int pid = atoi(pCmdLine->arguments[1]);
-        if (kill(pid, SIGCONT) == -1) {
-            perror("alarm failed");
-        } else {
-            printf("Process %d continued\n", pid);
+        fprintf(out, "Process %d %s\n", pid, done);
+    }
+}
+
+// Whether pid is a job of this shell that has not been reaped: the pid of a reaped one may have been reused
+int isLiveJob(int pid) {
+    for (process *curr = process_list; curr != NULL; curr = curr->next) {
+        if (curr->pid == pid && curr->status != TERMINATED) {
+            return 1;
         }
     }
+    return 0;
 }
 
-void handleBlastCommand(cmdLine *pCmdLine) {
-    if (pCmdLine->argCount < 2) {
-        fprintf(stderr, "blast: missing process id\n");
-    } else {
+// Sends sig to the process given as argument. Without one, the pids are read from the input
+// instead, one per line (the first number on it), so "procs --state=suspended | alarm" works.
+// Pids read that way are only signalled if they are live jobs of this shell.
+void signalJobs(cmdLine *pCmdLine, FILE *in, FILE *out, int sig, const char *done) {
+    const char *name = pCmdLine->arguments[0];
+    if (pCmdLine->argCount >= 2) {
         int pid = atoi(pCmdLine->arguments[1]);
-        if (kill(pid, SIGKILL) == -1) {
-            perror("blast failed");
+        if (pid <= 0) {
+            fprintf(stderr, "%s: invalid process id %s\n", name, pCmdLine->arguments[1]);
         } else {
-            printf("Process %d killed\n", pid);
+            signalJob(pid, sig, name, done, out);
         }
+        return;
+    }
+    if (in == NULL) {
+        fprintf(stderr, "%s: missing process id\n", name);
+        return;
     }
-}
 
-void handleSleepCommand(cmdLine *pCmdLine) {
-    if (pCmdLine->argCount < 2) {
-        fprintf(stderr, "sleep: missing process id\n");
-    } else {
-        int pid = atoi(pCmdLine->arguments[1]);    
-        if (kill(pid, SIGTSTP) == -1) {
-            fprintf(stderr, "sleep failed\n");
-            perror("sleep failed");
+    // Read everything first: the stage writing the pids (procs) holds builtin_lock until it is done
+    char *line = NULL;
+    size_t size = 0;
+    int *pids = NULL, count = 0, capacity = 0;
+    while (getline(&line, &size, in) != -1) {
+        char *digits = strpbrk(line, "0123456789");
+        if (digits == NULL) {
+            continue;
+        }
+        if (count == capacity) {
+            int *grown = (int *)realloc(pids, (capacity ? capacity * 2 : 64) * sizeof(int));
+            if (grown == NULL) {
+                fprintf(stderr, "%s: out of memory, ignoring the rest of the input\n", name);
+                break;
+            }
+            pids = grown;
+            capacity = capacity ? capacity * 2 : 64;
+        }
+        pids[count++] = atoi(digits);
+    }
+    free(line);
+
+    pthread_mutex_lock(&builtin_lock);
+    for (int i = 0; i < count; i++) {
+        if (isLiveJob(pids[i])) {
+            signalJob(pids[i], sig, name, done, out);
         } else {
-            printf("Process %d suspended\n", pid);
+            fprintf(stderr, "%s: %d: no such job\n", name, pids[i]);
         }
     }
+    pthread_mutex_unlock(&builtin_lock);
+    free(pids);
 }
 
-void executePipeCommands(cmdLine *pCmdLine) {
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe failed");
-        exit(1);
-    }
+void handleAlarmCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    signalJobs(pCmdLine, in, out, SIGCONT, "continued");
+}
 
-    pid_t pid1 = fork();
-    if (pid1 == -1) {
-        perror("fork failed");
-        exit(1);
-    } else if (pid1 == 0) {
-        // First child process
-        close(STDOUT_FILENO);
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[1]);
-        close(pipefd[0]);
-
-        if (pCmdLine->outputRedirect) {
-            fprintf(stderr, "Output redirection on the left-hand side of the pipe is not allowed\n");
-            _exit(1);
-        }
+void handleBlastCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    signalJobs(pCmdLine, in, out, SIGKILL, "killed");
+}
 
-        execvp(pCmdLine->arguments[0], pCmdLine->arguments);
-        perror("execvp failed");
-        _exit(1);
-    }
+void handleSleepCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    signalJobs(pCmdLine, in, out, SIGTSTP, "suspended");
+}
 
-    pid_t pid2 = fork();
-    if (pid2 == -1) {
-        perror("fork failed");
-        exit(1);
-    } else if (pid2 == 0) {
-        // Second child process
-        close(STDIN_FILENO);
-        dup2(pipefd[0], STDIN_FILENO);
-        close(pipefd[0]);
-        close(pipefd[1]);
-
-        if (pCmdLine->next->inputRedirect) {
-            fprintf(stderr, "Input redirection on the right-hand side of the pipe is not allowed\n");
-            _exit(1);
+long readPipeMaxSize() {
+    long max = 1024 * 1024; // the kernel default, used if /proc is unavailable
+    FILE *f = fopen(PIPE_MAX_SIZE_PATH, "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &max) != 1) {
+            max = 1024 * 1024;
         }
-
-        execvp(pCmdLine->next->arguments[0], pCmdLine->next->arguments);
-        perror("execvp failed");
-        _exit(1);
+        fclose(f);
     }
+    return max;
+}
 
-    close(pipefd[0]);
-    close(pipefd[1]);
-    waitpid(pid1, NULL, 0);
-    waitpid(pid2, NULL, 0);
+// Parses a byte count with an optional K/M/G suffix. Returns -1 if it is not valid or overflows;
+// callers that keep the size in a long must still check it against LONG_MAX (2G-1 with -m32).
+long long parseByteSize(const char *spec) {
+    char *end;
+    errno = 0;
+    long long size = strtoll(spec, &end, 10);
+    long long unit = 1;
+    if (end == spec || size < 0 || errno == ERANGE) {
+        return -1;
+    }
+    if (*end == 'K' || *end == 'k') {
+        unit = 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        unit = 1024 * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        unit = 1024 * 1024 * 1024;
+        end++;
+    }
+    if (*end != '\0' || size > LLONG_MAX / unit) {
+        return -1;
+    }
+    return size * unit;
 }
 
-void executeSingleCommand(cmdLine *pCmdLine) {
-    pid_t pid = fork();
-    
-    if (pid == -1) {
-        perror("fork failed");
-        exit(1);
-    } else if (pid == 0) {
-        // Child process
+// Parses a pipe size spec: "default", "max", "adaptive" or a byte count with an optional K/M suffix.
+// Returns -2 if the spec is not valid.
+long parsePipeSize(const char *spec) {
+    if (strcmp(spec, "default") == 0 || strcmp(spec, "off") == 0) {
+        return PIPE_SIZE_DEFAULT;
+    } else if (strcmp(spec, "max") == 0) {
+        return readPipeMaxSize();
+    } else if (strcmp(spec, "adaptive") == 0) {
+        return PIPE_SIZE_ADAPTIVE;
+    }
 
-        // Handle input redirection
-        if (pCmdLine->inputRedirect) {
-            int fd = open(pCmdLine->inputRedirect, O_RDONLY);
-            if (fd == -1) {
-                perror("open input file failed");
-                _exit(1);
-            }
-            if (dup2(fd, STDIN_FILENO) == -1) {
-                perror("dup2 input redirection failed");
-                _exit(1);
-            }
-            close(fd);
-        }
+    long long size = parseByteSize(spec);
+    return size > 0 && size <= LONG_MAX ? size : -2;
+}
 
-        // Handle output redirection
-        if (pCmdLine->outputRedirect) {
-            int fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd == -1) {
-                perror("open output file failed");
-                _exit(1);
-            }
-            if (dup2(fd, STDOUT_FILENO) == -1) {
-                perror("dup2 output redirection failed");
-                _exit(1);
-            }
-            close(fd);
+// Raises the capacity of the pipe behind fd, clamped to pipe-max-size.
+// If the kernel refuses (e.g. the per-user pipe page limit is reached) the size is halved until it fits.
+// Returns the resulting capacity, or -1 if it could not be changed at all.
+long setPipeSize(int fd, long size) {
+    long max = readPipeMaxSize();
+    if (size > max) {
+        size = max;
+    }
+    while (size >= PIPE_BUF) {
+        long res = fcntl(fd, F_SETPIPE_SZ, size);
+        if (res != -1) {
+            return res;
         }
-
-        execvp(pCmdLine->arguments[0], pCmdLine->arguments);
-        
-        // If execvp returns, it must have failed
-        perror("execvp failed");
-        _exit(1); // Exit abnormally if execvp fails
-    } else {
-        // Parent process
-        addProcess(&process_list, pCmdLine, pid);
-        if (debug) {
-            fprintf(stderr, "PID: %d\n", pid);
-            fprintf(stderr, "Executing command: %s\n", pCmdLine->arguments[0]);
-            fprintf(stderr, "Blocking: %d\n", pCmdLine->blocking);
+        if (errno != EPERM && errno != EBUSY) {
+            break;
         }
-        if (pCmdLine->blocking) {
-            waitpid(pid, NULL, 0); // Wait for the child process to terminate if blocking
+        size /= 2;
+    }
+    if (debug) {
+        perror("setPipeSize: F_SETPIPE_SZ failed");
+    }
+    return -1;
+}
+
+int createPipe(int pipefd[2], long size) {
+    if (pipe(pipefd) == -1) {
+        return -1;
+    }
+    if (size > 0) {
+        long res = setPipeSize(pipefd[1], size);
+        if (debug && res != -1) {
+            fprintf(stderr, "createPipe: pipe capacity set to %ld bytes\n", res);
         }
     }
+    return 0;
 }
 
-void execute(cmdLine *pCmdLine) {
-    if (strcmp(pCmdLine->arguments[0], "cd") == 0) {
-        handleCdCommand(pCmdLine);
-        return;
-    } else if (strcmp(pCmdLine->arguments[0], "alarm") == 0) {
-        handleAlarmCommand(pCmdLine);
-        return;
-    } else if (strcmp(pCmdLine->arguments[0], "blast") == 0) {
-        handleBlastCommand(pCmdLine);
-        return;
-    } else if (strcmp(pCmdLine->arguments[0], "procs") == 0) {
-        printProcessList(&process_list);
+void runCommands(cmdLine *pCmdLine, long pipeSize);
+const builtin *findBuiltin(const char *name);
+
+// pipesize [SIZE]: shows or sets the session's pipe size; "pipesize SIZE cmd | cmd ..." applies it
+// to that pipeline only
+void handlePipeSizeCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        if (pipe_size == PIPE_SIZE_ADAPTIVE) {
+            fprintf(out, "pipesize: adaptive (max %ld)\n", readPipeMaxSize());
+        } else if (pipe_size == PIPE_SIZE_DEFAULT) {
+            fprintf(out, "pipesize: default\n");
+        } else {
+            fprintf(out, "pipesize: %ld\n", pipe_size);
+        }
+        freeCmdLines(pCmdLine);
         return;
-    } else if (strcmp(pCmdLine->arguments[0], "sleep") == 0) {
-        handleSleepCommand(pCmdLine);
+    }
+
+    long size = parsePipeSize(pCmdLine->arguments[1]);
+    if (size == -2) {
+        fprintf(stderr, "pipesize: invalid size '%s' (expected default, max, adaptive or bytes[K|M])\n", pCmdLine->arguments[1]);
+        freeCmdLines(pCmdLine);
         return;
-    } else if (strcmp(pCmdLine->arguments[0], "history") == 0) {
-        printHistory();
+    }
+    if (pCmdLine->argCount == 2) {
+        pipe_size = size;
+        freeCmdLines(pCmdLine);
         return;
-    } 
-
-    if (pCmdLine->next) {
-        executePipeCommands(pCmdLine);
-    } else {
-        executeSingleCommand(pCmdLine);
     }
+    shiftCmdArgs(pCmdLine, 2);
+    runCommands(pCmdLine, size);
 }
 
-int main(int argc, char **argv) {
-    
-    // Check for debug flag
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        debug = 1;
+// Opens the stage's redirection files onto stdin/stdout. Only called in a child process.
+// If outFd is not -1 the parent already opened the output redirection and it is used instead.
+// With hints set, the kernel is told the input will be read sequentially and its start is read ahead.
+void applyRedirections(cmdLine *pCmdLine, int outFd, int hints) {
+    // Handle input redirection
+    if (pCmdLine->inputRedirect) {
+        int fd = open(pCmdLine->inputRedirect, O_RDONLY);
+        if (fd == -1) {
+            perror("open input file failed");
+            _exit(1);
+        }
+        if (dup2(fd, STDIN_FILENO) == -1) {
+            perror("dup2 input redirection failed");
+            _exit(1);
+        }
+        close(fd);
+        if (hints) {
+            posix_fadvise(STDIN_FILENO, 0, 0, POSIX_FADV_SEQUENTIAL);
+            posix_fadvise(STDIN_FILENO, 0, IOHINT_WINDOW, POSIX_FADV_WILLNEED);
+        }
     }
 
-    while (1) {
-        displayPrompt();
-
-        char *input = readInput();
-        if (input == NULL) {
-            break;
+    // Handle output redirection
+    if (outFd != -1) {
+        dup2(outFd, STDOUT_FILENO);
+        close(outFd);
+    } else if (pCmdLine->outputRedirect) {
+        int fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("open output file failed");
+            _exit(1);
+        }
+        if (dup2(fd, STDOUT_FILENO) == -1) {
+            perror("dup2 output redirection failed");
+            _exit(1);
+        }
+        close(fd);
+    }
+}
+
+// Sends SIGPIPE to the stages before the given one: they would get it on their next write anyway,
+// but a stage that is computing (or blocked on its own input) could otherwise run for much longer.
+void terminateUpstream(pid_t *pids, int stage) {
+    for (int i = 0; i < stage; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGPIPE);
+        }
+    }
+    if (debug) {
+        fprintf(stderr, "terminateUpstream: stage %d exited, stopping stages 0-%d\n", stage, stage - 1);
+    }
+}
+
+// Fill level of a monitored pipe, -1 if it is not watched (any more)
+int pipeFill(int fd, long *capacity) {
+    int queued = 0;
+    if (fd == -1 || ioctl(fd, FIONREAD, &queued) == -1) {
+        return -1;
+    }
+    *capacity = fcntl(fd, F_GETPIPE_SZ);
+    return queued;
+}
+
+// Classifies every live stage from its scheduler state and the fill of the pipes around it:
+// a sleeping stage whose output pipe is full waits on its reader, one whose input pipe is empty
+// waits on its writer.
+void sampleStages(pid_t *pids, int *monitor, stageStat *stats, int stages) {
+    for (int i = 0; i < stages; i++) {
+        long long rss;
+        long inCapacity = 0, outCapacity = 0;
+        stageStat *st = &stats[i];
+        if (pids[i] <= 0 || readProcStat(pids[i], &st->state, &st->cpuTicks, &rss) == -1) {
+            continue;
+        }
+        if (st->state == 'Z') {
+            continue; // exited, waiting to be reaped
+        }
+        if (st->verdict == -1) {
+            st->startTicks = st->reportTicks = st->cpuTicks;
+        }
+
+        int in = i > 0 ? pipeFill(monitor[i - 1], &inCapacity) : -1;
+        int out = i < stages - 1 ? pipeFill(monitor[i], &outCapacity) : -1;
+        if (st->state == 'R') {
+            st->verdict = STAGE_CPU;
+        } else if (out != -1 && out >= outCapacity - PIPE_BUF) {
+            st->verdict = STAGE_BLOCKED;
+        } else if (in == 0) {
+            st->verdict = STAGE_STARVED;
+        } else {
+            st->verdict = STAGE_WAITING;
+        }
+        st->counts[st->verdict]++;
+    }
+}
+
+// Prints the pipestat table to stderr. On a terminal each live report overwrites the previous one.
+// The final report shows the share of samples per verdict and names the busiest stage.
+void reportStages(cmdLine *pCmdLine, pid_t *pids, int *monitor, stageStat *stats, int stages,
+                  double elapsed, double interval, int final) {
+    static int drawn = 0; // lines of the previous live report still on the screen
+    long ticks = sysconf(_SC_CLK_TCK);
+    int tty = isatty(STDERR_FILENO);
+
+    if (tty && drawn > 0) {
+        fprintf(stderr, "\033[%dA\033[J", drawn);
+    }
+    drawn = 0;
+    fprintf(stderr, "pipestat %.1fs%s\n", elapsed, final ? " (done)" : "");
+    if (final) {
+        fprintf(stderr, "%-5s %-16s %8s %10s %8s %8s %8s\n", "STAGE", "COMMAND", "CPU(s)", "cpu-bound", "blocked",
+                "starved", "waiting");
+    } else {
+        fprintf(stderr, "%-5s %-16s %-7s %1s %6s %10s  %s\n", "STAGE", "COMMAND", "PID", "S", "CPU%", "OUT-PIPE",
+                "VERDICT");
+    }
+
+    const char *busiest = NULL;
+    int busiestStage = -1;
+    double busiestShare = 0;
+    cmdLine *curr = pCmdLine;
+    for (int i = 0; i < stages && curr != NULL; i++, curr = curr->next) {
+        stageStat *st = &stats[i];
+        int samples = 0;
+        for (int v = 0; v < STAGE_VERDICTS; v++) {
+            samples += st->counts[v];
+        }
+        if (final) {
+            double share[STAGE_VERDICTS] = {0};
+            for (int v = 0; v < STAGE_VERDICTS && samples > 0; v++) {
+                share[v] = 100.0 * st->counts[v] / samples;
+            }
+            fprintf(stderr, "%-5d %-16.16s %8.2f %9.0f%% %7.0f%% %7.0f%% %7.0f%%\n", i, curr->arguments[0],
+                    (double)(st->cpuTicks - st->startTicks) / ticks, share[STAGE_CPU], share[STAGE_BLOCKED],
+                    share[STAGE_STARVED], share[STAGE_WAITING]);
+            if (samples > 0 && share[STAGE_CPU] > busiestShare) {
+                busiest = curr->arguments[0];
+                busiestStage = i;
+                busiestShare = share[STAGE_CPU];
+            }
+        } else {
+            long capacity = 0;
+            int out = i < stages - 1 ? pipeFill(monitor[i], &capacity) : -1;
+            char fill[32] = "-";
+            if (out != -1) {
+                snprintf(fill, sizeof(fill), "%ldK/%ldK", out / 1024L, capacity / 1024);
+            }
+            fprintf(stderr, "%-5d %-16.16s %-7d %c %5.0f%% %10s  %s\n", i, curr->arguments[0], pids[i] > 0 ? pids[i] : 0,
+                    pids[i] > 0 ? st->state : '-', 100.0 * (st->cpuTicks - st->reportTicks) / ticks / interval, fill,
+                    pids[i] <= 0 ? "exited" : (st->verdict == -1 ? "-" : stage_verdicts[st->verdict]));
+            st->reportTicks = st->cpuTicks;
+            drawn++;
+        }
+    }
+    drawn += 2;
+    if (final) {
+        drawn = 0;
+        if (busiest != NULL) {
+            fprintf(stderr, "bottleneck: stage %d (%s), cpu-bound in %.0f%% of samples\n", busiestStage, busiest,
+                    busiestShare);
+        }
+    }
+}
+
+// Waits for the pipeline stages while watching the fill level of every inter-stage pipe.
+// With grow set, a pipe that is (nearly) full means its writer is stalled on the reader, so its capacity
+// is doubled, up to pipe-max-size. While pipestat_ms is set the stages are also classified on every
+// sample and reported every pipestat_ms. monitor[i] is a read end of the pipe feeding stage i+1, or -1.
+void monitorPipeline(cmdLine *pCmdLine, pid_t *pids, int *monitor, char *stops, int stages, int grow) {
+    long max = readPipeMaxSize();
+    int alive = 0;
+    stageStat *stats = NULL;
+    long long start = monotonicNs(), lastReport = start;
+
+    for (int i = 0; i < stages; i++) {
+        alive += pids[i] > 0; // builtin stages are threads, joined by waitPipeline
+    }
+    if (pipestat_ms > 0) {
+        stats = (stageStat *)calloc(stages, sizeof(stageStat));
+        for (int i = 0; stats != NULL && i < stages; i++) {
+            stats[i].verdict = -1;
+        }
+    }
+
+    while (alive > 0) {
+        if (stats != NULL) {
+            sampleStages(pids, monitor, stats, stages);
+            long long now = monotonicNs();
+            if (now - lastReport >= pipestat_ms * 1000000LL) {
+                reportStages(pCmdLine, pids, monitor, stats, stages, (now - start) / 1e9, (now - lastReport) / 1e9, 0);
+                lastReport = now;
+            }
+        }
+
+        for (int i = 0; i < stages; i++) {
+            int status = 0;
+            if (pids[i] > 0 && waitpid(pids[i], &status, WNOHANG) != 0) {
+                noteReaped(status);
+                if (i == stages - 1) {
+                    last_status = exitCode(status);
+                }
+                pids[i] = 0;
+                alive--;
+                if (stops[i]) {
+                    terminateUpstream(pids, i);
+                }
+                // Once the reader is gone our extra read end must not keep the writer from getting SIGPIPE
+                if (i > 0 && monitor[i - 1] != -1) {
+                    close(monitor[i - 1]);
+                    monitor[i - 1] = -1;
+                }
+            }
+        }
+
+        for (int i = 0; grow && i < stages - 1; i++) {
+            long capacity = 0;
+            int queued = pipeFill(monitor[i], &capacity);
+            if (queued == -1) {
+                continue;
+            }
+            if (capacity > 0 && capacity < max && queued >= capacity - PIPE_BUF) {
+                long res = setPipeSize(monitor[i], capacity * 2);
+                if (debug && res != -1) {
+                    fprintf(stderr, "monitorPipeline: writer of stage %d stalled, pipe grown to %ld bytes\n", i, res);
+                }
+            }
+        }
+
+        if (alive > 0) {
+            usleep(grow ? ADAPTIVE_SAMPLE_US : PIPESTAT_SAMPLE_US);
+        }
+    }
+
+    if (stats != NULL) {
+        reportStages(pCmdLine, pids, monitor, stats, stages, (monotonicNs() - start) / 1e9, 0, 1);
+        free(stats);
+    }
+
+    for (int i = 0; i < stages - 1; i++) {
+        if (monitor[i] != -1) {
+            close(monitor[i]);
+        }
+    }
+}
+
+// Reads fd to EOF straight into a growable argBuffer, trimming trailing newlines.
+// Returns NULL if no memory could be allocated at all.
+argBuffer *captureOutput(int fd) {
+    size_t capacity = CAPTURE_CHUNK;
+    argBuffer *buffer = (argBuffer *)malloc(sizeof(argBuffer) + capacity + 1);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->next = NULL;
+    buffer->size = 0;
+
+    while (1) {
+        if (capacity - buffer->size < CAPTURE_CHUNK) {
+            argBuffer *grown = (argBuffer *)realloc(buffer, sizeof(argBuffer) + capacity * 2 + 1);
+            if (grown == NULL) {
+                fprintf(stderr, "captureOutput: out of memory, output truncated\n");
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buffer->data + buffer->size, capacity - buffer->size);
+        if (n > 0) {
+            buffer->size += n;
+        } else if (n == 0 || errno != EINTR) {
+            break;
+        }
+    }
+
+    while (buffer->size > 0 && buffer->data[buffer->size - 1] == '\n') {
+        buffer->size--;
+    }
+    buffer->data[buffer->size] = '\0';
+    return buffer;
+}
+
+int countStages(cmdLine *pCmdLine) {
+    int stages = 0;
+    for (cmdLine *curr = pCmdLine; curr != NULL; curr = curr->next) {
+        stages++;
+    }
+    return stages;
+}
+
+void closeStageStreams(builtinStage *stage) {
+    if (stage->in != NULL) {
+        fclose(stage->in);
+        stage->in = NULL;
+    }
+    if (stage->out != NULL) {
+        if (stage->ownsOut) {
+            fclose(stage->out);
+        } else {
+            fflush(stage->out);
+        }
+        stage->out = NULL;
+    }
+}
+
+// Body of the thread running a builtin stage. A builtin that does not read its input closes it
+// at once, so the stage feeding it sees EPIPE instead of filling the pipe; such builtins touch
+// shell state and are run one at a time under builtin_lock.
+void *runBuiltinStage(void *arg) {
+    builtinStage *stage = (builtinStage *)arg;
+    int shared = !(stage->def->flags & BUILTIN_READS_INPUT);
+    if (shared && stage->in != NULL) {
+        fclose(stage->in);
+        stage->in = NULL;
+    }
+    if (shared) {
+        pthread_mutex_lock(&builtin_lock);
+    }
+    stage->def->run(stage->cmd, stage->in, stage->out);
+    stage->status = last_status;
+    if (shared) {
+        pthread_mutex_unlock(&builtin_lock);
+    }
+    closeStageStreams(stage);
+    return NULL;
+}
+
+// Opens the redirections and the final output of a builtin stage. Returns -1 (after reporting it) if the stage cannot run.
+int openBuiltinStage(builtinStage *stage, int outFd) {
+    cmdLine *curr = stage->cmd;
+    if (!(stage->def->flags & BUILTIN_STAGE)) {
+        fprintf(stderr, "%s: cannot run inside a pipeline\n", curr->arguments[0]);
+        return -1;
+    }
+    if (curr->next && curr->outputRedirect) {
+        fprintf(stderr, "Output redirection on the left-hand side of the pipe is not allowed\n");
+        return -1;
+    }
+    if (curr->idx > 0 && curr->inputRedirect) {
+        fprintf(stderr, "Input redirection on the right-hand side of the pipe is not allowed\n");
+        return -1;
+    }
+    if (curr->inputRedirect) {
+        stage->in = fopen(curr->inputRedirect, "re");
+        if (stage->in == NULL) {
+            perror(curr->inputRedirect);
+            return -1;
+        }
+    }
+    if (curr->next == NULL) {
+        if (curr->outputRedirect) {
+            stage->out = fopen(curr->outputRedirect, "we");
+        } else if (outFd != -1) {
+            int fd = fcntl(outFd, F_DUPFD_CLOEXEC, 0);
+            stage->out = fd == -1 ? NULL : fdopen(fd, "w");
+        } else {
+            stage->out = stdout;
+            stage->ownsOut = 0;
+        }
+        if (stage->out == NULL) {
+            perror(curr->outputRedirect ? curr->outputRedirect : "output");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Forks one child per stage of the chain that runs a program and starts a thread for every stage that
+// is a builtin (see runBuiltinStage). Neighbours are connected with pipes of the given size, or through
+// a ring buffer in memory when both are builtins, so a pipeline of builtins never forks.
+// If outFd is not -1 it becomes stdout of the last stage (an explicit output redirection still wins);
+// it should be close-on-exec so the other stages do not hold it open.
+// pids, monitor, stops and stages must have room for one entry per stage; pids[i] is 0 for a builtin.
+void spawnPipeline(cmdLine *pCmdLine, long pipeSize, int outFd, pid_t *pids, int *monitor, char *stops,
+                   builtinStage *threads) {
+    int prevRead = -1;   // read end of the pipe feeding the current stage, if it runs a program
+    FILE *prevIn = NULL; // stream feeding the current stage, if it is a builtin
+    cmdLine *curr = pCmdLine;
+    for (int i = 0; curr != NULL; i++, curr = curr->next) {
+        int pipefd[2] = {-1, -1};
+        builtinStage *stage = &threads[i];
+        const builtin *next = curr->next ? findBuiltin(curr->next->arguments[0]) : NULL;
+        FILE *nextIn = NULL;
+        memset(stage, 0, sizeof(builtinStage));
+        stage->def = findBuiltin(curr->arguments[0]);
+        stage->cmd = curr;
+        stage->in = prevIn;
+        stage->ownsOut = 1;
+        pids[i] = 0;
+        monitor[i] = -1;
+        stops[i] = curr->stopsUpstream;
+
+        if (curr->next && stage->def && next) {
+            if (ringOpen(&nextIn, &stage->out) == -1) {
+                perror("ring failed");
+                exit(1);
+            }
+        } else if (curr->next) {
+            if (createPipe(pipefd, pipeSize) == -1) {
+                perror("pipe failed");
+                exit(1);
+            }
+            // A builtin reader's end is not watched: a copy would keep its writer from seeing EPIPE
+            if ((pipeSize == PIPE_SIZE_ADAPTIVE || pipestat_ms > 0) && next == NULL) {
+                monitor[i] = fcntl(pipefd[0], F_DUPFD_CLOEXEC, 0);
+            }
+            if (stage->def) {
+                fcntl(pipefd[1], F_SETFD, FD_CLOEXEC);
+                stage->out = fdopen(pipefd[1], "w");
+            }
+            if (next) {
+                fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+                nextIn = fdopen(pipefd[0], "r");
+            }
+        }
+
+        if (stage->def) {
+            if (openBuiltinStage(stage, outFd) == -1) {
+                stage->status = 1;
+            }
+        } else {
+            const char *path = lookupCommand(curr->arguments[0]);
+            pids[i] = fork();
+            if (pids[i] == -1) {
+                metricsCount(METRIC_FORK_FAILURES);
+                perror("fork failed");
+                exit(1);
+            } else if (pids[i] == 0) {
+                if (prevRead != -1) {
+                    close(STDIN_FILENO);
+                    dup2(prevRead, STDIN_FILENO);
+                    close(prevRead);
+                }
+                if (curr->next) {
+                    close(STDOUT_FILENO);
+                    dup2(pipefd[1], STDOUT_FILENO);
+                    close(pipefd[1]);
+                    close(pipefd[0]);
+                } else if (outFd != -1) {
+                    dup2(outFd, STDOUT_FILENO);
+                    close(outFd);
+                }
+
+                if (curr->next && curr->outputRedirect) {
+                    fprintf(stderr, "Output redirection on the left-hand side of the pipe is not allowed\n");
+                    _exit(1);
+                }
+                if (curr->idx > 0 && curr->inputRedirect) {
+                    fprintf(stderr, "Input redirection on the right-hand side of the pipe is not allowed\n");
+                    _exit(1);
+                }
+                applyRedirections(curr, -1, 0);
+
+                execCommand(curr, path);
+                perror("execvp failed");
+                _exit(127);
+            }
+
+            metricsCount(METRIC_FORKS);
+            if (curr->next) {
+                close(pipefd[1]);
+            }
+        }
+        if (prevRead != -1) {
+            close(prevRead);
+        }
+        prevRead = next ? -1 : pipefd[0];
+        prevIn = nextIn;
+    }
+
+    // Threads start once every child is forked, with all signals blocked: they are the shell's to handle,
+    // and a builtin writing to a reader that went away gets EPIPE instead of SIGPIPE
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 0, stages = countStages(pCmdLine); i < stages; i++) {
+        builtinStage *stage = &threads[i];
+        if (stage->def == NULL) {
+            continue;
+        }
+        if (stage->status == 0 && pthread_create(&stage->thread, NULL, runBuiltinStage, stage) == 0) {
+            stage->started = 1;
+        } else {
+            stage->status = 1;
+            closeStageStreams(stage);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void waitPipeline(cmdLine *pCmdLine, pid_t *pids, int *monitor, char *stops, int stages, long pipeSize,
+                  builtinStage *threads) {
+    if (pipeSize == PIPE_SIZE_ADAPTIVE || pipestat_ms > 0) {
+        monitorPipeline(pCmdLine, pids, monitor, stops, stages, pipeSize == PIPE_SIZE_ADAPTIVE);
+    } else {
+        // Downstream stages are waited for first so that an early exit can stop the stages feeding it
+        for (int i = stages - 1; i >= 0; i--) {
+            int status = 0;
+            if (pids[i] <= 0) {
+                continue;
+            }
+            waitpid(pids[i], &status, 0);
+            noteReaped(status);
+            if (i == stages - 1) {
+                last_status = exitCode(status);
+            }
+            pids[i] = 0;
+            if (stops[i]) {
+                terminateUpstream(pids, i);
+            }
+        }
+    }
+
+    for (int i = 0; i < stages; i++) {
+        if (threads[i].started) {
+            pthread_join(threads[i].thread, NULL);
+        }
+    }
+    if (threads[stages - 1].def != NULL) {
+        last_status = threads[stages - 1].status;
+    }
+    fflush(stdout);
+}
+
+// Runs the chain to completion with its last stage writing to outFd (-1 for the shell's stdout).
+// Consumes pCmdLine. If capture is not NULL, outFd is ignored and the last stage's output is
+// read into *capture instead (see captureOutput).
+void runPipeline(cmdLine *pCmdLine, long pipeSize, int outFd, argBuffer **capture) {
+    int stages = countStages(pCmdLine);
+    pid_t *pids = (pid_t *)calloc(stages, sizeof(pid_t));
+    int *monitor = (int *)malloc(stages * sizeof(int));
+    char *stops = (char *)malloc(stages);
+    builtinStage *threads = (builtinStage *)calloc(stages, sizeof(builtinStage));
+    if (pids == NULL || monitor == NULL || stops == NULL || threads == NULL) {
+        fprintf(stderr, "Failed to allocate memory for pipeline.\n");
+        free(pids);
+        free(monitor);
+        free(stops);
+        free(threads);
+        freeCmdLines(pCmdLine);
+        return;
+    }
+
+    int capturefd[2] = {-1, -1};
+    if (capture != NULL) {
+        if (pipe2(capturefd, O_CLOEXEC) == -1) {
+            perror("pipe failed");
+            exit(1);
+        }
+        outFd = capturefd[1];
+    }
+
+    spawnPipeline(pCmdLine, pipeSize, outFd, pids, monitor, stops, threads);
+    if (capture != NULL) {
+        close(capturefd[1]);
+        *capture = captureOutput(capturefd[0]);
+        close(capturefd[0]);
+    }
+    waitPipeline(pCmdLine, pids, monitor, stops, stages, pipeSize, threads);
+
+    free(pids);
+    free(monitor);
+    free(stops);
+    free(threads);
+    freeCmdLines(pCmdLine);
+}
+
+void executePipeCommands(cmdLine *pCmdLine, long pipeSize) {
+    runPipeline(pCmdLine, pipeSize, -1, NULL);
+}
+
+void handleOptimizeCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        fprintf(out, "optimize: %s\n", optimize ? "on" : "off");
+    } else if (strcmp(pCmdLine->arguments[1], "on") == 0) {
+        optimize = 1;
+    } else if (strcmp(pCmdLine->arguments[1], "off") == 0) {
+        optimize = 0;
+    } else {
+        fprintf(stderr, "optimize: expected on or off\n");
+    }
+}
+
+// explain <pipeline>: shows the rewrites the optimizer would apply and the resulting plan, without running it
+void handleExplainCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        fprintf(stderr, "explain: missing command\n");
+        return;
+    }
+    shiftCmdArgs(pCmdLine, 1);
+
+    int rewrites = optimizeCmdLines(&pCmdLine, out);
+    fprintf(out, "plan (optimizer %s, %d rewrite%s):\n", optimize ? "on" : "off", rewrites, rewrites == 1 ? "" : "s");
+    printCmdLines(pCmdLine, out);
+    freeCmdLines(pCmdLine);
+}
+
+// memo [-i FILE] [-m FILE] [-e VAR] cmd args: runs cmd through the result cache (see Memo.h).
+// -i hashes the content of FILE, -m only its size and mtime, -e adds a variable to the key.
+// memo --stats / --clear / --limit SIZE manage the store itself.
+void handleMemoCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    char *inputs[MAX_ARGUMENTS], *statInputs[MAX_ARGUMENTS], *envNames[MAX_ARGUMENTS];
+    int nInputs = 0, nStatInputs = 0, nEnv = 0;
+    int i = 1;
+
+    if (pCmdLine->argCount == 2 && strcmp(pCmdLine->arguments[1], "--stats") == 0) {
+        memoPrintStats(out);
+        freeCmdLines(pCmdLine);
+        return;
+    } else if (pCmdLine->argCount == 2 && strcmp(pCmdLine->arguments[1], "--clear") == 0) {
+        memoClear();
+        freeCmdLines(pCmdLine);
+        return;
+    } else if (pCmdLine->argCount == 3 && strcmp(pCmdLine->arguments[1], "--limit") == 0) {
+        long long limit = parseByteSize(pCmdLine->arguments[2]);
+        if (limit <= 0 || limit > LONG_MAX) {
+            fprintf(stderr, "memo: invalid size '%s'\n", pCmdLine->arguments[2]);
+        } else {
+            memoSetLimit(limit);
+        }
+        freeCmdLines(pCmdLine);
+        return;
+    }
+
+    while (i + 1 < pCmdLine->argCount && pCmdLine->arguments[i][0] == '-') {
+        if (strcmp(pCmdLine->arguments[i], "-i") == 0) {
+            inputs[nInputs++] = pCmdLine->arguments[i + 1];
+        } else if (strcmp(pCmdLine->arguments[i], "-m") == 0) {
+            statInputs[nStatInputs++] = pCmdLine->arguments[i + 1];
+        } else if (strcmp(pCmdLine->arguments[i], "-e") == 0) {
+            envNames[nEnv++] = pCmdLine->arguments[i + 1];
+        } else {
+            break;
+        }
+        i += 2;
+    }
+    if (i >= pCmdLine->argCount || pCmdLine->next) {
+        fprintf(stderr, "memo: usage: memo [-i FILE] [-m FILE] [-e VAR] command [args] (single commands only)\n");
+        freeCmdLines(pCmdLine);
+        return;
+    }
+
+    // The option values are freed by the shift, so the key material is kept as copies
+    for (int j = 0; j < nInputs; j++) {
+        inputs[j] = strdup(inputs[j]);
+    }
+    for (int j = 0; j < nStatInputs; j++) {
+        statInputs[j] = strdup(statInputs[j]);
+    }
+    for (int j = 0; j < nEnv; j++) {
+        envNames[j] = strdup(envNames[j]);
+    }
+    shiftCmdArgs(pCmdLine, i);
+
+    int status = memoRun(pCmdLine, inputs, nInputs, statInputs, nStatInputs, envNames, nEnv);
+    last_status = status == -1 ? 1 : status;
+    if (debug) {
+        fprintf(stderr, "memo: %s exited with status %d\n", pCmdLine->arguments[0], status);
+    }
+    for (int j = 0; j < nInputs; j++) {
+        free(inputs[j]);
+    }
+    for (int j = 0; j < nStatInputs; j++) {
+        free(statInputs[j]);
+    }
+    for (int j = 0; j < nEnv; j++) {
+        free(envNames[j]);
+    }
+    freeCmdLines(pCmdLine);
+}
+
+// metrics PATH [SECONDS] exports session metrics to PATH (see Metrics.h); metrics off stops it
+void handleMetricsCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        metricsPrintStatus(out);
+    } else if (strcmp(pCmdLine->arguments[1], "off") == 0) {
+        metricsStop();
+        removeSigchldHandler();
+    } else {
+        int interval = pCmdLine->argCount > 2 ? atoi(pCmdLine->arguments[2]) : 15;
+        if (metricsStart(pCmdLine->arguments[1], interval) == -1) {
+            fprintf(stderr, "metrics: could not start the writer thread\n");
+        } else {
+            installSigchldHandler();
+            publishJobs(process_list);
+        }
+    }
+}
+
+// joblog [off|on|live] [SIZE]: captures the output of background jobs into per-job ring logs
+void handleJobLogCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    const char *modes[] = {"off", "on", "live"};
+    if (pCmdLine->argCount < 2) {
+        fprintf(out, "joblog: %s\n", modes[joblogMode()]);
+        return;
+    }
+
+    long long size = 0;
+    if (pCmdLine->argCount > 2 && ((size = parseByteSize(pCmdLine->arguments[2])) <= 0 || size > INT_MAX)) {
+        fprintf(stderr, "joblog: invalid size '%s'\n", pCmdLine->arguments[2]);
+        return;
+    }
+    for (int mode = JOBLOG_OFF; mode <= JOBLOG_LIVE; mode++) {
+        if (strcmp(pCmdLine->arguments[1], modes[mode]) == 0) {
+            joblogSetMode(mode, size);
+            return;
+        }
+    }
+    fprintf(stderr, "joblog: expected off, on or live\n");
+}
+
+// logs [%pid]: prints a captured job's output, or lists the captured jobs
+void handleLogsCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        joblogList(out);
+        return;
+    }
+
+    const char *job = pCmdLine->arguments[1];
+    int pid = atoi(job[0] == '%' ? job + 1 : job);
+    fflush(out);
+    if (joblogPrint(pid, out) == -1) {
+        fprintf(stderr, "logs: no captured output for %s\n", job);
+    }
+}
+
+void execute(cmdLine *pCmdLine);
+
+// pipestat [-i MS] cmd | cmd ...: runs the pipeline while reporting, every MS milliseconds, the fill
+// of each pipe and whether each stage is cpu-bound, blocked on a full output pipe or starved for input.
+void handlePipeStatCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    int interval = PIPESTAT_DEFAULT_MS;
+    int skip = 1;
+    if (pCmdLine->argCount > 2 && strcmp(pCmdLine->arguments[1], "-i") == 0) {
+        interval = atoi(pCmdLine->arguments[2]);
+        skip = 3;
+    }
+    if (interval <= 0 || pCmdLine->argCount <= skip || pCmdLine->next == NULL) {
+        fprintf(stderr, "usage: pipestat [-i MS] cmd | cmd ...\n");
+        freeCmdLines(pCmdLine);
+        return;
+    }
+    shiftCmdArgs(pCmdLine, skip);
+
+    pipestat_ms = interval;
+    execute(pCmdLine);
+    pipestat_ms = 0;
+}
+
+// Appends text to a command buffer, reporting whether it still fits
+int appendText(char *buf, size_t size, const char *text) {
+    size_t len = strlen(buf);
+    if (len + strlen(text) >= size) {
+        return 0;
+    }
+    strcpy(buf + len, text);
+    return 1;
+}
+
+// Writes the chain back as command text, one command per ":::" separator, into texts[0..]
+// (each BUFFER_SIZE bytes). Returns the number of commands, or -1 if they do not fit.
+int splitBenchCommands(cmdLine *pCmdLine, char texts[][BUFFER_SIZE], int max) {
+    int count = 1;
+    texts[0][0] = '\0';
+    for (cmdLine *curr = pCmdLine; curr != NULL; curr = curr->next) {
+        int ok = curr->idx == 0 || appendText(texts[count - 1], BUFFER_SIZE, " |");
+        for (int i = 0; ok && i < curr->argCount; i++) {
+            if (strcmp(curr->arguments[i], ":::") == 0) {
+                if (count == max) {
+                    return -1;
+                }
+                texts[count++][0] = '\0';
+            } else {
+                ok = appendText(texts[count - 1], BUFFER_SIZE, " ") &&
+                     appendText(texts[count - 1], BUFFER_SIZE, curr->arguments[i]);
+            }
+        }
+        if (ok && curr->inputRedirect) {
+            ok = appendText(texts[count - 1], BUFFER_SIZE, " < ") &&
+                 appendText(texts[count - 1], BUFFER_SIZE, curr->inputRedirect);
+        }
+        if (ok && curr->outputRedirect) {
+            ok = appendText(texts[count - 1], BUFFER_SIZE, " > ") &&
+                 appendText(texts[count - 1], BUFFER_SIZE, curr->outputRedirect);
+        }
+        if (!ok) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Runs the chain once through the normal spawn path with stdout on outFd (-1 to keep it) and
+// returns the wall-clock time in seconds. The chain is not consumed.
+double timePipeline(cmdLine *pCmdLine, int outFd) {
+    int stages = countStages(pCmdLine);
+    pid_t pids[stages];
+    int monitor[stages];
+    char stops[stages];
+    builtinStage threads[stages];
+
+    long long start = monotonicNs();
+    spawnPipeline(pCmdLine, pipe_size, outFd, pids, monitor, stops, threads);
+    waitPipeline(pCmdLine, pids, monitor, stops, stages, pipe_size, threads);
+    return (monotonicNs() - start) / 1e9;
+}
+
+// bench [-n RUNS] [-w WARMUPS] [--show-output] cmd [::: cmd ...]: times each command (or pipeline)
+// like hyperfine, from inside the shell. Output goes to /dev/null unless --show-output is given.
+void handleBenchCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    int runs = BENCH_DEFAULT_RUNS, warmups = 0, showOutput = 0;
+    int skip = 1;
+    while (skip < pCmdLine->argCount) {
+        const char *arg = pCmdLine->arguments[skip];
+        if (strcmp(arg, "-n") == 0 && skip + 1 < pCmdLine->argCount) {
+            runs = atoi(pCmdLine->arguments[skip + 1]);
+            skip += 2;
+        } else if (strcmp(arg, "-w") == 0 && skip + 1 < pCmdLine->argCount) {
+            warmups = atoi(pCmdLine->arguments[skip + 1]);
+            skip += 2;
+        } else if (strcmp(arg, "--show-output") == 0) {
+            showOutput = 1;
+            skip++;
+        } else {
+            break;
+        }
+    }
+    if (runs <= 0 || warmups < 0 || skip >= pCmdLine->argCount) {
+        fprintf(stderr, "usage: bench [-n RUNS] [-w WARMUPS] [--show-output] cmd [::: cmd ...]\n");
+        freeCmdLines(pCmdLine);
+        return;
+    }
+    shiftCmdArgs(pCmdLine, skip);
+
+    static char texts[BENCH_MAX_COMMANDS][BUFFER_SIZE];
+    int count = splitBenchCommands(pCmdLine, texts, BENCH_MAX_COMMANDS);
+    freeCmdLines(pCmdLine);
+    if (count == -1) {
+        fprintf(stderr, "bench: too many commands (at most %d)\n", BENCH_MAX_COMMANDS);
+        return;
+    }
+
+    int outFd = showOutput ? -1 : open("/dev/null", O_WRONLY | O_CLOEXEC);
+    double *samples = (double *)malloc(runs * sizeof(double));
+    benchStats stats[BENCH_MAX_COMMANDS];
+    char *names[BENCH_MAX_COMMANDS];
+
+    for (int c = 0; c < count; c++) {
+        names[c] = texts[c] + (texts[c][0] == ' ');
+        stats[c].n = 0;
+        cmdLine *cmd = parseCmdLines(names[c]);
+        if (cmd == NULL) {
+            fprintf(stderr, "bench: empty command\n");
+            continue;
+        }
+
+        for (int i = 0; i < warmups; i++) {
+            timePipeline(cmd, outFd);
+        }
+        struct rusage before, after;
+        int failed = 0;
+        getrusage(RUSAGE_CHILDREN, &before);
+        for (int i = 0; i < runs; i++) {
+            samples[i] = timePipeline(cmd, outFd);
+            if (last_status != 0) {
+                failed++;
+            }
+        }
+        getrusage(RUSAGE_CHILDREN, &after);
+        freeCmdLines(cmd);
+
+        double user = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) +
+                      (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+        double sys = (after.ru_stime.tv_sec - before.ru_stime.tv_sec) +
+                     (after.ru_stime.tv_usec - before.ru_stime.tv_usec) / 1e6;
+        benchSummarize(samples, runs, &stats[c]);
+        benchPrint(names[c], &stats[c], user / runs, sys / runs, failed, out);
+        last_status = failed > 0;
+    }
+    benchCompare(names, stats, count, out);
+
+    free(samples);
+    if (outFd != -1) {
+        close(outFd);
+    }
+}
+
+// Opens the output redirection in the shell so the file can be preallocated now and dropped from the
+// page cache once the job is done. Returns -1 (leaving the open to the child) if it cannot be opened.
+// The child writes through this fd, so it must not stop at 2 GiB whatever the child was built with.
+int openHintedOutput(cmdLine *pCmdLine) {
+    int fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_LARGEFILE, 0644);
+    if (fd == -1) {
+        return -1;
+    }
+    // KEEP_SIZE reserves the blocks without growing the file, so a shorter output leaves no padding
+    if (iohint_size > 0 && fallocate64(fd, FALLOC_FL_KEEP_SIZE, 0, iohint_size) == -1 && debug) {
+        perror("iohint: fallocate failed");
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+// iohint [auto|on|off]: page-cache hints for redirected files of single commands (auto: background jobs only)
+// iohint on|off [-s SIZE] cmd ...: overrides the setting for one command; -s preallocates the output
+void handleIoHintCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    const char *names[] = {"off", "on", "auto"};
+    if (pCmdLine->argCount < 2) {
+        fprintf(out, "iohint: %s\n", names[iohint_mode]);
+        freeCmdLines(pCmdLine);
+        return;
+    }
+
+    int mode = -1;
+    for (int i = 0; i < 3; i++) {
+        if (strcmp(pCmdLine->arguments[1], names[i]) == 0) {
+            mode = i;
+        }
+    }
+    int skip = mode == -1 ? 1 : 2;
+    long long size = 0;
+    if (skip + 1 < pCmdLine->argCount && strcmp(pCmdLine->arguments[skip], "-s") == 0) {
+        size = parseByteSize(pCmdLine->arguments[skip + 1]);
+        skip += 2;
+        mode = mode == -1 ? IOHINT_ON : mode;
+    }
+    if (mode == -1 || size < 0 || (mode == IOHINT_AUTO && skip < pCmdLine->argCount)) {
+        fprintf(stderr, "usage: iohint [auto|on|off] or iohint on|off [-s SIZE] cmd ...\n");
+        freeCmdLines(pCmdLine);
+        return;
+    }
+    if (skip >= pCmdLine->argCount) {
+        iohint_mode = mode;
+        freeCmdLines(pCmdLine);
+        return;
+    }
+    shiftCmdArgs(pCmdLine, skip);
+
+    iohint_force = mode;
+    iohint_size = size;
+    execute(pCmdLine);
+    iohint_force = -1;
+    iohint_size = 0;
+}
+
+// Runs a foreground "cat FILE... > OUT" (or "cat < IN > OUT") inside the shell when OUT is a regular
+// file, copying in the kernel (reflink, copy_file_range, sendfile or splice; see FastCopy.h).
+// Returns 0 without doing anything if the command does not qualify; otherwise consumes pCmdLine.
+int runBuiltinCat(cmdLine *pCmdLine) {
+    if (strcmp(pCmdLine->arguments[0], "cat") != 0 || !pCmdLine->blocking || pCmdLine->outputRedirect == NULL ||
+        (pCmdLine->argCount == 1 && pCmdLine->inputRedirect == NULL)) {
+        return 0;
+    }
+    for (int i = 1; i < pCmdLine->argCount; i++) {
+        if (pCmdLine->arguments[i][0] == '-') {
+            return 0; // options (and "-" for stdin) are left to the real cat
+        }
+    }
+    // opening a FIFO or a device could block or have side effects the real cat should handle
+    struct stat st;
+    if (stat(pCmdLine->outputRedirect, &st) == 0 && !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    int out = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out == -1) {
+        perror("open output file failed");
+        last_status = 1;
+        freeCmdLines(pCmdLine);
+        return 1;
+    }
+    struct stat outSt;
+    fstat(out, &outSt);
+
+    int inputs = pCmdLine->argCount > 1 ? pCmdLine->argCount - 1 : 1;
+    last_status = 0;
+    for (int i = 0; i < inputs; i++) {
+        const char *name = pCmdLine->argCount > 1 ? pCmdLine->arguments[i + 1] : pCmdLine->inputRedirect;
+        int in = open(name, O_RDONLY | O_CLOEXEC);
+        if (in == -1) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            last_status = 1;
+            continue;
+        }
+        struct stat inSt;
+        if (fstat(in, &inSt) == 0 && inSt.st_dev == outSt.st_dev && inSt.st_ino == outSt.st_ino) {
+            fprintf(stderr, "cat: %s: input file is output file\n", name);
+            last_status = 1;
+            close(in);
+            continue;
+        }
+
+        int method = copyFd(in, out, lseek(out, 0, SEEK_CUR) == 0);
+        if (method == COPY_FAILED) {
+            fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+            last_status = 1;
+        } else if (debug) {
+            fprintf(stderr, "cat: %s copied with %s\n", name, copyMethodName(method));
+        }
+        close(in);
+    }
+    close(out);
+    freeCmdLines(pCmdLine);
+    return 1;
+}
+
+void executeSingleCommand(cmdLine *pCmdLine) {
+    int logfd[2] = {-1, -1};
+    if (!pCmdLine->blocking && joblogMode() != JOBLOG_OFF && pipe2(logfd, O_CLOEXEC) == -1) {
+        perror("joblog: pipe failed");
+    }
+
+    int mode = iohint_force != -1 ? iohint_force : iohint_mode;
+    int hints = mode == IOHINT_ON || (mode == IOHINT_AUTO && !pCmdLine->blocking);
+    int outFd = hints && pCmdLine->outputRedirect ? openHintedOutput(pCmdLine) : -1;
+
+    const char *path = lookupCommand(pCmdLine->arguments[0]);
+    pid_t pid = fork();
+    
+    if (pid == -1) {
+        metricsCount(METRIC_FORK_FAILURES);
+        perror("fork failed");
+        exit(1);
+    } else if (pid == 0) {
+        // Child process
+        if (logfd[1] != -1) {
+            dup2(logfd[1], STDOUT_FILENO);
+            dup2(logfd[1], STDERR_FILENO);
+        }
+        applyRedirections(pCmdLine, outFd, hints);
+
+        execCommand(pCmdLine, path);
+        
+        // If execvp returns, it must have failed
+        perror("execvp failed");
+        _exit(127); // Exit abnormally if execvp fails (127 is what shells report for a command that cannot run)
+    } else {
+        // Parent process
+        metricsCount(METRIC_FORKS);
+        if (logfd[1] != -1) {
+            close(logfd[1]);
+            joblogAttach(pid, logfd[0], pCmdLine->arguments[0]);
+        }
+        addProcess(&process_list, pCmdLine, pid);
+        process_list->hintFd = outFd;
+        if (debug) {
+            fprintf(stderr, "PID: %d\n", pid);
+            fprintf(stderr, "Executing command: %s\n", pCmdLine->arguments[0]);
+            fprintf(stderr, "Blocking: %d\n", pCmdLine->blocking);
+        }
+        if (pCmdLine->blocking) {
+            int status = 0;
+            waitpid(pid, &status, 0); // Wait for the child process to terminate if blocking
+            noteReaped(status);
+            last_status = exitCode(status);
+            releaseOutput(process_list, 1); // waiting for the writeback would hold up the prompt
+        }
+    }
+}
+
+cmdLine *parseLine(const char *strLine);
+function *findFunction(const char *name);
+void callFunction(function *f, cmdLine *call);
+
+// Runs the command line inside a $(...) and returns its output
+argBuffer *captureCommand(const char *strLine) {
+    argBuffer *capture = NULL;
+    cmdLine *pCmdLine = parseLine(strLine);
+    function *f = pCmdLine != NULL && pCmdLine->next == NULL ? findFunction(pCmdLine->arguments[0]) : NULL;
+    if (f != NULL) {
+        // a function runs in the shell, writing into a memory file that is read back afterwards
+        int memfd = memfd_create("capture", MFD_CLOEXEC);
+        int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        fflush(stdout);
+        dup2(memfd, STDOUT_FILENO);
+        callFunction(f, pCmdLine);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+        lseek(memfd, 0, SEEK_SET);
+        capture = captureOutput(memfd);
+        close(memfd);
+        freeCmdLines(pCmdLine);
+    } else if (pCmdLine != NULL) {
+        runPipeline(pCmdLine, pipe_size, -1, &capture);
+    }
+    if (capture == NULL && (capture = (argBuffer *)malloc(sizeof(argBuffer) + 1)) != NULL) {
+        capture->next = NULL;
+        capture->size = 0;
+        capture->data[0] = '\0';
+    }
+    return capture;
+}
+
+// Returns the index of the capture if arg is exactly one marker, otherwise -1
+int markerIndex(const char *arg) {
+    char *end;
+    if (arg[0] != SUBST_MARK) {
+        return -1;
+    }
+    long k = strtol(arg + 1, &end, 10);
+    return (end[0] == SUBST_MARK && end[1] == '\0') ? (int)k : -1;
+}
+
+// Builds a copy of str with every marker replaced by its capture, whitespace runs folded into single spaces.
+// Used when a $(...) is only part of a word, so its output cannot be spliced in as separate arguments.
+char *expandMarkers(const char *str, argBuffer **captures) {
+    size_t len = strlen(str) + 1;
+    for (const char *s = strchr(str, SUBST_MARK); s != NULL; s = strchr(s + 1, SUBST_MARK)) {
+        int k = atoi(s + 1);
+        if (captures[k] != NULL) {
+            len += captures[k]->size;
+        }
+        s = strchr(s + 1, SUBST_MARK);
+    }
+
+    char *result = (char *)malloc(len);
+    char *out = result;
+    while (*str) {
+        if (*str != SUBST_MARK) {
+            *out++ = *str++;
+            continue;
+        }
+        int k = atoi(str + 1);
+        str = strchr(str + 1, SUBST_MARK) + 1;
+        if (captures[k] == NULL) {
+            continue;
+        }
+        int space = 0;
+        for (size_t i = 0; i < captures[k]->size; i++) {
+            if (isspace((unsigned char)captures[k]->data[i])) {
+                space = 1;
+            } else {
+                if (space && out > result && out[-1] != ' ') {
+                    *out++ = ' ';
+                }
+                space = 0;
+                *out++ = captures[k]->data[i];
+            }
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+// Parses a command line after evaluating every $(...) in it, left to right.
+// Each inner command line is run directly as a pipeline whose stdout is a pipe (no intermediate shell),
+// and a substitution that forms a whole word is split into arguments in place in the capture buffer.
+cmdLine *parseWithSubstitutions(const char *strLine) {
+    const char *open = strstr(strLine, "$(");
+    if (open == NULL) {
+        return parseTimed(strLine);
+    }
+
+    argBuffer *captures[MAX_ARGUMENTS];
+    int count = 0;
+    // a marker is at most 5 bytes and replaces at least the 3 bytes of "$()"
+    char *line = (char *)malloc(strlen(strLine) + 2 * MAX_ARGUMENTS + 1);
+    char *out = line;
+    const char *s = strLine;
+
+    while ((open = strstr(s, "$(")) != NULL && count < MAX_ARGUMENTS) {
+        const char *p = open + 2;
+        int depth = 1;
+        while (*p && depth > 0) {
+            if (*p == '(') {
+                depth++;
+            } else if (*p == ')') {
+                depth--;
+            }
+            p++;
+        }
+        if (depth > 0) {
+            fprintf(stderr, "substitution: missing )\n");
+            break;
+        }
+
+        memcpy(out, s, open - s);
+        out += open - s;
+        char *inner = strndup(open + 2, p - 1 - (open + 2));
+        captures[count] = captureCommand(inner);
+        free(inner);
+        out += sprintf(out, "%c%d%c", SUBST_MARK, count, SUBST_MARK);
+        count++;
+        s = p;
+    }
+    if (open != NULL) {
+        for (int k = 0; k < count; k++) {
+            free(captures[k]);
+        }
+        free(line);
+        return NULL;
+    }
+    strcpy(out, s);
+
+    cmdLine *head = parseTimed(line);
+    free(line);
+    for (cmdLine *curr = head; curr != NULL; curr = curr->next) {
+        for (int i = 0; i < curr->argCount; i++) {
+            int k = markerIndex(curr->arguments[i]);
+            if (k >= 0 && captures[k] != NULL) {
+                int words = spliceCmdArgs(curr, i, captures[k]);
+                captures[k] = NULL;
+                if (words == -1) {
+                    fprintf(stderr, "substitution: too many arguments\n");
+                    freeCmdLines(head);
+                    head = NULL;
+                    break;
+                }
+                i += words - 1;
+            } else if (strchr(curr->arguments[i], SUBST_MARK) != NULL) {
+                char *expanded = expandMarkers(curr->arguments[i], captures);
+                replaceCmdArg(curr, i, expanded);
+                free(expanded);
+            }
+        }
+        if (head == NULL) {
+            break;
+        }
+        if (curr->inputRedirect && strchr(curr->inputRedirect, SUBST_MARK) != NULL) {
+            char *expanded = expandMarkers(curr->inputRedirect, captures);
+            free((void *)curr->inputRedirect);
+            curr->inputRedirect = expanded;
+        }
+        if (curr->outputRedirect && strchr(curr->outputRedirect, SUBST_MARK) != NULL) {
+            char *expanded = expandMarkers(curr->outputRedirect, captures);
+            free((void *)curr->outputRedirect);
+            curr->outputRedirect = expanded;
+        }
+    }
+
+    for (int k = 0; k < count; k++) {
+        free(captures[k]);
+    }
+    for (cmdLine *curr = head; curr != NULL; curr = curr->next) {
+        if (curr->argCount == 0) {
+            // the whole command came from a substitution that produced nothing
+            freeCmdLines(head);
+            return NULL;
+        }
+    }
+    return head;
+}
+
+// Replaces every argument containing * ? or [...] by the paths it matches, in byte order.
+// A pattern that matches nothing is kept as typed. Returns -1 if the matches do not fit in
+// the argument list.
+int expandGlobs(cmdLine *head) {
+    char *words[MAX_ARGUMENTS];
+    for (cmdLine *curr = head; curr != NULL; curr = curr->next) {
+        for (int i = 0; i < curr->argCount; i++) {
+            if (!globHasMeta(curr->arguments[i])) {
+                continue;
+            }
+            // watch matches its patterns against the paths that change, not the ones that exist now
+            if (i > 0 && strcmp(curr->arguments[0], "watch") == 0 && strcmp(curr->arguments[i - 1], "-p") == 0) {
+                continue;
+            }
+            argBuffer *buffer;
+            int room = MAX_ARGUMENTS - curr->argCount;
+            int count = globExpand(curr->arguments[i], &buffer, words, room);
+            if (count > room) {
+                fprintf(stderr, "glob: %s: too many matches (at most %d arguments)\n", curr->arguments[i],
+                        MAX_ARGUMENTS - 1);
+                return -1;
+            } else if (count > 0) {
+                spliceCmdArgv(curr, i, buffer, words, count);
+                i += count - 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Expands $0-$9, $#, $? and $@ of the current frame inside str. Returns a new string
+char *expandParameters(const char *str) {
+    size_t size = strlen(str) + 1, len = 0;
+    char *out = (char *)malloc(size);
+    while (*str) {
+        char value[32];
+        const char *add = NULL;
+        int skip = 2;
+        if (str[0] == '$' && isdigit((unsigned char)str[1])) {
+            int n = str[1] - '0';
+            add = n == 0 ? current_frame->name : (n <= current_frame->argc ? current_frame->argv[n - 1] : "");
+        } else if (str[0] == '$' && str[1] == '#') {
+            snprintf(value, sizeof(value), "%d", current_frame->argc);
+            add = value;
+        } else if (str[0] == '$' && str[1] == '?') {
+            snprintf(value, sizeof(value), "%d", last_status);
+            add = value;
+        }
+
+        if (add == NULL && str[0] == '$' && str[1] == '@') {
+            // inside a longer word the arguments are joined with spaces
+            for (int i = 0; i < current_frame->argc; i++) {
+                size += strlen(current_frame->argv[i]) + 1;
+            }
+            out = (char *)realloc(out, size);
+            for (int i = 0; i < current_frame->argc; i++) {
+                len += sprintf(out + len, "%s%s", i ? " " : "", current_frame->argv[i]);
+            }
+        } else if (add != NULL) {
+            size += strlen(add);
+            out = (char *)realloc(out, size);
+            len += sprintf(out + len, "%s", add);
+        } else {
+            out[len++] = *str;
+            skip = 1;
+        }
+        str += skip;
+    }
+    out[len] = '\0';
+    return out;
+}
+
+// Replaces positional parameters in the arguments and redirections. A "$@" argument on its own
+// becomes one argument per parameter, so parameters containing spaces stay whole.
+void expandPositional(cmdLine *head) {
+    for (cmdLine *curr = head; curr != NULL; curr = curr->next) {
+        for (int i = 0; i < curr->argCount; i++) {
+            if (strchr(curr->arguments[i], '$') == NULL) {
+                continue;
+            }
+            if (strcmp(curr->arguments[i], "$@") == 0) {
+                char *words[MAX_ARGUMENTS];
+                size_t size = 0;
+                int count = current_frame->argc;
+                for (int k = 0; k < count; k++) {
+                    size += strlen(current_frame->argv[k]) + 1;
+                }
+                argBuffer *buffer = (argBuffer *)malloc(sizeof(argBuffer) + size + 1);
+                buffer->next = NULL;
+                buffer->size = 0;
+                for (int k = 0; k < count; k++) {
+                    words[k] = buffer->data + buffer->size;
+                    buffer->size += sprintf(words[k], "%s", current_frame->argv[k]) + 1;
+                }
+                buffer->size -= buffer->size > 0;
+                if (spliceCmdArgv(curr, i, buffer, words, count) == -1) {
+                    fprintf(stderr, "$@: too many arguments\n");
+                    continue;
+                }
+                i += count - 1;
+            } else {
+                char *expanded = expandParameters(curr->arguments[i]);
+                replaceCmdArg(curr, i, expanded);
+                free(expanded);
+            }
+        }
+        if (curr->inputRedirect && strchr(curr->inputRedirect, '$') != NULL) {
+            char *expanded = expandParameters(curr->inputRedirect);
+            free((void *)curr->inputRedirect);
+            curr->inputRedirect = expanded;
+        }
+        if (curr->outputRedirect && strchr(curr->outputRedirect, '$') != NULL) {
+            char *expanded = expandParameters(curr->outputRedirect);
+            free((void *)curr->outputRedirect);
+            curr->outputRedirect = expanded;
+        }
+    }
+}
+
+// The expansions that follow parsing: positional parameters (inside a function or script), then globs.
+// Consumes head on failure and returns NULL if nothing is left to run.
+cmdLine *expandCmdLines(cmdLine *head) {
+    if (head == NULL) {
+        return NULL;
+    }
+    if (current_frame != NULL) {
+        expandPositional(head);
+    }
+    if (glob_enabled && expandGlobs(head) == -1) {
+        freeCmdLines(head);
+        return NULL;
+    }
+    for (cmdLine *curr = head; curr != NULL; curr = curr->next) {
+        if (curr->argCount == 0) {
+            freeCmdLines(head);
+            return NULL;
+        }
+    }
+    return head;
+}
+
+cmdLine *parseLine(const char *strLine) {
+    return expandCmdLines(parseWithSubstitutions(strLine));
+}
+
+// glob [on|off]
+void handleGlobCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        fprintf(out, "glob: %s\n", glob_enabled ? "on" : "off");
+    } else if (strcmp(pCmdLine->arguments[1], "on") == 0) {
+        glob_enabled = 1;
+    } else if (strcmp(pCmdLine->arguments[1], "off") == 0) {
+        glob_enabled = 0;
+    } else {
+        fprintf(stderr, "glob: expected on or off\n");
+    }
+}
+
+// Runs a parsed command line; returns 1 once quit was requested
+int runCommand(cmdLine *cmd) {
+    if (cmd == NULL) {
+        return quit_requested;
+    }
+    if (strcmp(cmd->arguments[0], "quit") == 0) {
+        freeCmdLines(cmd);
+        quit_requested = 1;
+        return 1;
+    }
+    metricsCount(METRIC_COMMANDS);
+    last_status = 0;
+    execute(cmd);
+    return quit_requested;
+}
+
+function *findFunction(const char *name) {
+    for (function *f = functions; f != NULL; f = f->next) {
+        if (strcmp(f->name, name) == 0) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+void freeFunction(function *f) {
+    for (int i = 0; i < f->count; i++) {
+        free(f->lines[i]);
+        freeCmdLines(f->parsed[i]);
+    }
+    free(f->lines);
+    free(f->parsed);
+    free(f->name);
+    free(f);
+}
+
+// Drops a reference; a function redefined while it runs is only freed once its last call returns
+void releaseFunction(function *f) {
+    if (--f->refs == 0) {
+        freeFunction(f);
+    }
+}
+
+// "function NAME" starts collecting a body; "function" alone lists the defined functions
+void beginFunction(const char *rest) {
+    char name[MAX_BUF];
+    if (sscanf(rest, "%199s", name) != 1) {
+        for (function *f = functions; f != NULL; f = f->next) {
+            printf("%s (%d line%s)\n", f->name, f->count, f->count == 1 ? "" : "s");
+        }
+        return;
+    }
+    defining = (function *)calloc(1, sizeof(function));
+    defining->name = strdup(name);
+    defining->refs = 1;
+}
+
+// A line with a { ... } group runs as several command lines joined by a relay
+int isGroupLine(const char *line) {
+    return line[0] == '{' || strstr(line, "|{") != NULL;
+}
+
+// Splits "a ; b ; c" in place at the semicolons. Returns the number of (non-empty) parts,
+// or -1 if there are more than max.
+int splitGroup(char *text, char **parts, int max) {
+    int count = 0;
+    char *save = NULL;
+    for (char *part = strtok_r(text, ";", &save); part != NULL; part = strtok_r(NULL, ";", &save)) {
+        if (part[strspn(part, " \t\n")] == '\0') {
+            continue;
+        }
+        if (count == max) {
+            return -1;
+        }
+        parts[count++] = part;
+    }
+    return count;
+}
+
+// Runs one command line of a group in a child shell with stdin/stdout on inFd/outFd (-1 keeps
+// the shell's own). The child closes every other descriptor of the group, or the relays would
+// never see end of input. Consumes cmd; returns the child's pid or -1.
+pid_t spawnGroupMember(cmdLine *cmd, int inFd, int outFd, int *groupFds, int nfds) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (inFd != -1) {
+            dup2(inFd, STDIN_FILENO);
+        }
+        if (outFd != -1) {
+            dup2(outFd, STDOUT_FILENO);
+        }
+        for (int i = 0; i < nfds; i++) {
+            close(groupFds[i]);
+        }
+        job_table = NULL; // the member's commands are not jobs of the interactive shell
+        for (cmdLine *curr = cmd; curr != NULL; curr = curr->next) {
+            curr->blocking = 1;
+        }
+        runCommand(cmd);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pid == -1) {
+        perror("fork failed");
+    }
+    freeCmdLines(cmd);
+    return pid;
+}
+
+// Runs the members of a group, parsed from parts: member j is joined to the relay by its own
+// pipe. The first writers members write into the relay and the rest read from it; mode picks
+// the relay (GROUP_FAN_OUT, GROUP_FAN_IN or GROUP_MERGE). The last member's exit code becomes
+// the line's status.
+void runGroup(char **parts, int n, int writers, int mode) {
+    cmdLine *cmds[GROUP_MAX + 1];
+    int ok = 1;
+    for (int j = 0; j < n; j++) {
+        cmds[j] = parseLine(parts[j]);
+        ok = ok && cmds[j] != NULL;
+    }
+    if (!ok) {
+        fprintf(stderr, "syntax error: empty command in a { ... } group\n");
+    }
+
+    int pipes[GROUP_MAX + 1][2];
+    int fds[2 * (GROUP_MAX + 1)];
+    int nfds = 0;
+    for (int j = 0; ok && j < n; j++) {
+        if (createPipe(pipes[j], RELAY_PIPE_SIZE) == -1) {
+            perror("pipe failed");
+            ok = 0;
+            break;
+        }
+        fds[nfds++] = pipes[j][0];
+        fds[nfds++] = pipes[j][1];
+    }
+    if (!ok) {
+        for (int j = 0; j < n; j++) {
+            freeCmdLines(cmds[j]);
+        }
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        last_status = 2;
+        return;
+    }
+
+    pid_t pids[GROUP_MAX + 2];
+    int npids = 0;
+    for (int j = 0; j < writers; j++) {
+        pids[npids++] = spawnGroupMember(cmds[j], -1, pipes[j][1], fds, nfds);
+    }
+    pid_t relay = fork();
+    if (relay == 0) {
+        signal(SIGPIPE, SIG_IGN); // a reader that exits early is dropped, not fatal
+        int ins[GROUP_MAX + 1], outs[GROUP_MAX + 1];
+        for (int j = 0; j < n; j++) {
+            close(pipes[j][j < writers ? 1 : 0]);
+            if (j < writers) {
+                ins[j] = pipes[j][0];
+            } else {
+                outs[j - writers] = pipes[j][1];
+            }
+        }
+        int res = mode == GROUP_FAN_OUT ? relayTee(ins[0], outs, n - writers)
+                                        : relayMerge(ins, writers, outs[0], mode == GROUP_MERGE);
+        _exit(res == 0 ? 0 : 1);
+    }
+    pids[npids++] = relay;
+    for (int j = writers; j < n; j++) {
+        pids[npids++] = spawnGroupMember(cmds[j], pipes[j][0], -1, fds, nfds);
+    }
+    for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+
+    for (int i = 0; i < npids; i++) {
+        int status = 0;
+        if (pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i]) {
+            noteReaped(status);
+            last_status = exitCode(status);
+        }
+    }
+}
+
+// Called on the batch scheduler's thread for each released job: runs it in a child shell
+pid_t launchBatchJob(void *job) {
+    return spawnGroupMember(cloneCmdLines((cmdLine *)job), -1, -1, NULL, 0);
+}
+
+// Adds the jobs the batch scheduler has started since the last call to the process list
+void collectBatchJobs() {
+    pid_t pid;
+    cmdLine *job;
+    while ((job = (cmdLine *)batchTakeStarted(&pid)) != NULL) {
+        if (pid == -1) {
+            freeCmdLines(job);
+        } else {
+            addProcess(&process_list, job, pid);
+        }
+    }
+}
+
+// batch: shows the limits, the current pressure and the queued jobs.
+// batch -l cpu|memory|io|load VALUE: sets a limit (percent of time stalled for cpu, memory and io,
+// the 1-minute load average for load); 0 removes it.
+// batch command [args]: queues the command; it starts in the background once every limit is met.
+void handleBatchCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    static const char *names[BATCH_LIMITS] = {"cpu", "memory", "io", "load"};
+    if (batchInit(launchBatchJob) == -1) {
+        perror("batch: cannot start the scheduler");
+        last_status = 1;
+        return;
+    }
+    if (pCmdLine->argCount < 2) {
+        batchPrint(out);
+        return;
+    }
+
+    if (strcmp(pCmdLine->arguments[1], "-l") == 0) {
+        int resource = -1;
+        for (int r = 0; pCmdLine->argCount == 4 && r < BATCH_LIMITS; r++) {
+            if (strcmp(pCmdLine->arguments[2], names[r]) == 0) {
+                resource = r;
+            }
+        }
+        if (resource == -1) {
+            fprintf(stderr, "usage: batch -l cpu|memory|io|load VALUE\n");
+            last_status = 1;
+            return;
+        }
+        batchSetLimit(resource, atof(pCmdLine->arguments[3]));
+        return;
+    }
+
+    cmdLine *job = cloneCmdLines(pCmdLine);
+    shiftCmdArgs(job, 1);
+    char label[MAX_BUF] = "";
+    for (cmdLine *curr = job; curr != NULL; curr = curr->next) {
+        for (int i = 0; i < curr->argCount; i++) {
+            appendText(label, sizeof(label), curr->arguments[i]);
+            appendText(label, sizeof(label), i + 1 < curr->argCount ? " " : curr->next ? " | " : "");
+        }
+    }
+    batchSubmit(job, label);
+}
+
+// Runs a line holding a { ... } group:
+//   producer |{ consumer ; consumer ... }   every consumer reads all of the producer's output
+//   { producer ; producer ... }| consumer   the producers' lines are merged as they come
+//   { producer ; producer ... }|= consumer  sorted inputs are merged into one sorted stream
+void runGroupLine(const char *line) {
+    char *text = strdup(line);
+    char *parts[GROUP_MAX + 1];
+    int count = -1;
+    int mode = GROUP_FAN_OUT;
+    char *open = strstr(text, "|{");
+    char *close = text[0] == '{' ? strstr(text, "}|") : strrchr(text, '}');
+
+    if (text[0] == '{' && close != NULL) {
+        // the consumer goes after the producers, as the last member
+        char *consumer = close + 2;
+        mode = GROUP_FAN_IN;
+        if (*consumer == '=') {
+            mode = GROUP_MERGE;
+            consumer++;
+        }
+        *close = '\0';
+        count = splitGroup(text + 1, parts, GROUP_MAX);
+        if (count > 0) {
+            parts[count] = consumer;
+            runGroup(parts, count + 1, count, mode);
+        }
+    } else if (open != NULL && close != NULL && close > open && close[1 + strspn(close + 1, " \t\n")] == '\0') {
+        *open = '\0';
+        *close = '\0';
+        parts[0] = text;
+        count = splitGroup(open + 2, parts + 1, GROUP_MAX);
+        if (count > 0) {
+            runGroup(parts, count + 1, 1, mode);
+        }
+    }
+    if (count <= 0) {
+        fprintf(stderr, "syntax error: expected producer |{ a ; b ... } or { a ; b ... }| consumer "
+                        "(with 1 to %d commands in the braces)\n", GROUP_MAX);
+        last_status = 2;
+    }
+    free(text);
+}
+
+// Installs the function being defined, replacing any older definition
+void installFunction() {
+    function **link = &functions;
+    while (*link != NULL && strcmp((*link)->name, defining->name) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        function *old = *link;
+        *link = old->next;
+        releaseFunction(old);
+    }
+    defining->next = functions;
+    functions = defining;
+    defining = NULL;
+}
+
+// Appends a body line to the function being defined; parsed (NULL to parse on every call) is taken over
+void addFunctionLine(const char *line, cmdLine *parsed) {
+    defining->lines = (char **)realloc(defining->lines, (defining->count + 1) * sizeof(char *));
+    defining->parsed = (cmdLine **)realloc(defining->parsed, (defining->count + 1) * sizeof(cmdLine *));
+    defining->lines[defining->count] = line != NULL ? strdup(line) : NULL;
+    defining->parsed[defining->count] = parsed;
+    defining->count++;
+}
+
+// Adds a body line to the function being defined; "end" installs it
+void defineFunctionLine(const char *line) {
+    char word[8];
+    if (sscanf(line, "%7s", word) == 1 && strcmp(word, "end") == 0) {
+        installFunction();
+        return;
+    }
+
+    if (line[0] == '\0' || line[0] == '\n' || line[0] == '#') {
+        return;
+    }
+    // a $(...) must run on every call and a group is split up when it runs; anything else parses
+    // the same each time
+    addFunctionLine(line, strstr(line, "$(") == NULL && !isGroupLine(line) ? parseTimed(line) : NULL);
+}
+
+// Runs one line of input: collects function bodies, skips comments, parses and executes.
+// Returns 1 once quit was requested.
+int processLine(const char *line) {
+    while (*line == ' ' || *line == '\t') {
+        line++;
+    }
+    if (defining != NULL) {
+        defineFunctionLine(line);
+        return 0;
+    }
+    if (line[0] == '#') {
+        return 0;
+    }
+    if (strncmp(line, "function", 8) == 0 && (line[8] == '\0' || isspace((unsigned char)line[8]))) {
+        beginFunction(line + 8);
+        return 0;
+    }
+    if (isGroupLine(line)) {
+        runGroupLine(line);
+        return quit_requested;
+    }
+    return runCommand(parseLine(line));
+}
+
+// Points stdin/stdout at the command's redirections for an in-process run (function or source).
+// saved receives the original descriptors for restoreStreams. Returns -1 if a file cannot be opened.
+int redirectStreams(cmdLine *pCmdLine, int saved[2]) {
+    saved[0] = saved[1] = -1;
+    fflush(stdout);
+    if (pCmdLine->inputRedirect) {
+        int fd = open(pCmdLine->inputRedirect, O_RDONLY);
+        if (fd == -1) {
+            perror("open input file failed");
+            return -1;
+        }
+        saved[0] = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    if (pCmdLine->outputRedirect) {
+        int fd = open(pCmdLine->outputRedirect, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror("open output file failed");
+            return -1;
+        }
+        saved[1] = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+    return 0;
+}
+
+void restoreStreams(int saved[2]) {
+    fflush(stdout);
+    for (int i = 0; i < 2; i++) {
+        if (saved[i] != -1) {
+            dup2(saved[i], i);
+            close(saved[i]);
+        }
+    }
+}
+
+// Whether the command can replace the shell: one blocking stage that runs a program
+int canReplaceShell(cmdLine *pCmdLine) {
+    return pCmdLine->next == NULL && pCmdLine->blocking && findBuiltin(pCmdLine->arguments[0]) == NULL &&
+           findFunction(pCmdLine->arguments[0]) == NULL;
+}
+
+// Applies the command's redirections to the shell and execs it without forking. The shutdown
+// work of the atexit handlers is done first, since exec skips them. Returns (with last_status
+// set and the streams restored) only if the command cannot be run; after the point of no
+// return a failing exec ends the shell with status 127, as the command would have.
+void replaceShell(cmdLine *pCmdLine) {
+    const char *path = lookupCommand(pCmdLine->arguments[0]);
+    if (path == NULL && (strchr(pCmdLine->arguments[0], '/') == NULL || access(pCmdLine->arguments[0], X_OK) == -1)) {
+        fprintf(stderr, "%s: %s\n", pCmdLine->arguments[0],
+                strchr(pCmdLine->arguments[0], '/') ? strerror(errno) : "command not found");
+        last_status = 127;
+        return;
+    }
+    int saved[2];
+    if (redirectStreams(pCmdLine, saved) == -1) {
+        restoreStreams(saved);
+        last_status = 1;
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (saved[i] != -1) {
+            close(saved[i]);
+        }
+    }
+
+    metricsStop();
+    joblogShutdown();
+    stopPublishingJobs();
+    historyClose();
+    fflush(NULL);
+    execCommand(pCmdLine, path);
+    perror("exec failed");
+    _exit(127);
+}
+
+// exec cmd [args]: replaces the shell with cmd after applying its redirections. Without a
+// command the redirections are applied to the shell itself and stay in effect.
+void handleExecCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        int saved[2];
+        if (redirectStreams(pCmdLine, saved) == -1) {
+            restoreStreams(saved);
+            last_status = 1;
+            return;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (saved[i] != -1) {
+                close(saved[i]);
+            }
+        }
+        return;
+    }
+    shiftCmdArgs(pCmdLine, 1);
+    if (!canReplaceShell(pCmdLine)) {
+        fprintf(stderr, "exec: %s: only a single program in the foreground can replace the shell\n",
+                pCmdLine->arguments[0]);
+        last_status = 1;
+        return;
+    }
+    replaceShell(pCmdLine);
+}
+
+// Runs a function in the shell process, with the rest of the call's arguments as $1 ...
+void callFunction(function *f, cmdLine *call) {
+    if (call_depth >= CALL_MAX_DEPTH) {
+        fprintf(stderr, "%s: maximum call depth (%d) exceeded\n", f->name, CALL_MAX_DEPTH);
+        last_status = 1;
+        return;
+    }
+    int saved[2];
+    if (redirectStreams(call, saved) == -1) {
+        restoreStreams(saved);
+        last_status = 1;
+        return;
+    }
+
+    frame callFrame = {f->name, call->argCount - 1, call->arguments + 1, current_frame};
+    current_frame = &callFrame;
+    call_depth++;
+    f->refs++; // the body may redefine f (e.g. by sourcing the file it came from)
+    for (int i = 0; i < f->count && !returning && !quit_requested; i++) {
+        if (f->parsed[i] != NULL) {
+            runCommand(expandCmdLines(cloneCmdLines(f->parsed[i])));
+        } else {
+            processLine(f->lines[i]);
+        }
+    }
+    call_depth--;
+    current_frame = callFrame.prev;
+    releaseFunction(f);
+    returning = 0;
+    restoreStreams(saved);
+}
+
+// Runs the steps of a compiled script the way processLine runs the lines they came from
+void runCompiled(compiledScript *script) {
+    int op;
+    const char *text;
+    cmdLine *cmd;
+    while (!returning && !quit_requested && scriptNext(script, &op, &text, &cmd)) {
+        if (op == SCRIPT_OP_FUNCTION) {
+            beginFunction(text);
+        } else if (op == SCRIPT_OP_END) {
+            installFunction();
+        } else if (defining != NULL) {
+            addFunctionLine(text, cmd);
+        } else if (exec_last && call_depth == 1 && scriptAtEnd(script) &&
+                   (cmd != NULL || (strstr(text, "$(") != NULL && !isGroupLine(text)))) {
+            // a wrapper script's final command takes over the process instead of being waited for
+            cmd = cmd != NULL ? expandCmdLines(cmd) : parseLine(text);
+            if (cmd != NULL && canReplaceShell(cmd)) {
+                replaceShell(cmd); // only returns if the command cannot run at all
+                freeCmdLines(cmd);
+            } else {
+                runCommand(cmd);
+            }
+        } else if (cmd != NULL) {
+            runCommand(expandCmdLines(cmd));
+        } else {
+            processLine(text);
+        }
+    }
+}
+
+// Runs the lines of a file in the shell process. With args (argc >= 0) they become $1 ... and
+// name becomes $0; otherwise the caller's parameters stay visible. Returns -1 if it cannot be read.
+int sourceFile(const char *path, const char *name, int argc, char * const *argv) {
+    FILE *f = fopen(path, "re");
+    if (f == NULL) {
+        fprintf(stderr, "source: %s: %s\n", path, strerror(errno));
+        last_status = 1;
+        return -1;
+    }
+    if (call_depth >= CALL_MAX_DEPTH) {
+        fprintf(stderr, "source: maximum call depth (%d) exceeded\n", CALL_MAX_DEPTH);
+        fclose(f);
+        last_status = 1;
+        return -1;
+    }
+
+    frame fileFrame = {name, argc, argv, current_frame};
+    if (argc >= 0) {
+        current_frame = &fileFrame;
+    }
+    call_depth++;
+    compiledScript *compiled = scriptOpen(path);
+    if (compiled != NULL) {
+        runCompiled(compiled);
+        scriptClose(compiled);
+    } else {
+        char line[BUFFER_SIZE];
+        while (!returning && !quit_requested && fgets(line, sizeof(line), f) != NULL) {
+            processLine(line);
+        }
+    }
+    if (defining != NULL) {
+        fprintf(stderr, "source: %s: function %s has no end\n", path, defining->name);
+        defining->next = NULL;
+        freeFunction(defining);
+        defining = NULL;
+    }
+    call_depth--;
+    current_frame = fileFrame.prev;
+    returning = 0;
+    fclose(f);
+    return 0;
+}
+
+// source FILE [args]: runs FILE in this shell, so its functions and settings stay defined
+void handleSourceCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (pCmdLine->argCount < 2) {
+        fprintf(stderr, "usage: source FILE [args]\n");
+        last_status = 1;
+        return;
+    }
+    int saved[2];
+    if (redirectStreams(pCmdLine, saved) == 0) {
+        sourceFile(pCmdLine->arguments[1], pCmdLine->arguments[1],
+                   pCmdLine->argCount > 2 ? pCmdLine->argCount - 2 : -1, pCmdLine->arguments + 2);
+    }
+    restoreStreams(saved);
+}
+
+// return [N]: leaves the running function or sourced file with status N (default: the last status)
+void handleReturnCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    if (call_depth == 0) {
+        fprintf(stderr, "return: not in a function or sourced file\n");
+        last_status = 1;
+        return;
+    }
+    if (pCmdLine->argCount > 1) {
+        last_status = atoi(pCmdLine->arguments[1]);
+    }
+    returning = 1;
+}
+
+void watchSigintHandler(int sig) {
+    watch_interrupted = 1;
+}
+
+// Starts one run of the watched command in a child shell that leads its own process group,
+// so that a cancel reaches every process of the run. *pidfd becomes readable when it exits
+// (-1 if pidfd_open is not available).
+pid_t startWatchRun(cmdLine *cmd, int *pidfd) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("watch: fork failed");
+        return -1;
+    } else if (pid == 0) {
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        job_table = NULL; // the run's commands are not jobs of the interactive shell
+        runCommand(cloneCmdLines(cmd));
+        fflush(stdout);
+        _exit(last_status);
+    }
+    setpgid(pid, pid);
+    *pidfd = -1;
+#ifdef SYS_pidfd_open
+    *pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+    return pid;
+}
+
+// Reaps a finished run; returns its exit code
+int finishWatchRun(pid_t pid, int *pidfd) {
+    int status = 0;
+    waitpid(pid, &status, 0);
+    noteReaped(status);
+    if (*pidfd != -1) {
+        close(*pidfd);
+        *pidfd = -1;
+    }
+    return exitCode(status);
+}
+
+// Cancels a run: SIGTERM to its process group, SIGKILL if it is still there after a second
+void cancelWatchRun(pid_t pid, int *pidfd) {
+    kill(-pid, SIGTERM);
+    if (*pidfd != -1) {
+        struct pollfd pfd = {*pidfd, POLLIN, 0};
+        if (poll(&pfd, 1, 1000) == 0) {
+            kill(-pid, SIGKILL);
+        }
+    }
+    finishWatchRun(pid, pidfd);
+}
+
+// watch [-d MS] -p PATTERN [-p PATTERN ...] command [args]: runs command, then runs it again
+// whenever a path matching a pattern changes. Events are read from inotify, never by scanning
+// the tree; a burst of them starts one run once MS milliseconds pass without another. A change
+// during a run cancels it first. Ctrl-C ends the watch.
+void handleWatchCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    char *patterns[WATCH_MAX_PATTERNS];
+    int count = 0;
+    int debounce = WATCH_DEBOUNCE_MS;
+    int i = 1;
+    for (; i + 1 < pCmdLine->argCount && pCmdLine->arguments[i][0] == '-'; i += 2) {
+        if (strcmp(pCmdLine->arguments[i], "-p") == 0 && count < WATCH_MAX_PATTERNS) {
+            patterns[count++] = pCmdLine->arguments[i + 1];
+        } else if (strcmp(pCmdLine->arguments[i], "-d") == 0) {
+            debounce = atoi(pCmdLine->arguments[i + 1]);
+        } else {
+            break;
+        }
+    }
+    if (count == 0 || i >= pCmdLine->argCount) {
+        fprintf(stderr, "usage: watch [-d MS] -p PATTERN [-p PATTERN ...] command [args]\n");
+        last_status = 1;
+        return;
+    }
+
+    watchSet *set = watchOpen(patterns, count);
+    if (set == NULL) {
+        perror("watch: inotify failed");
+        last_status = 1;
+        return;
+    }
+    // The whole chain runs in the watch's child, so "watch -p x make | tee log" keeps the tee
+    cmdLine *cmd = cloneCmdLines(pCmdLine);
+    for (cmdLine *curr = cmd; curr != NULL; curr = curr->next) {
+        curr->blocking = 1;
+    }
+    shiftCmdArgs(cmd, i);
+
+    struct sigaction sa, old;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchSigintHandler; // no SA_RESTART: Ctrl-C has to interrupt poll
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+    watch_interrupted = 0;
+
+    int pidfd = -1;
+    int changed = 0;
+    pid_t pid = startWatchRun(cmd, &pidfd);
+    while (!watch_interrupted) {
+        struct pollfd fds[2] = {{watchFd(set), POLLIN, 0}, {pidfd, POLLIN, 0}};
+        int ready = poll(fds, pidfd != -1 ? 2 : 1, changed ? debounce : -1);
+        if (ready == -1 && errno != EINTR) {
+            perror("watch: poll failed");
+            break;
+        } else if (ready == 0) {
+            // the burst of changes is over
+            if (pid > 0) {
+                fprintf(stderr, "watch: change detected, cancelling the running command\n");
+                cancelWatchRun(pid, &pidfd);
+            }
+            changed = 0;
+            pid = startWatchRun(cmd, &pidfd);
+            continue;
+        } else if (ready == -1) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            changed += watchRead(set);
+        }
+        if (pid > 0 && (pidfd == -1 || (fds[1].revents & POLLIN))) {
+            int status = 0;
+            // without a pidfd the run is only checked for when an event wakes us up
+            if (pidfd != -1 || waitpid(pid, &status, WNOHANG) == pid) {
+                last_status = pidfd != -1 ? finishWatchRun(pid, &pidfd) : exitCode(status);
+                pid = 0;
+                fprintf(stderr, "watch: exit status %d, waiting for changes\n", last_status);
+            }
+        }
+    }
+
+    if (pid > 0) {
+        cancelWatchRun(pid, &pidfd);
+    }
+    sigaction(SIGINT, &old, NULL);
+    watchClose(set);
+    freeCmdLines(cmd);
+}
+
+// quit is normally taken by runCommand before execute; this only marks it as a builtin
+void handleQuitCommand(cmdLine *pCmdLine, FILE *in, FILE *out) {
+    quit_requested = 1;
+}
+
+const builtin builtins[] = {
+    {"cd", handleCdCommand, 0},
+    {"alarm", handleAlarmCommand, BUILTIN_STAGE | BUILTIN_READS_INPUT},
+    {"blast", handleBlastCommand, BUILTIN_STAGE | BUILTIN_READS_INPUT},
+    {"sleep", handleSleepCommand, BUILTIN_STAGE | BUILTIN_READS_INPUT},
+    {"procs", handleProcsCommand, BUILTIN_STAGE},
+    {"history", handleHistoryCommand, BUILTIN_STAGE},
+    {"hash", handleHashCommand, BUILTIN_STAGE},
+    {"logs", handleLogsCommand, BUILTIN_STAGE},
+    {"optimize", handleOptimizeCommand, 0},
+    {"explain", handleExplainCommand, BUILTIN_PREFIX | BUILTIN_CONSUMES},
+    {"memo", handleMemoCommand, BUILTIN_PREFIX | BUILTIN_CONSUMES},
+    {"metrics", handleMetricsCommand, 0},
+    {"joblog", handleJobLogCommand, 0},
+    {"jobtable", handleJobTableCommand, 0},
+    {"glob", handleGlobCommand, 0},
+    {"source", handleSourceCommand, 0},
+    {"return", handleReturnCommand, 0},
+    {"watch", handleWatchCommand, BUILTIN_PREFIX},
+    {"batch", handleBatchCommand, BUILTIN_PREFIX},
+    {"exec", handleExecCommand, BUILTIN_PREFIX},
+    {"iohint", handleIoHintCommand, BUILTIN_PREFIX | BUILTIN_CONSUMES},
+    {"bench", handleBenchCommand, BUILTIN_PREFIX | BUILTIN_CONSUMES},
+    {"pipestat", handlePipeStatCommand, BUILTIN_PREFIX | BUILTIN_CONSUMES},
+    {"pipesize", handlePipeSizeCommand, BUILTIN_PREFIX | BUILTIN_CONSUMES},
+    {"quit", handleQuitCommand, 0},
+    {NULL, NULL, 0}
+};
+
+const builtin *findBuiltin(const char *name) {
+    for (const builtin *b = builtins; b->name != NULL; b++) {
+        if (strcmp(b->name, name) == 0) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Runs a chain that is not a builtin or a function call: a pipeline (whose stages may still be
+// builtins, see spawnPipeline) or a single program. Consumes pCmdLine.
+void runCommands(cmdLine *pCmdLine, long pipeSize) {
+    if (optimize && pCmdLine->next) {
+        optimizeCmdLines(&pCmdLine, debug ? stderr : NULL);
+    }
+
+    if (pCmdLine->next) {
+        executePipeCommands(pCmdLine, pipeSize);
+    } else if (!runBuiltinCat(pCmdLine)) {
+        executeSingleCommand(pCmdLine);
+    }
+}
+
+void execute(cmdLine *pCmdLine) {
+    // A builtin that starts a pipeline only runs on its own if it takes the pipeline as its command
+    const builtin *b = findBuiltin(pCmdLine->arguments[0]);
+    if (b != NULL && (pCmdLine->next == NULL || (b->flags & BUILTIN_PREFIX))) {
+        b->run(pCmdLine, NULL, stdout);
+        if (!(b->flags & BUILTIN_CONSUMES)) {
+            freeCmdLines(pCmdLine);
+        }
+        return;
+    }
+
+    function *f = pCmdLine->next == NULL ? findFunction(pCmdLine->arguments[0]) : NULL;
+    if (f != NULL) {
+        callFunction(f, pCmdLine);
+        freeCmdLines(pCmdLine);
+        return;
+    }
+
+    runCommands(pCmdLine, pipe_size);
+}
+
+// Parses and runs one command line; returns its exit status
+int runCommandLine(const char *line) {
+    last_status = 0;
+    processLine(line);
+    return last_status;
+}
+
+// Waits until fd is readable; returns -1 on error or once deadline (in monotonicNs time) has passed
+int waitReadable(int fd, long long deadline) {
+    while (1) {
+        long long left = (deadline - monotonicNs()) / 1000000;
+        if (left <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        struct pollfd ready = {fd, POLLIN, 0};
+        int n = poll(&ready, 1, (int)left);
+        if (n > 0) {
+            return 0;
+        } else if (n == -1 && errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// Reads exactly len bytes before deadline; returns -1 on error, early EOF or timeout
+int readFully(int fd, char *buf, size_t len, long long deadline) {
+    while (len > 0) {
+        if (waitReadable(fd, deadline) == -1) {
+            return -1;
+        }
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Receives one request (see Serve.h). On success fds holds the client's stdin/stdout/stderr and
+// *request the payload (to be freed by the caller). Returns the payload length, or -1.
+// The daemon takes one connection at a time, so a client that does not send its whole request
+// within SERVE_REQUEST_TIMEOUT_MS is dropped rather than waited for.
+int receiveRequest(int conn, int fds[SERVE_FDS], char **request) {
+    unsigned int len = 0;
+    char control[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    long long deadline = monotonicNs() + SERVE_REQUEST_TIMEOUT_MS * 1000000LL;
+    if (waitReadable(conn, deadline) == -1 || recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT) != sizeof(len)) {
+        return -1;
+    }
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(SERVE_FDS * sizeof(int))) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), SERVE_FDS * sizeof(int));
+
+    if (len == 0 || len > SERVE_MAX_REQUEST || (*request = (char *)malloc(len + 1)) == NULL) {
+        return -1;
+    }
+    if (readFully(conn, *request, len, deadline) == -1) {
+        free(*request);
+        return -1;
+    }
+    (*request)[len] = '\0';
+    return len;
+}
+
+// Runs one client request. The command's programs are resolved here, in the daemon, so the PATH
+// cache stays warm across requests; the command itself runs in a forked worker that takes over the
+// client's fds, cwd and environment and reports the exit status back on the connection.
+void serveClient(int conn) {
+    int fds[SERVE_FDS];
+    char *request;
+    struct ucred peer;
+    socklen_t peerLen = sizeof(peer);
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &peerLen) == -1 || peer.uid != getuid()) {
+        close(conn);
+        return;
+    }
+    int len = receiveRequest(conn, fds, &request);
+    if (len == -1) {
+        close(conn);
+        return;
+    }
+
+    const char *cwd = request;
+    const char *line = cwd + strlen(cwd) + 1;
+    if (debug) {
+        fprintf(stderr, "serve: pid %d in %s: %s\n", peer.pid, cwd, line);
+    }
+
+    // Warm the cache with the client's PATH before the worker forks
+    const char *env = line + strlen(line) + 1;
+    for (const char *var = env; var < request + len; var += strlen(var) + 1) {
+        if (strncmp(var, "PATH=", 5) == 0) {
+            setenv("PATH", var + 5, 1);
+            cmdLine *cmd = parseCmdLines(line);
+            for (cmdLine *curr = cmd; curr != NULL; curr = curr->next) {
+                lookupCommand(curr->arguments[0]);
+            }
+            freeCmdLines(cmd);
+        }
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The daemon's dispositions must not leak into the commands it runs (ignored ones survive exec)
+        signal(SIGCHLD, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        for (int i = 0; i < SERVE_FDS; i++) {
+            dup2(fds[i], i);
+        }
+        clearenv();
+        for (const char *var = env; var < request + len; var += strlen(var) + 1) {
+            putenv((char *)var);
+        }
+        int status = 1;
+        if (chdir(cwd) == -1) {
+            perror("cd failed");
+        } else {
+            status = runCommandLine(line);
+        }
+        fflush(stdout);
+        write(conn, &status, sizeof(status));
+        _exit(0);
+    } else if (pid == -1) {
+        perror("fork failed");
+    }
+
+    for (int i = 0; i < SERVE_FDS; i++) {
+        close(fds[i]);
+    }
+    close(conn);
+    free(request);
+}
+
+// myshell --serve PATH: runs command lines sent by myshell-client until killed
+int serveCommands(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "serve: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    // Only a stale socket (e.g. left by a daemon that was killed) is replaced, never some other file
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(0077); // the socket is only for the current user
+    if (sock == -1 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 64) == -1) {
+        perror("serve failed");
+        return 1;
+    }
+    umask(mask);
+    signal(SIGCHLD, SIG_IGN); // workers are never waited for
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // out of fds or memory for now: the connection stays queued, so back off and retry
+                poll(NULL, 0, SERVE_RETRY_MS);
+                continue;
+            }
+            perror("accept failed");
+            break;
+        }
+        serveClient(conn);
+    }
+    close(sock);
+    unlink(path);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    int script = 0;
+
+    // Check for debug and optimizer flags
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
+            debug = 1;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            optimize = 1;
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            // -m PATH exports metrics every 15 seconds (the metrics builtin can change this later)
+            if (metricsStart(argv[++i], 15) == 0) {
+                installSigchldHandler();
+            }
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            return serveCommands(argv[i + 1]);
+        } else if (argv[i][0] != '-') {
+            script = i; // myshell [flags] SCRIPT [args]: the rest belongs to the script
+            break;
+        }
+    }
+    atexit(metricsStop); // the last snapshot is also written when the shell exits on a fatal error
+    atexit(joblogShutdown);
+    job_table = jobtableCreate(); // failing to publish (e.g. no /dev/shm) is not fatal
+    atexit(stopPublishingJobs);
+
+    if (script > 0) {
+        exec_last = 1;
+        sourceFile(argv[script], argv[script], argc - script - 1, argv + script + 1);
+        freeProcessList(process_list);
+        return last_status;
+    }
+
+    historyOpen(NULL);
+    atexit(historyClose);
+
+    while (1) {
+        mergeHistory();
+        collectBatchJobs();
+        if (defining != NULL) {
+            printf("> "); // inside a function definition
+        } else {
+            displayPrompt();
+        }
+
+        char *input = readInput();
+        if (input == NULL) {
+            break;
         }
 
         // Handle "!!" command
@@ -434,17 +3497,9 @@ int main(int argc, char **argv) {
         }
          addToHistory(input);
 
-        cmdLine *cmd = parseCmdLines(input);
-        if (cmd == NULL) {
-            continue;
-        }
-
-        if (strcmp(cmd->arguments[0], "quit") == 0) {
-            freeCmdLines(cmd);
+        if (processLine(input)) {
             break;
         }
-
-        execute(cmd);
     }
     freeProcessList(process_list);
     return 0;
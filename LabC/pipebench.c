@@ -0,0 +1,195 @@
+// pipebench: measures how the capacity of a pipe affects a bulk producer | consumer pair.
+// A writer child pushes a fixed amount of data through the pipe to a reader child, and the
+// context switches of both (from wait4's rusage) are reported per GB moved.
+//
+// usage: pipebench [-m MiB] [size ...]
+// each size is default, max, adaptive or a byte count with an optional K/M suffix (as for myshell's
+// pipesize). adaptive starts at the default and doubles the pipe whenever the writer stalls on a full
+// one, sampling its fill level the way myshell's monitorPipeline does; the size it ended at is shown.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define CHUNK (1024 * 1024)
+#define DEFAULT_MIB 2048
+#define SIZE_ADAPTIVE -1
+#define SIZE_INVALID -2
+#define ADAPTIVE_SAMPLE_US 2000    // as in myshell
+
+long readPipeMaxSize() {
+    long max = 1024 * 1024;
+    FILE *f = fopen("/proc/sys/fs/pipe-max-size", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%ld", &max) != 1) {
+            max = 1024 * 1024;
+        }
+        fclose(f);
+    }
+    return max;
+}
+
+// Returns the size in bytes, 0 for default, SIZE_ADAPTIVE, or SIZE_INVALID
+long parseSize(const char *spec) {
+    if (strcmp(spec, "default") == 0) {
+        return 0;
+    } else if (strcmp(spec, "max") == 0) {
+        return readPipeMaxSize();
+    } else if (strcmp(spec, "adaptive") == 0) {
+        return SIZE_ADAPTIVE;
+    }
+    char *end;
+    errno = 0;
+    long long size = strtoll(spec, &end, 10);
+    if (end == spec || size <= 0 || errno == ERANGE) {
+        return SIZE_INVALID;
+    }
+    if (*end == 'K' || *end == 'k') {
+        size = size > INT_MAX / 1024 ? (long long)INT_MAX + 1 : size * 1024;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        size = size > INT_MAX / (1024 * 1024) ? (long long)INT_MAX + 1 : size * 1024 * 1024;
+        end++;
+    }
+    // F_SETPIPE_SZ takes an int
+    return *end == '\0' && size <= INT_MAX ? size : SIZE_INVALID;
+}
+
+void runWriter(int fd, long long total) {
+    char *buf = malloc(CHUNK);
+    memset(buf, 'x', CHUNK);
+    while (total > 0) {
+        ssize_t n = write(fd, buf, total < CHUNK ? total : CHUNK);
+        if (n <= 0) {
+            _exit(1);
+        }
+        total -= n;
+    }
+    _exit(0);
+}
+
+void runReader(int fd) {
+    char *buf = malloc(CHUNK);
+    while (read(fd, buf, CHUNK) > 0) {
+    }
+    _exit(0);
+}
+
+// Waits for the pair while doubling the pipe (up to pipe-max-size) whenever it is nearly full,
+// i.e. the writer is stalled on the reader; monitor is a read end kept by the parent for sampling
+void adaptUntilDone(int monitor, pid_t writer, pid_t reader, struct rusage *wusage, struct rusage *rusage) {
+    long max = readPipeMaxSize();
+    int alive = 2;
+    while (alive > 0) {
+        if (writer > 0 && wait4(writer, NULL, WNOHANG, wusage) == writer) {
+            writer = 0;
+            alive--;
+        }
+        if (reader > 0 && wait4(reader, NULL, WNOHANG, rusage) == reader) {
+            reader = 0;
+            alive--;
+        }
+        int queued = 0;
+        long capacity = fcntl(monitor, F_GETPIPE_SZ);
+        if (ioctl(monitor, FIONREAD, &queued) == 0 && capacity > 0 && capacity < max &&
+            queued >= capacity - PIPE_BUF) {
+            fcntl(monitor, F_SETPIPE_SZ, capacity * 2 < max ? capacity * 2 : max);
+        }
+        if (alive > 0) {
+            usleep(ADAPTIVE_SAMPLE_US);
+        }
+    }
+}
+
+void bench(long size, long long total) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("pipe failed");
+        exit(1);
+    }
+    long capacity = fcntl(pipefd[1], F_GETPIPE_SZ);
+    if (size > 0) {
+        capacity = fcntl(pipefd[1], F_SETPIPE_SZ, size);
+        if (capacity == -1) {
+            perror("F_SETPIPE_SZ failed");
+            capacity = fcntl(pipefd[1], F_GETPIPE_SZ);
+        }
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t writer = fork();
+    if (writer == 0) {
+        close(pipefd[0]);
+        runWriter(pipefd[1], total);
+    }
+    pid_t reader = fork();
+    if (reader == 0) {
+        close(pipefd[1]);
+        runReader(pipefd[0]);
+    }
+    close(pipefd[1]);
+
+    struct rusage wusage, rusage;
+    char label[32];
+    if (size == SIZE_ADAPTIVE) {
+        adaptUntilDone(pipefd[0], writer, reader, &wusage, &rusage);
+        snprintf(label, sizeof(label), "adaptive %dK", fcntl(pipefd[0], F_GETPIPE_SZ) / 1024);
+    } else {
+        wait4(writer, NULL, 0, &wusage);
+        wait4(reader, NULL, 0, &rusage);
+        snprintf(label, sizeof(label), "%ld", capacity);
+    }
+    close(pipefd[0]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double gb = (double)total / (1024.0 * 1024.0 * 1024.0);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long switches = wusage.ru_nvcsw + wusage.ru_nivcsw + rusage.ru_nvcsw + rusage.ru_nivcsw;
+    printf("%14s %14.0f %14.0f %10.2f\n", label, switches / gb,
+           (wusage.ru_nvcsw + rusage.ru_nvcsw) / gb, gb / secs);
+}
+
+int main(int argc, char **argv) {
+    long long mib = DEFAULT_MIB;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-m") == 0) {
+        mib = atoll(argv[2]);
+        first = 3;
+    }
+    if (mib <= 0 || mib > LLONG_MAX / (1024 * 1024)) {
+        fprintf(stderr, "pipebench: invalid size -m %s\n", argv[2]);
+        return 1;
+    }
+    for (int i = first; i < argc; i++) {
+        if (parseSize(argv[i]) == SIZE_INVALID) {
+            fprintf(stderr, "pipebench: invalid pipe size '%s' (expected default, max, adaptive or bytes[K|M])\n",
+                    argv[i]);
+            return 1;
+        }
+    }
+    long long total = mib * 1024 * 1024;
+
+    printf("%14s %14s %14s %10s\n", "pipe size", "ctxsw/GB", "voluntary/GB", "GB/s");
+    if (first >= argc) {
+        bench(0, total);
+        bench(256 * 1024, total);
+        bench(readPipeMaxSize(), total);
+        bench(SIZE_ADAPTIVE, total);
+    }
+    for (int i = first; i < argc; i++) {
+        bench(parseSize(argv[i]), total);
+    }
+    return 0;
+}
@@ -0,0 +1,405 @@
+// stress: drives an interactive myshell with thousands of looper jobs to see how the job table
+// and the reaping path scale. The shell runs on a pseudo-terminal (so it prompts and flushes
+// exactly as it does for a user) and every command waits for the next prompt. After starting
+// the loopers in the background, each round throws a storm of sleep (SIGTSTP), alarm (SIGCONT)
+// and blast (SIGKILL) commands at random loopers, with procs in between, and then keeps calling
+// procs until every change shows up. Reported are the latency of each kind of command, the time
+// from a signal to the first procs that shows its effect, the CPU time the shell itself used,
+// and the number of loopers whose state was wrong once it had been noticed.
+//
+// usage: stress [-n LOOPERS] [-r ROUNDS] [-b SIGNALS] [-s SHELL] [-l LOOPER]
+// exits with 1 if a change was never noticed or a noticed state did not stick.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <linux/limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "Bench.h"
+
+#define DEFAULT_LOOPERS 2000
+#define DEFAULT_ROUNDS 20
+#define DEFAULT_SIGNALS 200
+#define PROCS_EVERY 10          // a procs after this many signal commands
+#define BLAST_PERCENT 5         // share of the signals that kill
+#define REPLY_TIMEOUT_MS 10000  // the shell is considered hung after this
+#define SETTLE_TIMEOUT_MS 5000  // a change not shown by procs within this is missed
+
+#define RUNNING 1
+#define SUSPENDED 0
+#define TERMINATED -1
+
+typedef struct looper {
+    pid_t pid;
+    int expected;               // the state procs should show
+    int pending;                // signalled, but procs has not shown it yet
+    int seen;                   // round of procs that last listed it
+    double signalledAt;
+} looper;
+
+typedef struct samples {
+    double *values;
+    int count, cap;
+} samples;
+
+pid_t shell_pid = -1;
+int pty = -1;
+char prompt[PATH_MAX + 2];
+char *reply = NULL;
+size_t reply_len = 0, reply_cap = 0;
+
+looper *loopers = NULL;
+int looper_count = 0;
+
+samples launch_latency, signal_latency, procs_latency, notice_latency;
+int regressions = 0, lost = 0, missed = 0;
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void addSample(samples *s, double value) {
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->values = realloc(s->values, sizeof(double) * s->cap);
+    }
+    s->values[s->count++] = value;
+}
+
+// Kills whatever is left, so that a failed run does not leave thousands of loopers behind
+void cleanup() {
+    for (int i = 0; i < looper_count; i++) {
+        if (loopers[i].expected != TERMINATED) {
+            kill(loopers[i].pid, SIGKILL);
+        }
+    }
+    if (shell_pid > 0) {
+        kill(shell_pid, SIGKILL);
+        waitpid(shell_pid, NULL, 0);
+        shell_pid = -1;
+    }
+}
+
+void fail(const char *message) {
+    fprintf(stderr, "stress: %s\n", message);
+    cleanup();
+    exit(2);
+}
+
+// user + system time of the shell so far, in seconds
+double shellCpu() {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", shell_pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return 0;
+    }
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// Starts the shell with a raw pseudo-terminal as stdin and stdout; stderr stays ours
+void startShell(const char *shell, const char *history) {
+    pty = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (pty == -1 || grantpt(pty) == -1 || unlockpt(pty) == -1) {
+        fail("cannot open a pseudo-terminal");
+    }
+    int slave = open(ptsname(pty), O_RDWR | O_NOCTTY);
+    if (slave == -1) {
+        fail("cannot open the terminal side of the pseudo-terminal");
+    }
+    struct termios raw;
+    tcgetattr(slave, &raw);
+    cfmakeraw(&raw); // no echo and no line editing: the output is exactly what the shell wrote
+    tcsetattr(slave, TCSANOW, &raw);
+
+    shell_pid = fork();
+    if (shell_pid == -1) {
+        fail("fork failed");
+    } else if (shell_pid == 0) {
+        dup2(slave, STDIN_FILENO);
+        dup2(slave, STDOUT_FILENO);
+        close(slave);
+        setenv("MYSHELL_HISTFILE", history, 1); // thousands of commands stay out of the real history
+        execl(shell, shell, (char *)NULL);
+        perror("stress: exec failed");
+        _exit(127);
+    }
+    close(slave);
+}
+
+// Reads until the shell prompts again. The reply holds what was printed before the prompt
+void awaitPrompt() {
+    reply_len = 0;
+    for (;;) {
+        if (reply_cap - reply_len < 65536) {
+            reply_cap = reply_cap ? reply_cap * 2 : 262144;
+            reply = realloc(reply, reply_cap);
+        }
+        struct pollfd pfd = {pty, POLLIN, 0};
+        int ready = poll(&pfd, 1, REPLY_TIMEOUT_MS);
+        if (ready == 0) {
+            fail("the shell stopped answering");
+        }
+        ssize_t n = read(pty, reply + reply_len, reply_cap - reply_len - 1);
+        if (n <= 0) {
+            fail("the shell exited");
+        }
+        reply_len += n;
+        reply[reply_len] = '\0';
+
+        size_t plen = strlen(prompt);
+        if (reply_len >= plen && strcmp(reply + reply_len - plen, prompt) == 0) {
+            reply_len -= plen;
+            reply[reply_len] = '\0';
+            return;
+        }
+    }
+}
+
+// Sends one command and waits for the prompt after it; returns how long that took
+double command(const char *line) {
+    char buf[PATH_MAX + 64];
+    int len = snprintf(buf, sizeof(buf), "%s\n", line);
+    double start = now();
+    if (write(pty, buf, len) != len) {
+        fail("cannot write to the shell");
+    }
+    awaitPrompt();
+    return now() - start;
+}
+
+int compareLoopers(const void *a, const void *b) {
+    return ((const looper *)a)->pid - ((const looper *)b)->pid;
+}
+
+looper *findLooper(pid_t pid) {
+    looper key = {.pid = pid};
+    return bsearch(&key, loopers, looper_count, sizeof(looper), compareLoopers);
+}
+
+// Runs procs and compares what it lists with what each looper should be by now
+void procs(int round) {
+    addSample(&procs_latency, command("procs"));
+    double shown = now();
+
+    char *line = reply;
+    while (line != NULL && *line) {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        int pid;
+        char state[16];
+        looper *l;
+        if (sscanf(line, "%d %*s %15s", &pid, state) == 2 && (l = findLooper(pid)) != NULL) {
+            int status = strcmp(state, "Running") == 0 ? RUNNING :
+                         (strcmp(state, "Suspended") == 0 ? SUSPENDED : TERMINATED);
+            l->seen = round;
+            if (l->pending && status == l->expected) {
+                addSample(&notice_latency, shown - l->signalledAt);
+                l->pending = 0;
+            } else if (!l->pending && status != l->expected) {
+                regressions++;
+            }
+        }
+        line = next;
+    }
+
+    for (int i = 0; i < looper_count; i++) {
+        looper *l = &loopers[i];
+        if (l->seen == round || (l->expected == TERMINATED && !l->pending)) {
+            continue;
+        }
+        // procs forgets a job right after listing it as terminated
+        if (l->pending && l->expected == TERMINATED) {
+            addSample(&notice_latency, shown - l->signalledAt);
+            l->pending = 0;
+        } else if (!l->pending) {
+            lost++;
+            l->expected = TERMINATED;
+        }
+    }
+}
+
+void launch(const char *looperPath, int count) {
+    char line[PATH_MAX + 32];
+    snprintf(line, sizeof(line), "%s > /dev/null &", looperPath);
+    for (int i = 0; i < count; i++) {
+        addSample(&launch_latency, command(line));
+    }
+
+    // the pids come from the shell's own list
+    command("procs");
+    loopers = calloc(count, sizeof(looper));
+    char *p = reply;
+    while (p != NULL && *p && looper_count < count) {
+        int pid;
+        char name[PATH_MAX];
+        if (sscanf(p, "%d %4095s", &pid, name) == 2 && strcmp(name, looperPath) == 0) {
+            loopers[looper_count].pid = pid;
+            loopers[looper_count].expected = RUNNING;
+            looper_count++;
+        }
+        p = strchr(p, '\n');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    qsort(loopers, looper_count, sizeof(looper), compareLoopers);
+    if (looper_count < count) {
+        fprintf(stderr, "stress: only %d of %d loopers started\n", looper_count, count);
+    }
+}
+
+// One storm: each picked looper gets a single signal, so what procs should show is unambiguous
+void storm(int round, int signals) {
+    int sent = 0;
+    for (int tries = 0; sent < signals && tries < signals * 10; tries++) {
+        looper *l = &loopers[random() % looper_count];
+        if (l->expected == TERMINATED || l->pending) {
+            continue;
+        }
+        char line[64];
+        if (random() % 100 < BLAST_PERCENT) {
+            snprintf(line, sizeof(line), "blast %d", l->pid);
+            l->expected = TERMINATED;
+        } else if (l->expected == RUNNING) {
+            snprintf(line, sizeof(line), "sleep %d", l->pid);
+            l->expected = SUSPENDED;
+        } else {
+            snprintf(line, sizeof(line), "alarm %d", l->pid);
+            l->expected = RUNNING;
+        }
+        addSample(&signal_latency, command(line));
+        l->signalledAt = now();
+        l->pending = 1;
+        if (++sent % PROCS_EVERY == 0) {
+            procs(round);
+        }
+    }
+
+    double deadline = now() + SETTLE_TIMEOUT_MS / 1000.0;
+    for (;;) {
+        procs(round);
+        int pending = 0;
+        for (int i = 0; i < looper_count; i++) {
+            pending += loopers[i].pending;
+        }
+        if (pending == 0) {
+            break;
+        }
+        if (now() > deadline) {
+            for (int i = 0; i < looper_count; i++) {
+                loopers[i].pending = 0;
+            }
+            missed += pending;
+            break;
+        }
+    }
+}
+
+void report(const char *name, samples *s) {
+    benchStats stats;
+    if (s->count == 0) {
+        return;
+    }
+    benchSummarize(s->values, s->count, &stats);
+    printf("%-16s %8d %10.3f %10.3f %10.3f %10.3f\n", name, stats.n, stats.median * 1e3, stats.mean * 1e3,
+           stats.p99 * 1e3, stats.max * 1e3);
+}
+
+int main(int argc, char **argv) {
+    int count = DEFAULT_LOOPERS, rounds = DEFAULT_ROUNDS, signals = DEFAULT_SIGNALS;
+    const char *shell = "./myshell", *looperPath = "./looper";
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:b:s:l:")) != -1) {
+        if (opt == 'n') {
+            count = atoi(optarg);
+        } else if (opt == 'r') {
+            rounds = atoi(optarg);
+        } else if (opt == 'b') {
+            signals = atoi(optarg);
+        } else if (opt == 's') {
+            shell = optarg;
+        } else if (opt == 'l') {
+            looperPath = optarg;
+        } else {
+            fprintf(stderr, "usage: stress [-n LOOPERS] [-r ROUNDS] [-b SIGNALS] [-s SHELL] [-l LOOPER]\n");
+            return 2;
+        }
+    }
+    if (count < 1 || access(looperPath, X_OK) == -1 || access(shell, X_OK) == -1) {
+        fprintf(stderr, "stress: needs at least one looper and both %s and %s\n", shell, looperPath);
+        return 2;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("getcwd failed");
+        return 2;
+    }
+    snprintf(prompt, sizeof(prompt), "%s> ", cwd);
+    char history[] = "/tmp/stress-history-XXXXXX";
+    int hfd = mkstemp(history);
+    if (hfd == -1) {
+        perror("mkstemp failed");
+        return 2;
+    }
+    close(hfd);
+    signal(SIGPIPE, SIG_IGN);
+    srandom(getpid());
+
+    startShell(shell, history);
+    awaitPrompt();
+
+    double start = now(), cpu = shellCpu();
+    launch(looperPath, count);
+    double launchSecs = now() - start, launchCpu = shellCpu() - cpu;
+
+    start = now();
+    cpu = shellCpu();
+    for (int round = 1; round <= rounds && looper_count > 0; round++) {
+        storm(round, signals);
+    }
+    double stormSecs = now() - start, stormCpu = shellCpu() - cpu;
+
+    int alive = 0;
+    for (int i = 0; i < looper_count; i++) {
+        alive += loopers[i].expected != TERMINATED;
+    }
+    printf("%d loopers, %d rounds of %d signals, %d loopers left\n\n", looper_count, rounds, signals, alive);
+    printf("%-16s %8s %10s %10s %10s %10s\n", "latency (ms)", "count", "median", "mean", "p99", "max");
+    report("launch", &launch_latency);
+    report("signal", &signal_latency);
+    report("procs", &procs_latency);
+    report("change noticed", &notice_latency);
+    printf("\nshell CPU: %.2f s to launch (%.1f%% of %.2f s), %.2f s in the storms (%.1f%% of %.2f s)\n",
+           launchCpu, 100 * launchCpu / launchSecs, launchSecs, stormCpu, 100 * stormCpu / stormSecs, stormSecs);
+    printf("changes never noticed: %d, noticed states that did not stick: %d, jobs that vanished: %d\n",
+           missed, regressions, lost);
+
+    cleanup();
+    unlink(history);
+    return missed || regressions || lost ? 1 : 0;
+}